@@ -0,0 +1,444 @@
+#include "AnalysisServer.hh"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <format>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <thread>
+
+AnalysisServer::Client::Client(int fd, uint64_t client_id) : fd(fd), client_id(client_id) {}
+
+bool AnalysisServer::Client::send(const std::string& data) {
+  std::lock_guard<std::mutex> g(this->write_lock);
+  size_t offset = 0;
+  while (!this->disconnected && (offset < data.size())) {
+    // MSG_NOSIGNAL prevents SIGPIPE if the client has gone away
+    ssize_t bytes = ::send(this->fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+    if (bytes > 0) {
+      offset += bytes;
+    } else if ((bytes < 0) && (errno != EINTR)) {
+      this->disconnected = true;
+    }
+  }
+  return !this->disconnected;
+}
+
+AnalysisServer::AnalysisServer(AnalysisShell& shell, const std::string& socket_path)
+    : shell(shell),
+      socket_path(socket_path) {
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  if (this->socket_path.size() >= sizeof(sa.sun_path)) {
+    throw std::invalid_argument("Socket path is too long");
+  }
+  sa.sun_family = AF_UNIX;
+  memcpy(sa.sun_path, this->socket_path.data(), this->socket_path.size());
+
+  this->listen_fd = phosg::scoped_fd(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (this->listen_fd < 0) {
+    throw std::runtime_error(std::format("Cannot create socket: {}", strerror(errno)));
+  }
+  // If a previous server didn't exit cleanly, its socket file would prevent bind() from succeeding
+  unlink(this->socket_path.c_str());
+  if (bind(this->listen_fd, reinterpret_cast<const struct sockaddr*>(&sa), sizeof(sa)) != 0) {
+    throw std::runtime_error(std::format("Cannot bind to {}: {}", this->socket_path, strerror(errno)));
+  }
+  if (listen(this->listen_fd, 16) != 0) {
+    throw std::runtime_error(std::format("Cannot listen on {}: {}", this->socket_path, strerror(errno)));
+  }
+
+  this->log = fdopen(dup(STDERR_FILENO), "w");
+  if (!this->log) {
+    throw std::runtime_error(std::format("Cannot open log stream: {}", strerror(errno)));
+  }
+  setvbuf(this->log, nullptr, _IOLBF, 0);
+}
+
+AnalysisServer::~AnalysisServer() {
+  unlink(this->socket_path.c_str());
+  fclose(this->log);
+}
+
+void AnalysisServer::run() {
+  phosg::fwrite_fmt(this->log, "Listening on {}\n", this->socket_path);
+
+  std::thread dispatcher_thread(&AnalysisServer::dispatch_requests, this);
+  std::string error;
+  for (;;) {
+    int fd = accept(this->listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) {
+        continue;
+      }
+      if ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOBUFS) || (errno == ENOMEM)) {
+        // These may clear up when other clients disconnect
+        phosg::fwrite_fmt(this->log, "Cannot accept connection: {}\n", strerror(errno));
+        usleep(100000);
+        continue;
+      }
+      error = std::format("Cannot accept connection: {}", strerror(errno));
+      break;
+    }
+    auto c = std::make_shared<Client>(fd, this->next_client_id++);
+    phosg::fwrite_fmt(this->log, "Client {} connected\n", c->client_id);
+    std::thread(&AnalysisServer::handle_client, this, c).detach();
+  }
+
+  // The dispatcher thread must be joined before this throws, or std::thread's destructor would terminate the process
+  {
+    std::lock_guard<std::mutex> g(this->queue_lock);
+    this->stopping = true;
+    this->queue_cv.notify_all();
+  }
+  dispatcher_thread.join();
+  throw std::runtime_error(error);
+}
+
+void AnalysisServer::handle_client(std::shared_ptr<Client> c) {
+  std::string buffer;
+  for (;;) {
+    char data[0x1000];
+    ssize_t bytes = read(c->fd, data, sizeof(data));
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // The connection is broken, so there's nobody to send results to
+      c->disconnected = true;
+      break;
+    } else if (bytes == 0) {
+      // The client may have only shut down its write side, so finish running the requests it already sent
+      break;
+    }
+    buffer.append(data, bytes);
+
+    size_t line_end;
+    while ((line_end = buffer.find('\n')) != std::string::npos) {
+      std::string line = buffer.substr(0, line_end);
+      buffer.erase(0, line_end + 1);
+      phosg::strip_whitespace(line);
+      if (line.empty()) {
+        continue;
+      }
+
+      size_t space_pos = line.find(' ');
+      std::string request_id = line.substr(0, space_pos);
+      std::string command = (space_pos == std::string::npos) ? "" : line.substr(space_pos + 1);
+      phosg::strip_whitespace(command);
+      if (command.empty()) {
+        c->send(std::format("{} done error No command given\n", request_id));
+      } else if (command.starts_with("cancel ")) {
+        std::string target_request_id = command.substr(7);
+        phosg::strip_whitespace(target_request_id);
+        this->cancel(c, request_id, target_request_id);
+      } else {
+        auto req = std::make_shared<Request>();
+        req->client = c;
+        req->request_id = request_id;
+        req->command = command;
+        std::lock_guard<std::mutex> g(this->queue_lock);
+        this->queue.emplace_back(std::move(req));
+        this->queue_cv.notify_all();
+      }
+    }
+  }
+  phosg::fwrite_fmt(this->log, "Client {} closed its connection\n", c->client_id);
+}
+
+void AnalysisServer::cancel_running_locked(Request& req) {
+  req.cancelled = true;
+  if (!req.in_child) {
+    MemoryReader::cancel_scans = true;
+  } else if (req.pid > 0) {
+    // Partial output has already been sent, and the child has no state worth keeping
+    kill(req.pid, SIGKILL);
+  } // Otherwise, execute_in_child kills the child as soon as it starts
+}
+
+void AnalysisServer::cancel(
+    std::shared_ptr<Client> c, const std::string& request_id, const std::string& target_request_id) {
+  bool found = false;
+  {
+    std::lock_guard<std::mutex> g(this->queue_lock);
+    for (const auto& req : this->running) {
+      if ((req->client == c) && (req->request_id == target_request_id)) {
+        // The running request sends its own done response when it stops
+        this->cancel_running_locked(*req);
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      for (auto it = this->queue.begin(); it != this->queue.end(); it++) {
+        if (((*it)->client == c) && ((*it)->request_id == target_request_id)) {
+          this->queue.erase(it);
+          c->send(std::format("{} done cancelled\n", target_request_id));
+          found = true;
+          break;
+        }
+      }
+    }
+  }
+  if (found) {
+    c->send(std::format("{} done ok\n", request_id));
+  } else {
+    c->send(std::format("{} done error No such request: {}\n", request_id, target_request_id));
+  }
+}
+
+void AnalysisServer::dispatch_requests() {
+  for (;;) {
+    std::shared_ptr<Request> req;
+    {
+      std::unique_lock<std::mutex> g(this->queue_lock);
+      this->queue_cv.wait(g, [&]() -> bool { return this->stopping || !this->queue.empty(); });
+      if (this->stopping) {
+        return;
+      }
+      req = this->queue.front();
+    }
+
+    // Only this thread runs commands in the server process, so the shell's state can't change during this call, and
+    // children forked from this thread always see the state left by all earlier requests
+    bool in_process = this->shell.command_changes_state(req->command);
+
+    {
+      std::unique_lock<std::mutex> g(this->queue_lock);
+      if (!in_process) {
+        this->queue_cv.wait(g, [&]() -> bool {
+          return this->stopping || (this->num_running_children < MAX_CONCURRENT_REQUESTS);
+        });
+      }
+      if (this->stopping) {
+        return;
+      }
+      if (this->queue.empty() || (this->queue.front() != req)) {
+        continue; // The request was cancelled while waiting
+      }
+      this->queue.pop_front();
+      if (req->client->disconnected) {
+        continue;
+      }
+      req->in_child = !in_process;
+      this->running.emplace_back(req);
+      if (in_process) {
+        MemoryReader::cancel_scans = false;
+      } else {
+        this->num_running_children++;
+      }
+    }
+
+    phosg::fwrite_fmt(this->log, "Client {} request {}{}: {}\n", req->client->client_id, req->request_id,
+        in_process ? "" : " (in child process)", req->command);
+    if (in_process) {
+      this->execute_in_process(req);
+    } else {
+      this->execute_in_child(req);
+    }
+  }
+}
+
+std::string AnalysisServer::run_command(const std::string& command) {
+  std::string result = "ok";
+  try {
+    this->shell.run_command(command);
+  } catch (const scan_cancelled&) {
+    result = "cancelled";
+  } catch (const std::exception& e) {
+    result = std::format("error {}", e.what());
+  }
+  // Commands like exit don't make sense here; the server runs until it's killed
+  this->shell.should_exit = false;
+  return result;
+}
+
+void AnalysisServer::finish_request(std::shared_ptr<Request> req, std::string result) {
+  for (char& ch : result) {
+    if (ch == '\n') {
+      ch = ' ';
+    }
+  }
+  {
+    std::lock_guard<std::mutex> g(this->queue_lock);
+    this->running.remove(req);
+  }
+  req->client->send(std::format("{} done {}\n", req->request_id, result));
+}
+
+void AnalysisServer::relay_output(int fd, std::shared_ptr<Request> req) {
+  char data[0x10000];
+  for (;;) {
+    ssize_t bytes = read(fd, data, sizeof(data));
+    if ((bytes < 0) && (errno == EINTR)) {
+      continue;
+    } else if (bytes <= 0) {
+      break;
+    }
+    std::string frame = std::format("{} data {}\n", req->request_id, bytes);
+    frame.append(data, bytes);
+    if (!req->client->send(frame)) {
+      // Nobody is waiting for the result anymore
+      std::lock_guard<std::mutex> g(this->queue_lock);
+      if (!req->cancelled) {
+        this->cancel_running_locked(*req);
+      }
+    }
+  }
+}
+
+void AnalysisServer::execute_in_process(std::shared_ptr<Request> req) {
+  // Commands write to stdout and stderr, so send everything written to either of them to the client while the command
+  // runs. Only one command runs in this process at a time, so this doesn't mix output from different requests.
+  int pipe_fds[2];
+  if (pipe(pipe_fds) != 0) {
+    this->finish_request(req, std::format("error Cannot create output pipe: {}", strerror(errno)));
+    return;
+  }
+  phosg::scoped_fd output_fd(pipe_fds[0]);
+  phosg::scoped_fd output_write_fd(pipe_fds[1]);
+
+  // Start the relay thread before redirecting anything, so there's nothing to undo if it can't be started
+  std::thread relay_thread;
+  try {
+    relay_thread = std::thread(&AnalysisServer::relay_output, this, static_cast<int>(output_fd), req);
+  } catch (const std::exception& e) {
+    this->finish_request(req, std::format("error Cannot start output thread: {}", e.what()));
+    return;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  phosg::scoped_fd saved_stdout_fd(dup(STDOUT_FILENO));
+  phosg::scoped_fd saved_stderr_fd(dup(STDERR_FILENO));
+  dup2(output_write_fd, STDOUT_FILENO);
+  dup2(output_write_fd, STDERR_FILENO);
+  output_write_fd.close();
+
+  std::string result = this->run_command(req->command);
+
+  // Restoring the original descriptors closes the last write ends of the pipe, so the relay thread sees EOF after it
+  // has sent everything
+  fflush(stdout);
+  fflush(stderr);
+  dup2(saved_stdout_fd, STDOUT_FILENO);
+  dup2(saved_stderr_fd, STDERR_FILENO);
+  relay_thread.join();
+
+  this->finish_request(req, result);
+}
+
+void AnalysisServer::execute_in_child(std::shared_ptr<Request> req) {
+  auto fail = [&](const std::string& message) -> void {
+    {
+      std::lock_guard<std::mutex> g(this->queue_lock);
+      this->num_running_children--;
+      this->queue_cv.notify_all();
+    }
+    this->finish_request(req, "error " + message);
+  };
+
+  // The child sends its output through one pipe, and its result through another when the command is done
+  int output_fds[2];
+  if (pipe(output_fds) != 0) {
+    fail(std::format("Cannot create output pipe: {}", strerror(errno)));
+    return;
+  }
+  phosg::scoped_fd output_fd(output_fds[0]);
+  phosg::scoped_fd output_write_fd(output_fds[1]);
+  int result_fds[2];
+  if (pipe(result_fds) != 0) {
+    fail(std::format("Cannot create result pipe: {}", strerror(errno)));
+    return;
+  }
+  phosg::scoped_fd result_fd(result_fds[0]);
+  phosg::scoped_fd result_write_fd(result_fds[1]);
+
+  // Anything left in the stdio buffers would be written again by the child
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fail(std::format("Cannot start child process: {}", strerror(errno)));
+    return;
+  }
+
+  if (pid == 0) {
+    // In the child process, only this thread exists, so it must not touch anything that another of the server's
+    // threads could have been holding a lock on (like the log stream or the queue)
+    dup2(output_write_fd, STDOUT_FILENO);
+    dup2(output_write_fd, STDERR_FILENO);
+    output_write_fd.close();
+    output_fd.close();
+    result_fd.close();
+    MemoryReader::cancel_scans = false;
+    std::string result = this->run_command(req->command);
+    fflush(stdout);
+    fflush(stderr);
+    for (size_t offset = 0; offset < result.size();) {
+      ssize_t bytes = write(result_write_fd, result.data() + offset, result.size() - offset);
+      if (bytes > 0) {
+        offset += bytes;
+      } else if ((bytes < 0) && (errno != EINTR)) {
+        break;
+      }
+    }
+    _exit(0);
+  }
+
+  output_write_fd.close();
+  result_write_fd.close();
+  {
+    std::lock_guard<std::mutex> g(this->queue_lock);
+    req->pid = pid;
+    if (req->cancelled) {
+      kill(pid, SIGKILL);
+    }
+  }
+
+  auto wait_for_child = [this, req, pid](phosg::scoped_fd output_fd, phosg::scoped_fd result_fd) -> void {
+    this->relay_output(output_fd, req);
+    std::string result;
+    for (;;) {
+      char data[0x400];
+      ssize_t bytes = read(result_fd, data, sizeof(data));
+      if ((bytes < 0) && (errno == EINTR)) {
+        continue;
+      } else if (bytes <= 0) {
+        break;
+      }
+      result.append(data, bytes);
+    }
+    int status = 0;
+    while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR)) {
+    }
+
+    {
+      std::lock_guard<std::mutex> g(this->queue_lock);
+      if (req->cancelled) {
+        result = "cancelled";
+      } else if (result.empty()) {
+        result = WIFSIGNALED(status)
+            ? std::format("error Child process was killed by signal {}", WTERMSIG(status))
+            : std::format("error Child process exited with status {} without a result", WEXITSTATUS(status));
+      }
+      this->num_running_children--;
+      this->queue_cv.notify_all();
+    }
+    this->finish_request(req, result);
+  };
+  try {
+    std::thread(wait_for_child, std::move(output_fd), std::move(result_fd)).detach();
+  } catch (const std::exception& e) {
+    kill(pid, SIGKILL);
+    while ((waitpid(pid, nullptr, 0) < 0) && (errno == EINTR)) {
+    }
+    fail(std::format("Cannot start output thread: {}", e.what()));
+  }
+}
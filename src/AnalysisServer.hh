@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <phosg/Filesystem.hh>
+#include <string>
+
+#include "AnalysisShell.hh"
+
+// Serves shell commands over a Unix domain socket, so a loaded (and prepared) snapshot can be queried repeatedly
+// without remapping it. Any number of clients may connect at once. The protocol is line-based; each request is a
+// single line:
+//   ID COMMAND [ARGS...]   Queues a shell command
+//   ID cancel TARGET_ID    Cancels a queued or running request sent earlier on the same connection
+// ID is any token chosen by the client. The server sends these responses, in order for each request:
+//   ID data SIZE\n<SIZE bytes>   Output (stdout and stderr) from the command; may be sent many times
+//   ID done ok|cancelled|error MESSAGE\n
+// Requests are started in the order they're received (across all clients). Commands that only read the snapshot run
+// concurrently, up to MAX_CONCURRENT_REQUESTS at a time, each in a forked child process: the child shares the
+// snapshot's mappings and sees the shell's state as of when it was started, and has its own stdout and stderr.
+// Commands that change the shell's state (see AnalysisShell::command_changes_state) run one at a time in the server
+// process, and requests received after one of them don't start until it's done.
+class AnalysisServer {
+public:
+  static constexpr size_t MAX_CONCURRENT_REQUESTS = 4;
+
+  AnalysisServer(AnalysisShell& shell, const std::string& socket_path);
+  AnalysisServer(const AnalysisServer&) = delete;
+  AnalysisServer(AnalysisServer&&) = delete;
+  AnalysisServer& operator=(const AnalysisServer&) = delete;
+  AnalysisServer& operator=(AnalysisServer&&) = delete;
+  ~AnalysisServer();
+
+  // Accepts connections until accept() fails with a non-transient error, which is then thrown
+  void run();
+
+private:
+  struct Client {
+    explicit Client(int fd, uint64_t client_id);
+    // Returns false if the client has disconnected
+    bool send(const std::string& data);
+
+    phosg::scoped_fd fd;
+    uint64_t client_id;
+    std::mutex write_lock;
+    std::atomic<bool> disconnected = false;
+  };
+
+  struct Request {
+    std::shared_ptr<Client> client;
+    std::string request_id;
+    std::string command;
+    bool in_child = false;
+    pid_t pid = 0; // Only set if in_child is true, after the child process has been started
+    bool cancelled = false;
+  };
+
+  AnalysisShell& shell;
+  std::string socket_path;
+  phosg::scoped_fd listen_fd;
+  FILE* log; // The real stderr, which isn't redirected while commands run
+  uint64_t next_client_id = 1;
+
+  // All of these are protected by queue_lock
+  std::mutex queue_lock;
+  std::condition_variable queue_cv;
+  std::deque<std::shared_ptr<Request>> queue;
+  std::list<std::shared_ptr<Request>> running;
+  size_t num_running_children = 0;
+  bool stopping = false;
+
+  void handle_client(std::shared_ptr<Client> c);
+  void cancel(std::shared_ptr<Client> c, const std::string& request_id, const std::string& target_request_id);
+  void dispatch_requests();
+  // Each of these sends the request's output and done response, and doesn't throw
+  void execute_in_process(std::shared_ptr<Request> req);
+  void execute_in_child(std::shared_ptr<Request> req);
+  void finish_request(std::shared_ptr<Request> req, std::string result);
+  // Sends everything read from fd to the request's client until EOF. If the client disconnects, cancels the request
+  // but keeps reading, so the command doesn't block on a full pipe.
+  void relay_output(int fd, std::shared_ptr<Request> req);
+  // Stops a running request's command; queue_lock must be held
+  void cancel_running_locked(Request& req);
+  // Runs the command in the current process, with output going to the current stdout and stderr, and returns the
+  // result to send in the done response
+  std::string run_command(const std::string& command);
+};
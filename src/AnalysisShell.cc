@@ -1,44 +1,91 @@
 #include <readline/history.h>
 #include <readline/readline.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <atomic>
+#include <bit>
+#include <filesystem>
+#include <iterator>
 #include <mutex>
 #include <phosg/Arguments.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <regex>
 #include <set>
 
 #include "AnalysisShell.hh"
+#include "Census.hh"
+#include "ColumnarExport.hh"
+#include "OwnerIndex.hh"
+#include "GraphAnalysis.hh"
+#include "OrderedOutput.hh"
 #include "Types/PyAsyncObjects.hh"
 #include "Types/PyGeneratorObjects.hh"
+#include "Types/PyListObject.hh"
+#include "Types/PySetObject.hh"
 #include "Types/PyThreadState.hh"
 #include "Types/PyTypeObject.hh"
 
+// A per-object visitor that can share a memory scan with other visitors (see fused-scan). visit() is called from scan
+// threads for each candidate object whose type is a known type object; implementations should keep per-thread state
+// indexed by thread_index, and merge it and print their results in finish(), which is called once after the scan.
+class ObjectVisitor {
+public:
+  virtual ~ObjectVisitor() = default;
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) = 0;
+  virtual void finish() = 0;
+};
+
 struct ShellCommand {
+  using VisitorFactory = std::unique_ptr<ObjectVisitor> (*)(AnalysisShell&, phosg::Arguments&, ScanProgress&);
+
   std::string name;
   std::string help_text;
   void (*run)(AnalysisShell&, phosg::Arguments&);
+  void (*run_raw)(AnalysisShell&, const std::string&); // For commands that parse their own arguments
+  VisitorFactory make_visitor; // Only set for commands that can be run in a fused scan
 
   static std::vector<const ShellCommand*> commands_by_order;
   static std::unordered_map<std::string, const ShellCommand*> commands_by_name;
 
-  ShellCommand(std::string name, std::string help_text, void (*run)(AnalysisShell&, phosg::Arguments&))
-      : name(std::move(name)), help_text(std::move(help_text)), run(run) {
+  ShellCommand(std::string name, std::string help_text, void (*run)(AnalysisShell&, phosg::Arguments&),
+      VisitorFactory make_visitor = nullptr)
+      : name(std::move(name)), help_text(std::move(help_text)), run(run), run_raw(nullptr), make_visitor(make_visitor) {
+    this->register_command();
+  }
+  ShellCommand(std::string name, std::string help_text, void (*run_raw)(AnalysisShell&, const std::string&))
+      : name(std::move(name)), help_text(std::move(help_text)), run(nullptr), run_raw(run_raw), make_visitor(nullptr) {
+    this->register_command();
+  }
+
+  void register_command() {
     // These are expected to be constructed only statically, so it's OK to save raw pointers in these registries
     this->commands_by_name.emplace(this->name, this);
     this->commands_by_order.emplace_back(this);
   }
 
+  static const ShellCommand* find(const std::string& command_name) {
+    auto cmd_it = ShellCommand::commands_by_name.find(command_name);
+    if (cmd_it == ShellCommand::commands_by_name.end()) {
+      throw std::invalid_argument(std::format("Invalid command: {}", command_name));
+    }
+    return cmd_it->second;
+  }
+
   static void dispatch(AnalysisShell& shell, const std::string& command) {
     phosg::Arguments args(command);
     const auto& command_name = args.get<std::string>(0, false);
     if (command_name.empty()) {
       return;
     }
-    auto cmd_it = ShellCommand::commands_by_name.find(command_name);
-    if (cmd_it == ShellCommand::commands_by_name.end()) {
-      phosg::fwrite_fmt(stderr, "Invalid command: {}\n", command_name);
+    const auto* def = ShellCommand::find(command_name);
+    if (def->run_raw) {
+      size_t args_offset = command.find(command_name) + command_name.size();
+      def->run_raw(shell, command.substr(args_offset));
     } else {
-      ShellCommand::commands_by_name.at(command_name)->run(shell, args);
+      def->run(shell, args);
     }
   }
 };
@@ -46,6 +93,70 @@ struct ShellCommand {
 std::vector<const ShellCommand*> ShellCommand::commands_by_order;
 std::unordered_map<std::string, const ShellCommand*> ShellCommand::commands_by_name;
 
+// Runs one scan over all memory, and passes every candidate object to all of the given visitors. Each visitor checks
+// the object's type itself, since some (like find-all-objects --type-addr) need to see objects whose types aren't in
+// the analysis data.
+static void run_object_visitors(
+    AnalysisShell& shell, const std::vector<ObjectVisitor*>& visitors, ScanProgress& progress) {
+  shell.env.r.map_all_addresses<PyObject>(
+      [&](const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) -> void {
+        for (auto* visitor : visitors) {
+          visitor->visit(obj, addr, thread_index);
+        }
+      },
+      8, shell.max_threads, &progress);
+  phosg::fwrite_fmt(stderr, CLEAR_LINE);
+}
+
+template <typename VisitorT>
+std::unique_ptr<ObjectVisitor> make_visitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress& progress) {
+  return std::make_unique<VisitorT>(shell, args, progress);
+}
+
+template <typename VisitorT>
+void run_visitor(AnalysisShell& shell, phosg::Arguments& args) {
+  ScanProgress progress;
+  VisitorT visitor(shell, args, progress);
+  run_object_visitors(shell, {&visitor}, progress);
+  visitor.finish();
+}
+
+// Collects the addresses of a scan's results in per-thread lists, and saves them as a result set at the end if the
+// command's --as option was given. If it wasn't given, this does nothing.
+class ResultSetCollector {
+public:
+  ResultSetCollector(AnalysisShell& shell, phosg::Arguments& args)
+      : shell(shell),
+        name(args.get<std::string>("as", false)) {
+    if (!this->name.empty()) {
+      this->addrs.resize(shell.max_threads);
+    }
+  }
+
+  inline void add(size_t thread_index, MappedPtr<void> addr) {
+    if (!this->name.empty()) {
+      this->addrs[thread_index].emplace_back(addr);
+    }
+  }
+
+  void save() {
+    if (this->name.empty()) {
+      return;
+    }
+    std::vector<MappedPtr<void>> all_addrs;
+    for (auto& thread_addrs : this->addrs) {
+      all_addrs.insert(all_addrs.end(), thread_addrs.begin(), thread_addrs.end());
+      thread_addrs.clear();
+    }
+    this->shell.save_result_set(this->name, std::move(all_addrs));
+  }
+
+private:
+  AnalysisShell& shell;
+  std::string name;
+  std::vector<std::vector<MappedPtr<void>>> addrs;
+};
+
 static void find_base_type_object(Environment& env, size_t max_threads) {
   std::mutex output_lock;
   std::vector<MappedPtr<PyTypeObject>> candidates;
@@ -109,19 +220,24 @@ AnalysisShell::AnalysisShell(const std::string& data_path, size_t max_threads)
   }
 }
 
-void AnalysisShell::prepare() {
-  if (this->env.base_type_object.is_null()) {
+// Finds the base type object and all type objects, if they aren't already in the environment's analysis data
+static void prepare_environment(Environment& env, size_t max_threads) {
+  if (env.base_type_object.is_null()) {
     phosg::fwrite_fmt(stderr, "Base type object not present in analysis data; looking for it\n");
-    find_base_type_object(this->env, this->max_threads);
+    find_base_type_object(env, max_threads);
   }
-  if (this->env.base_type_object.is_null()) {
+  if (env.base_type_object.is_null()) {
     phosg::fwrite_fmt(stderr, "Failed to find exactly one base type object; cannot proceed with analysis\n");
-  } else if (this->env.type_objects.empty()) {
+  } else if (env.type_objects.empty()) {
     phosg::fwrite_fmt(stderr, "No type objects are present in analysis data; looking for them\n");
-    find_all_type_objects(this->env, this->max_threads);
+    find_all_type_objects(env, max_threads);
   }
 }
 
+void AnalysisShell::prepare() {
+  prepare_environment(this->env, this->max_threads);
+}
+
 void AnalysisShell::run() {
   this->prepare();
 
@@ -154,10 +270,123 @@ void AnalysisShell::run() {
   }
 }
 
+size_t AnalysisShell::run_script(const std::string& filename) {
+  // Scripts can run other scripts with the source command, so a script that sources itself would recurse until the
+  // stack overflows
+  if (this->script_depth >= MAX_SCRIPT_DEPTH) {
+    throw std::runtime_error(std::format("Scripts are nested more than {} levels deep", MAX_SCRIPT_DEPTH));
+  }
+  this->script_depth++;
+  struct DepthGuard {
+    size_t& depth;
+    ~DepthGuard() {
+      this->depth--;
+    }
+  } depth_guard{this->script_depth};
+
+  std::string contents = (filename == "-") ? phosg::read_all(stdin) : phosg::load_file(filename);
+
+  size_t num_failures = 0;
+  for (std::string command : phosg::split(contents, '\n')) {
+    phosg::strip_whitespace(command);
+    if (command.empty() || command.starts_with("#")) {
+      continue;
+    }
+    phosg::fwrite_fmt(stderr, "{}> {}\n", this->env.data_path, command);
+    try {
+      this->run_command(command);
+    } catch (const std::exception& e) {
+      phosg::fwrite_fmt(stderr, "Error: {}\n", e.what());
+      num_failures++;
+    }
+    fflush(stdout);
+    if (this->should_exit) {
+      break;
+    }
+  }
+  return num_failures;
+}
+
+std::vector<MappedPtr<void>> AnalysisShell::parse_addrs(const std::string& addr_str, bool bswap) {
+  if (addr_str.starts_with("@")) {
+    return this->get_result_set(addr_str.substr(1));
+  }
+  return {this->parse_addr<void>(addr_str, bswap)};
+}
+
+void AnalysisShell::save_result_set(const std::string& name, std::vector<MappedPtr<void>>&& addrs) {
+  if (name.empty() || name.starts_with("@")) {
+    throw std::invalid_argument("Result set names must not be empty or begin with @");
+  }
+  std::sort(addrs.begin(), addrs.end());
+  addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+  phosg::fwrite_fmt(stderr, "Saved {} addresses as @{}\n", addrs.size(), name);
+  this->result_sets[name] = std::move(addrs);
+}
+
+const std::vector<MappedPtr<void>>& AnalysisShell::get_result_set(const std::string& name) const {
+  try {
+    return this->result_sets.at(name);
+  } catch (const std::out_of_range&) {
+    throw std::out_of_range(std::format("There is no result set named {}", name));
+  }
+}
+
+const ObjectGraph& AnalysisShell::get_graph() {
+  if (!this->graph) {
+    std::string filename = ObjectGraph::filename_for_environment(this->env);
+    if (!std::filesystem::is_regular_file(filename)) {
+      throw std::runtime_error("The object graph has not been built for this snapshot; run build-graph first");
+    }
+    this->graph = std::make_unique<ObjectGraph>(filename);
+    phosg::fwrite_fmt(stderr, "Loaded object graph with {} objects and {} references\n",
+        this->graph->node_count(), this->graph->edge_count());
+    if (this->graph->type_count() != this->env.type_objects.size()) {
+      phosg::fwrite_fmt(stderr,
+          "Warning: the object graph was built when {} types were known, but now {} are; run build-graph again to include objects of all known types\n",
+          this->graph->type_count(), this->env.type_objects.size());
+    }
+  }
+  return *this->graph;
+}
+
+const OwnerIndex& AnalysisShell::get_owner_index() {
+  if (!this->owner_index) {
+    phosg::fwrite_fmt(stderr, "Building owner index\n");
+    this->owner_index = std::make_unique<OwnerIndex>(this->env, this->max_threads);
+    phosg::fwrite_fmt(stderr, "Indexed {} objects and buffers\n", this->owner_index->size());
+  }
+  return *this->owner_index;
+}
+
 void AnalysisShell::run_command(const std::string& command) {
   ShellCommand::dispatch(*this, command);
 }
 
+bool AnalysisShell::command_changes_state(const std::string& command) {
+  static const std::unordered_set<std::string> state_changing_commands = {
+      "build-graph", "delete-set", "set-union", "set-intersection", "set-difference", "source", "exit"};
+  try {
+    phosg::Arguments args(command);
+    const auto& command_name = args.get<std::string>(0, false);
+    if (state_changing_commands.count(command_name)) {
+      return true;
+    }
+    // fused-scan's arguments are other commands, any of which may save a result set
+    if ((command_name == "fused-scan") ? (command.find("--as=") != std::string::npos)
+                                       : !args.get<std::string>("as", false).empty()) {
+      return true;
+    }
+    // The owner index is expensive to build, so build it here once instead of in every child process
+    if (!this->owner_index && ((command_name == "whose") || ((command_name == "find") && args.get<bool>("owner")))) {
+      return true;
+    }
+    return false;
+  } catch (const std::exception&) {
+    return true; // Let run_command report the error
+  }
+}
+
 ShellCommand c_help(
     "help", "\
   help\n\
@@ -177,6 +406,21 @@ ShellCommand c_exit(
       shell.should_exit = true;
     });
 
+ShellCommand c_source(
+    "source", "\
+  source FILENAME\n\
+    Runs all commands in FILENAME, one per line. Blank lines and lines\n\
+    beginning with # are ignored. This is equivalent to running\n\
+    python-memtools with --script=FILENAME, but can be used in the shell. If\n\
+    any of the commands fail, the source command also fails.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      const auto& filename = args.get<std::string>(1, true);
+      size_t num_failures = shell.run_script(filename);
+      if (num_failures) {
+        throw std::runtime_error(std::format("{} commands failed in {}", num_failures, filename));
+      }
+    });
+
 ShellCommand c_regions(
     "regions", "\
   regions\n\
@@ -208,6 +452,26 @@ ShellCommand c_show_analysis_data(
       phosg::fwrite_fmt(stderr, "{} non-base type objects overall\n", sorted_types.size());
     });
 
+// Describes where addr is within the given owner interval, like "in buffer of list @ 00007F0000001000 +0x18". For
+// the owner's own allocation, the offset is relative to the object's address (so it's negative in its GC header).
+static std::string describe_owner(const Environment& env,
+    const std::unordered_map<MappedPtr<PyTypeObject>, std::string>& name_for_type, const OwnerIndex::Interval& interval,
+    MappedPtr<void> addr) {
+  auto name_it = name_for_type.find(env.r.get(interval.owner).ob_type);
+  const char* type_name = (name_it == name_for_type.end()) ? "<unknown type>" : name_it->second.c_str();
+  if (interval.kind == OwnerIndex::IntervalKind::SHARED_DICT_KEYS) {
+    // The owner is a type; describe it by its own name rather than as "type"
+    auto owner_name_it = name_for_type.find(interval.owner.cast<PyTypeObject>());
+    return std::format("in shared __dict__ keys of {} @ {} +0x{:X}",
+        (owner_name_it == name_for_type.end()) ? "<unknown type>" : owner_name_it->second.c_str(), interval.owner,
+        addr.addr - interval.start);
+  }
+  bool is_buffer = (interval.kind == OwnerIndex::IntervalKind::BUFFER);
+  int64_t offset = addr.addr - (is_buffer ? interval.start : interval.owner.addr);
+  return std::format("in {}{} @ {} {}0x{:X}", is_buffer ? "buffer of " : "", type_name, interval.owner,
+      (offset < 0) ? "-" : "+", (offset < 0) ? -offset : offset);
+}
+
 ShellCommand c_find(
     "find", "\
   find DATA [OPTIONS]\n\
@@ -216,7 +480,11 @@ ShellCommand c_find(
       --bswap: Byteswap DATA before searching (only if --ptr is also given).\n\
       --align=ALIGN: Only find DATA at addresses aligned to ALIGN bytes\n\
           (default 8 if --ptr is given, or 1 otherwise).\n\
-      --count: Don\'t print each occurrence, just count them.\n",
+      --count: Don\'t print each occurrence, just count them.\n\
+      --owner: Show the object (or object\'s buffer) containing each\n\
+          occurrence. The first time this is used, this builds an index of\n\
+          all objects, which requires an extra scan.\n\
+    Occurrences are printed in address order after the search is done.\n",
     +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
       size_t alignment;
       std::string data;
@@ -236,20 +504,36 @@ ShellCommand c_find(
       }
 
       bool count_only = args.get<bool>("count");
+      const OwnerIndex* owner_index = args.get<bool>("owner") ? &shell.get_owner_index() : nullptr;
+      auto name_for_type = shell.env.names_for_types();
+      auto describe_occurrence = [&](MappedPtr<void> addr) -> std::string {
+        if (!owner_index) {
+          return std::format("Data found at {}\n", addr);
+        }
+        auto owners = owner_index->owners_of(addr);
+        if (owners.empty()) {
+          return std::format("Data found at {} (not in any known object)\n", addr);
+        }
+        std::string ret = std::format("Data found at {}", addr);
+        for (const auto* interval : owners) {
+          ret += std::format(" ({})", describe_owner(shell.env, name_for_type, *interval, addr));
+        }
+        ret.push_back('\n');
+        return ret;
+      };
 
-      std::mutex console_lock;
+      OrderedOutput output(shell.max_threads);
       std::atomic<size_t> result_count = 0;
 
       if (data.size() == 8 && alignment == 8) {
         // Optimized common case: aligned 8-byte comparison instead of memcmp()
         uint64_t target_value = *reinterpret_cast<const uint64_t*>(data.data());
         shell.env.r.map_all_addresses<uint64_t>(
-            [&](const uint64_t& value, MappedPtr<uint64_t> addr, size_t) -> void {
+            [&](const uint64_t& value, MappedPtr<uint64_t> addr, size_t thread_index) -> void {
               if (value == target_value) {
                 result_count++;
                 if (!count_only) {
-                  std::lock_guard<std::mutex> g(console_lock);
-                  phosg::fwrite_fmt(stderr, CLEAR_LINE "Data found at {}\n", addr);
+                  output.add(thread_index, addr.addr, describe_occurrence(addr));
                 }
               }
             },
@@ -257,179 +541,1705 @@ ShellCommand c_find(
 
       } else {
         shell.env.r.map_all_addresses<uint8_t>(
-            [&](const uint8_t& mem_data, MappedPtr<void> addr, size_t) -> void {
+            [&](const uint8_t& mem_data, MappedPtr<void> addr, size_t thread_index) -> void {
               if (!memcmp(&mem_data, data.data(), data.size())) {
                 result_count++;
                 if (!count_only) {
-                  std::lock_guard<std::mutex> g(console_lock);
-                  phosg::fwrite_fmt(stderr, CLEAR_LINE "Data found at {}\n", addr);
+                  output.add(thread_index, addr.addr, describe_occurrence(addr));
                 }
               }
             },
-            alignment, shell.max_threads, data.size());
+            alignment, shell.max_threads, nullptr, data.size());
       }
 
-      phosg::fwrite_fmt(stderr, CLEAR_LINE "{} results found\n", result_count.load());
+      phosg::fwrite_fmt(stderr, CLEAR_LINE);
+      output.write(stderr);
+      phosg::fwrite_fmt(stderr, "{} results found\n", result_count.load());
     });
 
+class CountByTypeVisitor : public ObjectVisitor {
+public:
+  CountByTypeVisitor(AnalysisShell& shell, phosg::Arguments&, ScanProgress&)
+      : shell(shell),
+        name_for_type(shell.env.names_for_types()),
+        count_for_type(shell.max_threads) {
+    if (shell.env.base_type_object.is_null()) {
+      throw std::runtime_error("Base type object not present in analysis data");
+    }
+  }
+
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    if (this->name_for_type.count(obj.ob_type) && !this->shell.env.invalid_reason(addr)) {
+      this->count_for_type[thread_index][obj.ob_type]++;
+    }
+  }
+
+  virtual void finish() {
+    std::unordered_map<MappedPtr<PyTypeObject>, size_t> overall_count_for_type;
+    for (size_t z = 0; z < this->count_for_type.size(); z++) {
+      const auto& thread_count_for_type = this->count_for_type[z];
+      phosg::fwrite_fmt(stderr, "Collecting {} results from thread {}\n", thread_count_for_type.size(), z);
+      for (const auto& [type, count] : thread_count_for_type) {
+        overall_count_for_type[type] += count;
+      }
+    }
+
+    phosg::fwrite_fmt(stderr, "Found {} types\n", overall_count_for_type.size());
+
+    std::vector<std::tuple<size_t, std::string, MappedPtr<PyTypeObject>>> entries;
+    entries.reserve(overall_count_for_type.size());
+    for (const auto& [type_addr, count] : overall_count_for_type) {
+      try {
+        const std::string& type_name = this->name_for_type.at(type_addr);
+        entries.emplace_back(std::make_tuple(count, type_name, type_addr));
+      } catch (const std::out_of_range&) {
+      }
+    }
+
+    phosg::fwrite_fmt(stderr, "Sorting {} entries\n", entries.size());
+    sort(entries.begin(), entries.end());
+
+    for (const auto& [count, name, type_addr] : entries) {
+      phosg::fwrite_fmt(stderr, "({} objects) {} @ {}\n", count, name, type_addr);
+    }
+  }
+
+private:
+  AnalysisShell& shell;
+  std::unordered_map<MappedPtr<PyTypeObject>, std::string> name_for_type;
+  std::vector<std::unordered_map<MappedPtr<PyTypeObject>, size_t>> count_for_type;
+};
+
 ShellCommand c_count_by_type(
     "count-by-type", "\
   count-by-type\n\
     Counts the number of existing objects for each known type.\n",
-    +[](AnalysisShell& shell, phosg::Arguments&) -> void {
-      if (shell.env.base_type_object.is_null()) {
-        throw std::runtime_error("Base type object not present in analysis data");
-      }
+    &run_visitor<CountByTypeVisitor>, &make_visitor<CountByTypeVisitor>);
+
+class MemoryByTypeVisitor : public ObjectVisitor {
+public:
+  MemoryByTypeVisitor(AnalysisShell& shell, phosg::Arguments&, ScanProgress&)
+      : shell(shell),
+        name_for_type(shell.env.names_for_types()),
+        stats_for_type(shell.max_threads) {
+    if (shell.env.base_type_object.is_null()) {
+      throw std::runtime_error("Base type object not present in analysis data");
+    }
+  }
+
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    if (!this->name_for_type.count(obj.ob_type) || this->shell.env.invalid_reason(addr)) {
+      return;
+    }
+    try {
+      auto extents = this->shell.env.object_extents(addr);
+      auto& stats = this->stats_for_type[thread_index][obj.ob_type];
+      stats.count++;
+      stats.inline_bytes += extents.size;
+      stats.buffer_bytes += extents.buffers_size();
+    } catch (const std::out_of_range&) {
+    }
+  }
 
-      // Invert type_objects for fast lookup
-      std::unordered_map<MappedPtr<PyTypeObject>, std::string> name_for_type;
-      for (const auto& [name, type] : shell.env.type_objects) {
-        name_for_type.emplace(type, name);
+  virtual void finish() {
+    std::unordered_map<MappedPtr<PyTypeObject>, TypeStats> overall_stats_for_type;
+    for (const auto& thread_stats_for_type : this->stats_for_type) {
+      for (const auto& [type, stats] : thread_stats_for_type) {
+        auto& overall_stats = overall_stats_for_type[type];
+        overall_stats.count += stats.count;
+        overall_stats.inline_bytes += stats.inline_bytes;
+        overall_stats.buffer_bytes += stats.buffer_bytes;
       }
+    }
 
-      std::vector<std::unordered_map<MappedPtr<PyTypeObject>, size_t>> count_for_type;
-      count_for_type.resize(shell.max_threads);
+    std::vector<std::tuple<size_t, std::string, MappedPtr<PyTypeObject>, const TypeStats*>> entries;
+    entries.reserve(overall_stats_for_type.size());
+    size_t total_bytes = 0;
+    for (const auto& [type_addr, stats] : overall_stats_for_type) {
+      size_t type_bytes = stats.inline_bytes + stats.buffer_bytes;
+      entries.emplace_back(type_bytes, this->name_for_type.at(type_addr), type_addr, &stats);
+      total_bytes += type_bytes;
+    }
+    sort(entries.begin(), entries.end());
 
-      shell.env.r.map_all_addresses<PyTypeObject>(
-          [&](const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) -> void {
-            if (name_for_type.count(obj.ob_type) && !shell.env.invalid_reason(addr)) {
-              count_for_type[thread_index][obj.ob_type]++;
-            }
-          },
-          8, shell.max_threads);
-      fputc('\n', stdout);
+    for (const auto& [type_bytes, name, type_addr, stats] : entries) {
+      phosg::fwrite_fmt(stdout, "({} total = {} inline + {} buffers; {} objects) {} @ {}\n",
+          phosg::format_size(type_bytes), phosg::format_size(stats->inline_bytes),
+          phosg::format_size(stats->buffer_bytes), stats->count, name, type_addr);
+    }
+    phosg::fwrite_fmt(stdout, "{} in {} types\n", phosg::format_size(total_bytes), entries.size());
+  }
 
-      std::unordered_map<MappedPtr<PyTypeObject>, size_t> overall_count_for_type;
-      for (size_t z = 0; z < count_for_type.size(); z++) {
-        const auto& thread_count_for_type = count_for_type[z];
-        phosg::fwrite_fmt(stderr, "Collecting {} results from thread {}\n", thread_count_for_type.size(), z);
-        for (const auto& [type, count] : thread_count_for_type) {
-          overall_count_for_type[type] += count;
-        }
-      }
+private:
+  struct TypeStats {
+    size_t count = 0;
+    size_t inline_bytes = 0;
+    size_t buffer_bytes = 0;
+  };
 
-      phosg::fwrite_fmt(stderr, "Found {} types\n", count_for_type.size());
+  AnalysisShell& shell;
+  std::unordered_map<MappedPtr<PyTypeObject>, std::string> name_for_type;
+  std::vector<std::unordered_map<MappedPtr<PyTypeObject>, TypeStats>> stats_for_type;
+};
 
-      std::vector<std::tuple<size_t, std::string, MappedPtr<PyTypeObject>>> entries;
-      entries.reserve(overall_count_for_type.size());
-      for (const auto& [type_addr, count] : overall_count_for_type) {
-        try {
-          const std::string& type_name = name_for_type.at(type_addr);
-          entries.emplace_back(std::make_tuple(count, type_name, type_addr));
-        } catch (const std::out_of_range&) {
-        }
+ShellCommand c_memory_by_type(
+    "memory-by-type", "\
+  memory-by-type\n\
+    Sums the memory used by the existing objects of each known type. Inline\n\
+    bytes are the objects' own allocations, including GC headers; buffer bytes\n\
+    are separately-allocated storage owned by the objects, like list item\n\
+    arrays, dict tables, set tables, and non-compact string data.\n",
+    &run_visitor<MemoryByTypeVisitor>, &make_visitor<MemoryByTypeVisitor>);
+
+class LargestObjectsVisitor : public ObjectVisitor {
+public:
+  LargestObjectsVisitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress&)
+      : shell(shell),
+        args(args),
+        count(args.get<size_t>("n", 50)),
+        set_name(args.get<std::string>("as", false)),
+        name_for_type(shell.env.names_for_types()),
+        thread_heaps(shell.max_threads) {
+    if (shell.env.base_type_object.is_null()) {
+      throw std::runtime_error("Base type object not present in analysis data");
+    }
+    if (this->count == 0) {
+      throw std::invalid_argument("--n must be at least 1");
+    }
+  }
+
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    if (!this->name_for_type.count(obj.ob_type) || this->shell.env.invalid_reason(addr)) {
+      return;
+    }
+    // Each thread keeps a min-heap of its largest count objects, so most objects are rejected with one comparison
+    auto& heap = this->thread_heaps[thread_index];
+    try {
+      auto extents = this->shell.env.object_extents(addr);
+      Entry entry{extents.total_size(), extents.size, addr, obj.ob_type};
+      if (heap.size() < this->count) {
+        heap.emplace_back(entry);
+        std::push_heap(heap.begin(), heap.end(), Entry::is_larger);
+      } else if (Entry::is_larger(entry, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), Entry::is_larger);
+        heap.back() = entry;
+        std::push_heap(heap.begin(), heap.end(), Entry::is_larger);
       }
+    } catch (const std::out_of_range&) {
+    }
+  }
 
-      phosg::fwrite_fmt(stderr, "Sorting {} entries\n", entries.size());
-      sort(entries.begin(), entries.end());
+  virtual void finish() {
+    std::vector<Entry> entries;
+    for (auto& heap : this->thread_heaps) {
+      entries.insert(entries.end(), heap.begin(), heap.end());
+      heap.clear();
+    }
+    std::sort(entries.begin(), entries.end(), Entry::is_larger);
+    if (entries.size() > this->count) {
+      entries.resize(this->count);
+    }
 
-      for (const auto& [count, name, type_addr] : entries) {
-        phosg::fwrite_fmt(stderr, "({} objects) {} @ {}\n", count, name, type_addr);
+    std::vector<MappedPtr<void>> found_addrs;
+    size_t total_bytes = 0;
+    for (const auto& entry : entries) {
+      auto t = this->shell.env.traverse(&this->args);
+      t.is_short = true;
+      if (t.max_recursion_depth < 0) {
+        t.max_recursion_depth = 0;
       }
-    });
+      phosg::fwrite_fmt(stdout, "({} = {} inline + {} buffers) {} @ {} {}\n",
+          phosg::format_size(entry.total_size), phosg::format_size(entry.inline_size),
+          phosg::format_size(entry.total_size - entry.inline_size), this->name_for_type.at(entry.type),
+          entry.addr, t.repr(entry.addr));
+      total_bytes += entry.total_size;
+      found_addrs.emplace_back(entry.addr);
+    }
+    phosg::fwrite_fmt(stdout, "{} in {} objects\n", phosg::format_size(total_bytes), entries.size());
 
-ShellCommand c_find_all_objects(
-    "find-all-objects", "\
-  find-all-objects [OPTIONS]\n\
-    Finds all objects of a given type. Options:\n\
-      --type-addr=ADDRESS: Find objects whose type object is at this address.\n\
-      --type-name=NAME: Find objects whose type has this name.\n\
-      --count: Only count the number of objects; don\'t print them.\n\
+    if (!this->set_name.empty()) {
+      this->shell.save_result_set(this->set_name, std::move(found_addrs));
+    }
+  }
+
+private:
+  struct Entry {
+    size_t total_size;
+    size_t inline_size;
+    MappedPtr<PyObject> addr;
+    MappedPtr<PyTypeObject> type;
+
+    // Larger objects first; ties are broken by address so the results don't depend on the number of threads
+    static bool is_larger(const Entry& a, const Entry& b) {
+      return (a.total_size != b.total_size) ? (a.total_size > b.total_size) : (a.addr < b.addr);
+    }
+  };
+
+  AnalysisShell& shell;
+  phosg::Arguments& args;
+  size_t count;
+  std::string set_name;
+  std::unordered_map<MappedPtr<PyTypeObject>, std::string> name_for_type;
+  std::vector<std::vector<Entry>> thread_heaps;
+};
+
+ShellCommand c_largest(
+    "largest", "\
+  largest [OPTIONS]\n\
+    Find the largest individual objects of all known types. Each object\'s size\n\
+    includes its GC header and any separately-allocated storage it owns, as\n\
+    in memory-by-type. Options:\n\
+      --n=N: Show this many objects (default 50).\n\
+      --as=NAME: Save the addresses of the shown objects as the result set\n\
+          NAME.\n\
     The formatting options to the repr command are also valid here.\n",
-    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
-      // TODO: It'd be nice to have something like --max-results=N here
-      MappedPtr<PyTypeObject> type_addr{args.get<uint64_t>("type-addr", 0, phosg::Arguments::IntFormat::HEX)};
-      if (type_addr.is_null()) {
-        const std::string& type_name = args.get<std::string>("type-name", false);
-        type_addr = shell.env.type_objects.at(type_name);
+    &run_visitor<LargestObjectsVisitor>, &make_visitor<LargestObjectsVisitor>);
+
+class ContainerSlackVisitor : public ObjectVisitor {
+public:
+  ContainerSlackVisitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress&)
+      : shell(shell),
+        top_count(args.get<size_t>("top", 50)),
+        name_for_type(shell.env.names_for_types()),
+        dict_type(shell.env.get_type_if_exists("dict")),
+        list_type(shell.env.get_type_if_exists("list")),
+        set_type(shell.env.get_type_if_exists("set")),
+        frozenset_type(shell.env.get_type_if_exists("frozenset")),
+        str_type(shell.env.get_type_if_exists("str")),
+        stats_for_type(shell.max_threads),
+        stats_for_owner(shell.max_threads) {
+    if (shell.env.base_type_object.is_null()) {
+      throw std::runtime_error("Base type object not present in analysis data");
+    }
+  }
+
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    if (!this->name_for_type.count(obj.ob_type) || this->shell.env.invalid_reason(addr)) {
+      return;
+    }
+    try {
+      if (this->is_container_type(obj.ob_type)) {
+        this->stats_for_type[thread_index][obj.ob_type].add(this->shell.env, addr);
+        return;
       }
-      bool count_only = args.get<bool>("count");
 
-      std::mutex output_lock;
-      std::atomic<size_t> result_count = 0;
-      shell.env.r.map_all_addresses<PyObject>([&](const PyObject& obj, MappedPtr<PyObject> addr, size_t) -> void {
-        if ((obj.ob_type != type_addr) || shell.env.invalid_reason(addr)) {
-          return;
+      // For instances with a __dict__, attribute the slack in the __dict__ itself and in any containers directly in
+      // its values to the instance's type and attribute name. These containers are also counted in the totals by type
+      // when they're visited themselves.
+      // TODO: Support negative tp_dictoffset here
+      const auto& r = this->shell.env.r;
+      const auto& type_obj = r.get(obj.ob_type);
+      if (type_obj.tp_dictoffset <= 0) {
+        return;
+      }
+      auto dict_addr = r.get(addr.offset_bytes(type_obj.tp_dictoffset).cast<MappedPtr<PyDictObject>>());
+      if (dict_addr.is_null() || this->shell.env.invalid_reason(dict_addr.cast<PyObject>())) {
+        return;
+      }
+      const auto& dict = r.get(dict_addr);
+      if (dict.ob_type != this->dict_type) {
+        return;
+      }
+      const std::string& type_name = this->name_for_type.at(obj.ob_type);
+      auto& owner_stats = this->stats_for_owner[thread_index];
+      owner_stats[type_name + ".__dict__"].add(this->shell.env, dict_addr.cast<PyObject>());
+      for (const auto& [key, value] : dict.get_items(r)) {
+        if (value.is_null() || key.is_null() || this->shell.env.invalid_reason(value) ||
+            !this->is_container_type(r.get(value).ob_type) || (r.get(key).ob_type != this->str_type)) {
+          continue;
         }
+        auto key_dec = decode_string_types(r, key, 0x40);
+        owner_stats[std::format("{}.{}{}", type_name, key_dec.data, key_dec.excess_bytes ? "..." : "")].add(
+            this->shell.env, value);
+      }
+    } catch (const std::exception&) {
+    }
+  }
 
-        if (count_only) {
-          result_count++;
-        } else {
-          auto t = shell.env.traverse(&args);
-          std::string repr = t.repr(addr);
-          if (!t.is_valid) {
-            return;
-          }
-          result_count++;
-
-          std::lock_guard<std::mutex> g(output_lock);
-          phosg::fwrite_fmt(stderr, CLEAR_LINE);
-          phosg::fwrite_fmt(stdout, "{}\n", repr);
-        }
-      },
-          8, shell.max_threads);
-      phosg::fwrite_fmt(stderr, CLEAR_LINE "{} objects found\n", result_count.load());
-    });
+  virtual void finish() {
+    std::unordered_map<MappedPtr<PyTypeObject>, Stats> overall_stats_for_type;
+    for (const auto& thread_stats_for_type : this->stats_for_type) {
+      for (const auto& [type, stats] : thread_stats_for_type) {
+        overall_stats_for_type[type].merge(stats);
+      }
+    }
+    std::unordered_map<std::string, Stats> overall_stats_for_owner;
+    for (auto& thread_stats_for_owner : this->stats_for_owner) {
+      for (const auto& [owner, stats] : thread_stats_for_owner) {
+        overall_stats_for_owner[owner].merge(stats);
+      }
+      thread_stats_for_owner.clear();
+    }
 
-ShellCommand c_find_references(
-    "find-references", "\
-  find-references ADDRESS [OPTIONS]\n\
-    Find references to the given object, from types that python-memtools\n\
-    implements (importantly, this excludes many types defined in C extension\n\
-    modules, even those that are part of the standard library).\n",
-    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
-      auto target_addr = shell.parse_addr<void>(args.get<std::string>(1, true), args.get<bool>("bswap"));
+    phosg::fwrite_fmt(stdout, "By container type:\n");
+    std::vector<std::pair<std::string, const Stats*>> type_entries;
+    Stats total_stats;
+    for (const auto& [type, stats] : overall_stats_for_type) {
+      type_entries.emplace_back(this->name_for_type.at(type), &stats);
+      total_stats.merge(stats);
+    }
+    this->print_entries(type_entries, type_entries.size());
+    phosg::fwrite_fmt(stdout, "{} slack in {} of buffers in {} containers\n",
+        phosg::format_size(total_stats.slack_bytes), phosg::format_size(total_stats.buffer_bytes), total_stats.count);
+
+    phosg::fwrite_fmt(stdout, "By instance attribute:\n");
+    std::vector<std::pair<std::string, const Stats*>> owner_entries;
+    for (const auto& [owner, stats] : overall_stats_for_owner) {
+      if (stats.slack_bytes > 0) {
+        owner_entries.emplace_back(owner, &stats);
+      }
+    }
+    this->print_entries(owner_entries, this->top_count);
+  }
 
-      std::mutex output_lock;
-      size_t result_count = 0;
-      shell.env.r.map_all_addresses<PyObject>([&](const PyObject& obj, MappedPtr<PyObject> addr, size_t) -> void {
-        // Check if the immediate object is value
-        if (shell.env.invalid_reason(addr)) {
-          return;
-        }
+private:
+  struct Stats {
+    size_t count = 0;
+    size_t buffer_bytes = 0;
+    size_t slack_bytes = 0;
 
-        // Get all referents (this can still throw invalid_object if one of the downstream objects it needs is invalid)
-        std::unordered_set<MappedPtr<void>> referents;
-        try {
-          referents = shell.env.direct_referents(addr);
-        } catch (const invalid_object&) {
-        }
-        if (!referents.count(target_addr)) {
-          return;
-        }
+    void add(const Environment& env, MappedPtr<PyObject> addr) {
+      this->count++;
+      this->buffer_bytes += env.object_extents(addr).buffers_size();
+      this->slack_bytes += env.container_slack(addr);
+    }
+    void merge(const Stats& other) {
+      this->count += other.count;
+      this->buffer_bytes += other.buffer_bytes;
+      this->slack_bytes += other.slack_bytes;
+    }
+  };
 
-        auto t = shell.env.traverse(&args);
-        std::string repr = t.repr(addr);
-        if (!t.is_valid) {
-          return;
-        }
+  inline bool is_container_type(MappedPtr<PyTypeObject> type) const {
+    return (type == this->dict_type) || (type == this->list_type) || (type == this->set_type) ||
+        (type == this->frozenset_type);
+  }
 
-        std::lock_guard<std::mutex> g(output_lock);
-        phosg::fwrite_fmt(stderr, CLEAR_LINE);
-        phosg::fwrite_fmt(stdout, "{}\n", repr);
-        result_count++;
-      },
-          8, shell.max_threads);
-      phosg::fwrite_fmt(stderr, CLEAR_LINE "{} objects found\n", result_count);
+  void print_entries(std::vector<std::pair<std::string, const Stats*>>& entries, size_t max_count) const {
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) -> bool {
+      return (a.second->slack_bytes != b.second->slack_bytes)
+          ? (a.second->slack_bytes > b.second->slack_bytes)
+          : (a.first < b.first);
     });
+    for (size_t z = 0; z < std::min<size_t>(entries.size(), max_count); z++) {
+      const auto& [name, stats] = entries[z];
+      phosg::fwrite_fmt(stdout, "  ({} slack in {} of buffers; {} containers) {}\n",
+          phosg::format_size(stats->slack_bytes), phosg::format_size(stats->buffer_bytes), stats->count, name);
+    }
+    if (entries.size() > max_count) {
+      phosg::fwrite_fmt(stdout, "  ({} more not shown)\n", entries.size() - max_count);
+    }
+  }
 
-ShellCommand c_find_module(
-    "find-module", "\
-  find-module NAME\n\
-    Find all modules with the given name (as in the __name__ attribute). Note\n\
-    that the `sys` module typically contains a dict of all other modules; to\n\
-    find this, use `find-module sys`.\n",
+  AnalysisShell& shell;
+  size_t top_count;
+  std::unordered_map<MappedPtr<PyTypeObject>, std::string> name_for_type;
+  MappedPtr<PyTypeObject> dict_type;
+  MappedPtr<PyTypeObject> list_type;
+  MappedPtr<PyTypeObject> set_type;
+  MappedPtr<PyTypeObject> frozenset_type;
+  MappedPtr<PyTypeObject> str_type;
+  std::vector<std::unordered_map<MappedPtr<PyTypeObject>, Stats>> stats_for_type;
+  std::vector<std::unordered_map<std::string, Stats>> stats_for_owner;
+};
+
+ShellCommand c_container_slack(
+    "container-slack", "\
+  container-slack [OPTIONS]\n\
+    Find memory wasted by over-allocated dicts, lists, and sets. A container\'s\n\
+    slack is the size of its buffers minus the size CPython would allocate for\n\
+    a new container with the same number of items, so a dict that was once\n\
+    large and has since been emptied shows nearly all of its table as slack.\n\
+    Slack is summed by container type, and for the __dict__ of each instance\n\
+    and the containers in its attributes, by the instance\'s type and the\n\
+    attribute name (as TYPE.__dict__ or TYPE.NAME). A container referenced by\n\
+    several instances is counted once for each of them. Options:\n\
+      --top=N: Show this many instance attributes (default 50).\n",
+    &run_visitor<ContainerSlackVisitor>, &make_visitor<ContainerSlackVisitor>);
+
+static std::string format_signed_size(int64_t delta) {
+  return std::format("{}{}", (delta < 0) ? "-" : "+", phosg::format_size((delta < 0) ? -delta : delta));
+}
+
+ShellCommand c_diff(
+    "diff", "\
+  diff --against=PATH [OPTIONS]\n\
+    Compare this snapshot to an earlier snapshot of the same process, and show\n\
+    how the number and total size of the objects of each type changed. Also\n\
+    finds the objects that are new in this snapshot: those for which the\n\
+    earlier snapshot has no valid object of the same type at the same address.\n\
+    Objects of mutable types (lists, dicts, instances of classes, etc.) count\n\
+    as the same object even if their contents changed. Objects of immutable\n\
+    types (str, bytes, tuple, int, and float) count as new if their values\n\
+    differ, since the old object must have been freed and replaced. Each\n\
+    snapshot is scanned once. Options:\n\
+      --against=PATH: The earlier snapshot\'s data path (required).\n\
+      --top=N: Show this many types in each list (default 50).\n\
+      --as=NAME: Save the addresses of all new objects of the shown types as\n\
+          the result set NAME.\n",
     +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
-      auto module_name = args.get<std::string>(1);
-      auto module_type = shell.env.get_type("module");
-      auto dict_type = shell.env.get_type_if_exists("dict");
+      const auto& other_path = args.get<std::string>("against");
+      size_t top_count = args.get<size_t>("top", 50);
+      const auto& set_name = args.get<std::string>("as", false);
 
-      std::mutex output_lock;
-      std::atomic<size_t> result_count = 0;
-      shell.env.r.map_all_addresses<PyObject>([&](const PyObject& obj, MappedPtr<PyObject> addr, size_t) -> void {
-        if ((obj.ob_type != module_type) || shell.env.invalid_reason(addr)) {
-          return;
-        }
+      Environment other_env(other_path);
+      prepare_environment(other_env, shell.max_threads);
+      Census other_census;
+      {
+        ScanProgress progress;
+        other_census = take_census(other_env, shell.max_threads, &progress);
+        phosg::fwrite_fmt(stderr, CLEAR_LINE);
+      }
+
+      struct NewObjects {
+        TypeCensus census;
+        std::vector<MappedPtr<void>> addrs;
+      };
+      auto other_name_for_type = other_env.names_for_types();
+      std::vector<std::unordered_map<std::string, NewObjects>> thread_new_objects(shell.max_threads);
+      Census this_census;
+      {
+        ScanProgress progress;
+        auto& num_new_objects = progress.add_counter("new objects");
+        // Objects of mutable types are expected to change between snapshots, so an object of the same type at the
+        // same address counts as the same object. Objects of immutable types can't change, so if the contents differ,
+        // the old object was freed and a new one was allocated in its place.
+        auto is_in_other_env = [&](MappedPtr<PyObject> addr, const std::string& type_name, const ObjectExtents& extents) -> bool {
+          try {
+            auto type_addr = shell.env.r.get(addr).ob_type;
+            if (other_env.r.get(addr).ob_type != type_addr) {
+              return false;
+            }
+            auto other_name_it = other_name_for_type.find(type_addr);
+            if ((other_name_it == other_name_for_type.end()) || (other_name_it->second != type_name) ||
+                other_env.invalid_reason(addr)) {
+              return false;
+            }
+            if (type_name == "str") {
+              // The hash and the UTF-8 and wchar_t representations are computed lazily, so compare only the kind and
+              // the stored code units
+              if (shell.env.r.get(addr.cast<PyASCIIStringObject>()).char_kind() !=
+                  other_env.r.get(addr.cast<PyASCIIStringObject>()).char_kind()) {
+                return false;
+              }
+              return read_string_storage(shell.env.r, addr).all() == read_string_storage(other_env.r, addr).all();
+            } else if (type_name == "bytes") {
+              // ob_shash is computed lazily too
+              return shell.env.r.get(addr.cast<PyBytesObject>()).read_contents().all() ==
+                  other_env.r.get(addr.cast<PyBytesObject>()).read_contents().all();
+            } else if ((type_name == "tuple") || (type_name == "int") || (type_name == "float")) {
+              // Compare everything after ob_type, up to the end of the object's own allocation
+              auto compare_addr = addr.offset_bytes(sizeof(PyObject));
+              size_t compare_size = (extents.start.addr + extents.size) - compare_addr.addr;
+              return !memcmp(shell.env.r.readv(compare_addr, compare_size),
+                  other_env.r.readv(compare_addr, compare_size), compare_size);
+            } else {
+              return true;
+            }
+          } catch (const std::out_of_range&) {
+            return false;
+          } catch (const invalid_object&) {
+            return false;
+          }
+        };
+        this_census = take_census(shell.env, shell.max_threads, &progress,
+            [&](const PyObject&, MappedPtr<PyObject> addr, const std::string& type_name, const ObjectExtents& extents,
+                size_t thread_index) -> void {
+              if (is_in_other_env(addr, type_name, extents)) {
+                return;
+              }
+              auto& new_objects = thread_new_objects[thread_index][type_name];
+              new_objects.census.count++;
+              new_objects.census.total_size += extents.total_size();
+              if (!set_name.empty()) {
+                new_objects.addrs.emplace_back(addr);
+              }
+              num_new_objects.fetch_add(1, std::memory_order_relaxed);
+            });
+        phosg::fwrite_fmt(stderr, CLEAR_LINE);
+      }
+
+      // Both censuses are sorted by type name, so they can be merged in one pass
+      struct TypeDelta {
+        const std::string* name;
+        TypeCensus before;
+        TypeCensus after;
+        inline int64_t size_delta() const {
+          return static_cast<int64_t>(this->after.total_size) - static_cast<int64_t>(this->before.total_size);
+        }
+        inline int64_t count_delta() const {
+          return static_cast<int64_t>(this->after.count) - static_cast<int64_t>(this->before.count);
+        }
+      };
+      std::vector<TypeDelta> deltas;
+      int64_t total_size_delta = 0;
+      int64_t total_count_delta = 0;
+      for (auto other_it = other_census.begin(), this_it = this_census.begin();
+          (other_it != other_census.end()) || (this_it != this_census.end());) {
+        auto& delta = deltas.emplace_back();
+        if ((this_it == this_census.end()) || ((other_it != other_census.end()) && (other_it->first < this_it->first))) {
+          delta.name = &other_it->first;
+          delta.before = other_it->second;
+          other_it++;
+        } else if ((other_it == other_census.end()) || (this_it->first < other_it->first)) {
+          delta.name = &this_it->first;
+          delta.after = this_it->second;
+          this_it++;
+        } else {
+          delta.name = &this_it->first;
+          delta.before = other_it->second;
+          delta.after = this_it->second;
+          other_it++;
+          this_it++;
+        }
+        if ((delta.size_delta() == 0) && (delta.count_delta() == 0)) {
+          deltas.pop_back();
+        } else {
+          total_size_delta += delta.size_delta();
+          total_count_delta += delta.count_delta();
+        }
+      }
+      std::sort(deltas.begin(), deltas.end(), [](const TypeDelta& a, const TypeDelta& b) -> bool {
+        int64_t a_abs = std::abs(a.size_delta());
+        int64_t b_abs = std::abs(b.size_delta());
+        return (a_abs != b_abs) ? (a_abs > b_abs) : (*a.name < *b.name);
+      });
+
+      phosg::fwrite_fmt(stdout, "{} ({:+} objects) in {} changed types since {}\n",
+          format_signed_size(total_size_delta), total_count_delta, deltas.size(), other_path);
+      for (size_t z = 0; z < std::min<size_t>(top_count, deltas.size()); z++) {
+        const auto& delta = deltas[z];
+        phosg::fwrite_fmt(stdout, "  {} ({:+} objects; {} -> {} objects, {} -> {}) {}\n",
+            format_signed_size(delta.size_delta()), delta.count_delta(), delta.before.count, delta.after.count,
+            phosg::format_size(delta.before.total_size), phosg::format_size(delta.after.total_size), *delta.name);
+      }
+
+      std::unordered_map<std::string, NewObjects> new_objects_for_type;
+      for (auto& thread_new_objects_for_type : thread_new_objects) {
+        for (auto& [type_name, new_objects] : thread_new_objects_for_type) {
+          auto& overall_new_objects = new_objects_for_type[type_name];
+          overall_new_objects.census.count += new_objects.census.count;
+          overall_new_objects.census.total_size += new_objects.census.total_size;
+          overall_new_objects.addrs.insert(
+              overall_new_objects.addrs.end(), new_objects.addrs.begin(), new_objects.addrs.end());
+        }
+        thread_new_objects_for_type.clear();
+      }
+      std::vector<std::pair<const std::string*, NewObjects*>> new_types;
+      TypeCensus total_new;
+      for (auto& [type_name, new_objects] : new_objects_for_type) {
+        new_types.emplace_back(&type_name, &new_objects);
+        total_new.count += new_objects.census.count;
+        total_new.total_size += new_objects.census.total_size;
+      }
+      std::sort(new_types.begin(), new_types.end(), [](const auto& a, const auto& b) -> bool {
+        return (a.second->census.total_size != b.second->census.total_size)
+            ? (a.second->census.total_size > b.second->census.total_size)
+            : (*a.first < *b.first);
+      });
+      if (new_types.size() > top_count) {
+        new_types.resize(top_count);
+      }
+
+      phosg::fwrite_fmt(stdout, "{} new objects ({}) in {} types\n",
+          total_new.count, phosg::format_size(total_new.total_size), new_objects_for_type.size());
+      std::vector<MappedPtr<void>> new_addrs;
+      for (const auto& [type_name, new_objects] : new_types) {
+        phosg::fwrite_fmt(stdout, "  ({} in {} new objects) {}\n",
+            phosg::format_size(new_objects->census.total_size), new_objects->census.count, *type_name);
+        new_addrs.insert(new_addrs.end(), new_objects->addrs.begin(), new_objects->addrs.end());
+      }
+
+      if (!set_name.empty()) {
+        shell.save_result_set(set_name, std::move(new_addrs));
+      }
+    });
+
+ShellCommand c_trend(
+    "trend", "\
+  trend PATH PATH [PATH...] [OPTIONS]\n\
+    Take a census of the objects of each type in each of the given snapshots,\n\
+    which should be of the same process and in chronological order, and rank\n\
+    the types whose total size grows the fastest. Growth rates are fitted by\n\
+    least squares, in bytes and objects per snapshot. Only types whose object\n\
+    count never decreases (and increases overall) are shown by default.\n\
+    Snapshots are loaded only while their census is being taken, so at most\n\
+    --parallel snapshots are mapped at once. The current snapshot isn\'t\n\
+    included unless its path is given. Options:\n\
+      --parallel=N: Take this many censuses at once (default 2). The shell\'s\n\
+          threads are divided between them.\n\
+      --top=N: Show this many types (default 50).\n\
+      --all: Show all types whose total size grew, even if their object count\n\
+          didn\'t grow monotonically.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      std::vector<std::string> paths;
+      for (size_t z = 1;; z++) {
+        auto path = args.get<std::string>(z, false);
+        if (path.empty()) {
+          break;
+        }
+        paths.emplace_back(std::move(path));
+      }
+      if (paths.size() < 2) {
+        throw std::invalid_argument("At least two snapshots are required");
+      }
+      size_t num_parallel = std::clamp<size_t>(args.get<size_t>("parallel", 2), 1, paths.size());
+      size_t top_count = args.get<size_t>("top", 50);
+      bool show_all = args.get<bool>("all");
+      size_t threads_per_census = std::max<size_t>(shell.max_threads / num_parallel, 1);
+
+      std::vector<Census> censuses(paths.size());
+      std::vector<std::exception_ptr> errors(paths.size());
+      std::atomic<size_t> next_index = 0;
+      std::mutex output_lock;
+      auto thread_fn = [&]() -> void {
+        size_t index;
+        while ((index = next_index.fetch_add(1)) < paths.size()) {
+          try {
+            Environment env(paths[index]);
+            prepare_environment(env, threads_per_census);
+            censuses[index] = take_census(env, threads_per_census, nullptr);
+            size_t num_objects = 0;
+            for (const auto& [_, type_census] : censuses[index]) {
+              num_objects += type_census.count;
+            }
+            std::lock_guard<std::mutex> g(output_lock);
+            phosg::fwrite_fmt(stderr, "Found {} objects of {} types in {}\n",
+                num_objects, censuses[index].size(), paths[index]);
+          } catch (...) {
+            errors[index] = std::current_exception();
+          }
+        }
+      };
+      std::vector<std::thread> threads;
+      while (threads.size() < num_parallel) {
+        threads.emplace_back(thread_fn);
+      }
+      for (auto& t : threads) {
+        t.join();
+      }
+      for (const auto& error : errors) {
+        if (error) {
+          std::rethrow_exception(error);
+        }
+      }
+
+      std::set<std::string> type_names;
+      for (const auto& census : censuses) {
+        for (const auto& [type_name, _] : census) {
+          type_names.emplace(type_name);
+        }
+      }
+
+      // Least-squares slope of y over x = 0, 1, 2, ...
+      double x_mean = static_cast<double>(paths.size() - 1) / 2.0;
+      double x_variance_sum = 0.0;
+      for (size_t x = 0; x < paths.size(); x++) {
+        x_variance_sum += (x - x_mean) * (x - x_mean);
+      }
+      auto fit_slope = [&](const std::vector<double>& ys) -> double {
+        double y_mean = 0.0;
+        for (double y : ys) {
+          y_mean += y;
+        }
+        y_mean /= ys.size();
+        double covariance_sum = 0.0;
+        for (size_t x = 0; x < ys.size(); x++) {
+          covariance_sum += (x - x_mean) * (ys[x] - y_mean);
+        }
+        return covariance_sum / x_variance_sum;
+      };
+
+      struct TypeTrend {
+        const std::string* name;
+        double size_slope;
+        double count_slope;
+        TypeCensus first;
+        TypeCensus last;
+        bool is_monotonic;
+      };
+      std::vector<TypeTrend> trends;
+      std::vector<double> sizes(paths.size());
+      std::vector<double> counts(paths.size());
+      for (const auto& type_name : type_names) {
+        bool is_monotonic = true;
+        for (size_t z = 0; z < censuses.size(); z++) {
+          auto it = censuses[z].find(type_name);
+          const TypeCensus& type_census = (it == censuses[z].end()) ? TypeCensus() : it->second;
+          sizes[z] = type_census.total_size;
+          counts[z] = type_census.count;
+          if ((z > 0) && (counts[z] < counts[z - 1])) {
+            is_monotonic = false;
+          }
+        }
+        if (counts.back() <= counts.front()) {
+          is_monotonic = false;
+        }
+        auto& trend = trends.emplace_back(TypeTrend{
+            .name = &type_name,
+            .size_slope = fit_slope(sizes),
+            .count_slope = fit_slope(counts),
+            .first = TypeCensus{static_cast<size_t>(counts.front()), static_cast<size_t>(sizes.front())},
+            .last = TypeCensus{static_cast<size_t>(counts.back()), static_cast<size_t>(sizes.back())},
+            .is_monotonic = is_monotonic});
+        if ((trend.size_slope <= 0.0) || (!show_all && !is_monotonic)) {
+          trends.pop_back();
+        }
+      }
+      std::sort(trends.begin(), trends.end(), [](const TypeTrend& a, const TypeTrend& b) -> bool {
+        return (a.size_slope != b.size_slope) ? (a.size_slope > b.size_slope) : (*a.name < *b.name);
+      });
+      size_t num_growing_types = trends.size();
+      if (trends.size() > top_count) {
+        trends.resize(top_count);
+      }
+
+      phosg::fwrite_fmt(stdout, "{} growing types over {} snapshots\n", num_growing_types, paths.size());
+      for (const auto& trend : trends) {
+        phosg::fwrite_fmt(stdout, "  +{}/snapshot ({:+.1f} objects/snapshot; {} -> {} objects, {} -> {}{}) {}\n",
+            phosg::format_size(static_cast<size_t>(trend.size_slope)), trend.count_slope, trend.first.count, trend.last.count,
+            phosg::format_size(trend.first.total_size), phosg::format_size(trend.last.total_size),
+            trend.is_monotonic ? "" : ", not monotonic", *trend.name);
+      }
+    });
+
+ShellCommand c_export_objects(
+    "export-objects", "\
+  export-objects DIRECTORY [OPTIONS]\n\
+    Writes all objects of known types, and the references between them, to\n\
+    DIRECTORY as a set of memory-mappable column files for analysis with other\n\
+    tools. See the README for a description of the format. Options:\n\
+      --skip-edges: Only write the objects table, not the edges table.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      const auto& directory = args.get<std::string>(1, true);
+      bool skip_edges = args.get<bool>("skip-edges");
+      std::filesystem::create_directories(directory);
+
+      auto name_for_type = shell.env.names_for_types();
+      auto tuple_type = shell.env.get_type_if_exists("tuple");
+      auto list_type = shell.env.get_type_if_exists("list");
+      auto bytes_type = shell.env.get_type_if_exists("bytes");
+      auto str_type = shell.env.get_type_if_exists("str");
+      auto dict_type = shell.env.get_type_if_exists("dict");
+      auto set_type = shell.env.get_type_if_exists("set");
+      auto container_length = [&](const PyObject& obj, MappedPtr<PyObject> addr) -> int64_t {
+        if ((obj.ob_type == tuple_type) || (obj.ob_type == list_type) || (obj.ob_type == bytes_type)) {
+          return shell.env.r.get(addr.cast<PyVarObject>()).ob_size;
+        } else if (obj.ob_type == str_type) {
+          return shell.env.r.get(addr.cast<PyASCIIStringObject>()).length;
+        } else if (obj.ob_type == dict_type) {
+          return shell.env.r.get(addr.cast<PyDictObject>()).ma_used;
+        } else if (obj.ob_type == set_type) {
+          return shell.env.r.get(addr.cast<PySetObject>()).used;
+        } else {
+          return -1;
+        }
+      };
+
+      ColumnTableWriter objects_table(directory, "objects",
+          {{"address", 'u'}, {"type", 'u'}, {"size", 'u'}, {"refcount", 'u'}, {"length", 'i'}});
+      ColumnTableWriter edges_table(directory, "edges", {{"src", 'u'}, {"dst", 'u'}});
+      std::vector<ColumnTableWriter::RowGroup> object_groups;
+      std::vector<ColumnTableWriter::RowGroup> edge_groups;
+      object_groups.reserve(shell.max_threads);
+      edge_groups.reserve(shell.max_threads);
+      for (size_t z = 0; z < shell.max_threads; z++) {
+        object_groups.emplace_back(objects_table.row_group());
+        edge_groups.emplace_back(edges_table.row_group());
+      }
+
+      shell.env.r.map_all_addresses<PyObject>(
+          [&](const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) -> void {
+            if (!name_for_type.count(obj.ob_type) || shell.env.invalid_reason(addr)) {
+              return;
+            }
+
+            size_t size;
+            int64_t length;
+            try {
+              size = shell.env.shallow_size(addr);
+              length = container_length(obj, addr);
+            } catch (const std::out_of_range&) {
+              return;
+            }
+            object_groups[thread_index].add_row({addr.addr, obj.ob_type.addr, size, obj.ob_refcnt, static_cast<uint64_t>(length)});
+
+            if (!skip_edges) {
+              std::unordered_set<MappedPtr<void>> referents;
+              try {
+                referents = shell.env.direct_referents(addr);
+              } catch (const invalid_object&) {
+              }
+              for (auto referent : referents) {
+                if (!referent.is_null()) {
+                  edge_groups[thread_index].add_row({addr.addr, referent.addr});
+                }
+              }
+            }
+          },
+          8, shell.max_threads);
+
+      for (auto& group : object_groups) {
+        group.flush();
+      }
+      for (auto& group : edge_groups) {
+        group.flush();
+      }
+      objects_table.finalize();
+      edges_table.finalize();
+
+      auto tables_json = phosg::JSON::dict();
+      for (const auto* table : {&objects_table, &edges_table}) {
+        auto columns_json = phosg::JSON::list();
+        for (const auto& column : table->get_columns()) {
+          columns_json.emplace_back(phosg::JSON::dict({
+              {"name", column.name},
+              {"type", std::string(1, column.type)},
+              {"width", sizeof(uint64_t)},
+              {"filename", std::format("{}.{}.col", table->name(), column.name)},
+          }));
+        }
+        tables_json.emplace(table->name(), phosg::JSON::dict({
+                                               {"row_count", table->row_count()},
+                                               {"columns", std::move(columns_json)},
+                                           }));
+      }
+      auto types_json = phosg::JSON::dict();
+      for (const auto& [name, addr] : shell.env.type_objects) {
+        types_json.emplace(name, addr.addr);
+      }
+      auto manifest_json = phosg::JSON::dict({
+          {"format_version", 1},
+          {"data_path", shell.env.data_path},
+          {"tables", std::move(tables_json)},
+          {"types", std::move(types_json)},
+      });
+      phosg::save_file(std::format("{}/manifest.json", directory), manifest_json.serialize());
+
+      phosg::fwrite_fmt(stderr, CLEAR_LINE "Wrote {} objects and {} edges to {}\n",
+          objects_table.row_count(), edges_table.row_count(), directory);
+    });
+
+class FindAllObjectsVisitor : public ObjectVisitor {
+public:
+  FindAllObjectsVisitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress& progress)
+      : shell(shell),
+        args(args),
+        type_addr(args.get<uint64_t>("type-addr", 0, phosg::Arguments::IntFormat::HEX)),
+        count_only(args.get<bool>("count")),
+        output(shell.max_threads, OrderedOutput::parse_order(args.get<std::string>("sort", false))),
+        result_set(shell, args),
+        result_count(progress.add_counter("objects")) {
+    // TODO: It'd be nice to have something like --max-results=N here
+    if (this->type_addr.is_null()) {
+      const std::string& type_name = args.get<std::string>("type-name", false);
+      this->type_addr = shell.env.type_objects.at(type_name);
+    }
+  }
+
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    if ((obj.ob_type != this->type_addr) || this->shell.env.invalid_reason(addr)) {
+      return;
+    }
+
+    if (this->count_only) {
+      this->result_count.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      auto t = this->shell.env.traverse(&this->args);
+      std::string repr = t.repr(addr);
+      if (!t.is_valid) {
+        return;
+      }
+      this->result_count.fetch_add(1, std::memory_order_relaxed);
+      repr.push_back('\n');
+      this->output.add(thread_index, addr.addr, std::move(repr));
+    }
+    this->result_set.add(thread_index, addr);
+  }
+
+  virtual void finish() {
+    this->output.write(stdout);
+    phosg::fwrite_fmt(stderr, "{} objects found\n", this->result_count.load());
+    this->result_set.save();
+  }
+
+private:
+  AnalysisShell& shell;
+  phosg::Arguments& args;
+  MappedPtr<PyTypeObject> type_addr;
+  bool count_only;
+  OrderedOutput output;
+  ResultSetCollector result_set;
+  std::atomic<size_t>& result_count;
+};
+
+ShellCommand c_find_all_objects(
+    "find-all-objects", "\
+  find-all-objects [OPTIONS]\n\
+    Finds all objects of a given type. Options:\n\
+      --type-addr=ADDRESS: Find objects whose type object is at this address.\n\
+      --type-name=NAME: Find objects whose type has this name.\n\
+      --count: Only count the number of objects; don\'t print them.\n\
+      --sort=ORDER: Print objects in this order: address (default) or repr.\n\
+      --as=NAME: Save the found objects\' addresses as the result set NAME.\n\
+    The formatting options to the repr command are also valid here.\n",
+    &run_visitor<FindAllObjectsVisitor>, &make_visitor<FindAllObjectsVisitor>);
+
+ShellCommand c_find_references(
+    "find-references", "\
+  find-references [ADDRESS|@SET ...] [OPTIONS]\n\
+    Find references to the given objects, from types that python-memtools\n\
+    implements (importantly, this excludes many types defined in C extension\n\
+    modules, even those that are part of the standard library). All targets\n\
+    are searched for in a single scan. If there are multiple targets, each\n\
+    result is preceded by the address of the target it refers to, and objects\n\
+    that refer to multiple targets appear once for each. A histogram of the\n\
+    referring objects\' types is printed at the end. Options:\n\
+      --targets-file=FILENAME: Also search for references to the addresses in\n\
+          this file (one per line).\n\
+      --target-type=NAME: Also search for references to all objects of this\n\
+          type.\n\
+      --sort=ORDER: Print objects in this order: address (default) or repr.\n\
+          With multiple targets, address order groups results by target.\n\
+      --as=NAME: Save the referring objects\' addresses as the result set NAME.\n\
+    The formatting options to the repr command are also valid here.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      bool bswap = args.get<bool>("bswap");
+      std::unordered_set<MappedPtr<void>> target_addrs;
+      for (size_t z = 1;; z++) {
+        const auto& addr_str = args.get<std::string>(z, false);
+        if (addr_str.empty()) {
+          break;
+        }
+        for (auto addr : shell.parse_addrs(addr_str, bswap)) {
+          target_addrs.emplace(addr);
+        }
+      }
+      const auto& targets_filename = args.get<std::string>("targets-file", false);
+      if (!targets_filename.empty()) {
+        for (std::string line : phosg::split(phosg::load_file(targets_filename), '\n')) {
+          phosg::strip_whitespace(line);
+          if (!line.empty() && !line.starts_with("#")) {
+            for (auto addr : shell.parse_addrs(line, bswap)) {
+              target_addrs.emplace(addr);
+            }
+          }
+        }
+      }
+      // Objects of the target type are recognized as they're encountered as referents, so they don't need to be found
+      // with a separate scan first
+      MappedPtr<PyTypeObject> target_type;
+      const auto& target_type_name = args.get<std::string>("target-type", false);
+      if (!target_type_name.empty()) {
+        target_type = shell.env.get_type(target_type_name.c_str());
+      }
+      if (target_addrs.empty() && target_type.is_null()) {
+        throw std::invalid_argument("No targets given");
+      }
+      bool multiple_targets = !target_type.is_null() || (target_addrs.size() > 1);
+
+      auto is_target = [&](MappedPtr<void> referent) -> bool {
+        if (target_addrs.count(referent)) {
+          return true;
+        }
+        if (target_type.is_null()) {
+          return false;
+        }
+        auto obj_addr = referent.cast<PyObject>();
+        return shell.env.r.obj_valid(obj_addr) &&
+            (shell.env.r.get(obj_addr).ob_type == target_type) &&
+            !shell.env.invalid_reason(obj_addr);
+      };
+
+      OrderedOutput output(shell.max_threads, OrderedOutput::parse_order(args.get<std::string>("sort", false)));
+      ResultSetCollector result_set(shell, args);
+      std::vector<std::unordered_map<MappedPtr<PyTypeObject>, size_t>> count_for_type(shell.max_threads);
+      std::atomic<size_t> result_count = 0;
+      std::atomic<size_t> reference_count = 0;
+      shell.env.r.map_all_addresses<PyObject>([&](const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) -> void {
+        // Check if the immediate object is value
+        if (shell.env.invalid_reason(addr)) {
+          return;
+        }
+
+        // Get all referents (this can still throw invalid_object if one of the downstream objects it needs is invalid)
+        std::unordered_set<MappedPtr<void>> referents;
+        try {
+          referents = shell.env.direct_referents(addr);
+        } catch (const invalid_object&) {
+        }
+        std::vector<MappedPtr<void>> found_targets;
+        for (const auto& referent : referents) {
+          if (is_target(referent)) {
+            found_targets.emplace_back(referent);
+          }
+        }
+        if (found_targets.empty()) {
+          return;
+        }
+
+        auto t = shell.env.traverse(&args);
+        std::string repr = t.repr(addr);
+        if (!t.is_valid) {
+          return;
+        }
+
+        result_count++;
+        reference_count += found_targets.size();
+        count_for_type[thread_index][obj.ob_type]++;
+        result_set.add(thread_index, addr);
+        if (multiple_targets) {
+          for (auto target : found_targets) {
+            output.add(thread_index, target.addr, std::format("{} <- {}\n", target, repr));
+          }
+        } else {
+          repr.push_back('\n');
+          output.add(thread_index, addr.addr, std::move(repr));
+        }
+      },
+          8, shell.max_threads);
+      phosg::fwrite_fmt(stderr, CLEAR_LINE);
+      output.write(stdout);
+      phosg::fwrite_fmt(stderr, "{} objects found with {} references to targets\n", result_count.load(),
+          reference_count.load());
+
+      std::unordered_map<MappedPtr<PyTypeObject>, size_t> overall_count_for_type;
+      for (const auto& thread_count_for_type : count_for_type) {
+        for (const auto& [type, count] : thread_count_for_type) {
+          overall_count_for_type[type] += count;
+        }
+      }
+      auto name_for_type = shell.env.names_for_types();
+      std::vector<std::tuple<size_t, std::string, MappedPtr<PyTypeObject>>> entries;
+      for (const auto& [type_addr, count] : overall_count_for_type) {
+        auto name_it = name_for_type.find(type_addr);
+        entries.emplace_back(std::make_tuple(
+            count, (name_it == name_for_type.end()) ? "<unknown type>" : name_it->second, type_addr));
+      }
+      std::sort(entries.begin(), entries.end());
+      for (const auto& [count, name, type_addr] : entries) {
+        phosg::fwrite_fmt(stdout, "({} referring objects) {} @ {}\n", count, name, type_addr);
+      }
+      result_set.save();
+    });
+
+ShellCommand c_build_graph(
+    "build-graph", "\
+  build-graph [--memory-limit=BYTES]\n\
+    Find all objects and the references between them, and save the resulting\n\
+    graph in a file next to the snapshot. Commands that use the graph (like\n\
+    graph-edges) load it from this file, so this only needs to be done once\n\
+    per snapshot (or again after finding more types). Options:\n\
+      --memory-limit=BYTES: Buffer references in memory until they use this\n\
+          many bytes (default: 1/4 of physical memory). Beyond this, they are\n\
+          found a second time and written directly to the graph file instead.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      size_t default_memory_limit = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) / 4;
+      size_t memory_limit = args.get<uint64_t>("memory-limit", default_memory_limit);
+      // Unmap the previous graph, if any, before replacing its file
+      shell.graph.reset();
+      shell.graph = ObjectGraph::build(
+          shell.env, ObjectGraph::filename_for_environment(shell.env), shell.max_threads, memory_limit);
+      phosg::fwrite_fmt(stderr, "Built object graph with {} objects and {} references\n",
+          shell.graph->node_count(), shell.graph->edge_count());
+    });
+
+ShellCommand c_graph_edges(
+    "graph-edges", "\
+  graph-edges ADDRESS|@SET [OPTIONS]\n\
+    Show the objects that the given objects refer to, using the object graph\n\
+    instead of scanning memory. Run build-graph first. Options:\n\
+      --reverse: Show the objects that refer to the given objects instead.\n\
+      --as=NAME: Save the found objects\' addresses as the result set NAME.\n\
+    The formatting options to the repr command are also valid here.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      const auto& graph = shell.get_graph();
+      bool reverse = args.get<bool>("reverse");
+
+      std::vector<MappedPtr<void>> found_addrs;
+      for (auto addr : shell.parse_addrs(args.get<std::string>(1, true), args.get<bool>("bswap"))) {
+        uint32_t id = graph.id_for_addr(addr);
+        if (id == ObjectGraph::INVALID_ID) {
+          phosg::fwrite_fmt(stderr, "{} is not an object in the graph\n", addr);
+          continue;
+        }
+        phosg::fwrite_fmt(stdout, "{} {}:\n", addr, reverse ? "is referred to by" : "refers to");
+        for (uint32_t other_id : reverse ? graph.referrers(id) : graph.referents(id)) {
+          auto other_addr = graph.addr_for_id(other_id);
+          phosg::fwrite_fmt(stdout, "  {}\n", shell.env.traverse(&args).repr(other_addr));
+          found_addrs.emplace_back(other_addr);
+        }
+      }
+
+      const auto& set_name = args.get<std::string>("as", false);
+      if (!set_name.empty()) {
+        shell.save_result_set(set_name, std::move(found_addrs));
+      }
+    });
+
+ShellCommand c_retained_sizes(
+    "retained-sizes", "\
+  retained-sizes [OPTIONS]\n\
+    Compute the dominator tree of the object graph, and show the objects and\n\
+    types that keep the most memory alive. An object\'s retained size is the\n\
+    total size of all objects that would be freed if it were freed. Roots\n\
+    are type objects, modules, running frames, and immortal interned strings.\n\
+    A type\'s retained size counts only objects that aren\'t dominated by\n\
+    another object of the same type, so nested objects aren\'t counted twice.\n\
+    Run build-graph first. Options:\n\
+      --top=N: Show this many objects and types (default 20).\n\
+      --include-unreferenced: Also treat objects with no known referrers as\n\
+          roots. These are usually referenced from C extension objects.\n\
+      --as=NAME: Save the addresses of the top objects as the result set NAME.\n\
+    The formatting options to the repr command are also valid here.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      size_t top_count = args.get<size_t>("top", 20);
+      const auto& graph = shell.get_graph();
+      auto root_kinds = find_roots(shell.env, graph, shell.max_threads, args.get<bool>("include-unreferenced"));
+      auto sizes = object_sizes(shell.env, graph, shell.max_threads);
+      phosg::fwrite_fmt(stderr, "Computing dominator tree\n");
+      DominatorTree dom(graph, root_kinds);
+      auto retained = dom.retained_sizes(sizes);
+
+      size_t total_size = 0;
+      for (uint64_t size : sizes) {
+        total_size += size;
+      }
+      phosg::fwrite_fmt(stdout, "{} of {} objects ({} of {}) are reachable from roots\n",
+          dom.size() - 1, graph.node_count(), phosg::format_size(retained[0]), phosg::format_size(total_size));
+
+      // Walk the dominator tree depth-first, keeping track of how many objects of each type are on the current path, so
+      // only the outermost object of each type contributes to that type's retained size
+      std::vector<uint64_t> child_offsets(dom.size() + 1, 0);
+      for (size_t z = 1; z < dom.size(); z++) {
+        child_offsets[dom.idom[z] + 1]++;
+      }
+      for (size_t z = 0; z < dom.size(); z++) {
+        child_offsets[z + 1] += child_offsets[z];
+      }
+      std::vector<uint32_t> children(dom.size() - 1);
+      {
+        std::vector<uint64_t> cursors(child_offsets.begin(), child_offsets.end() - 1);
+        for (size_t z = 1; z < dom.size(); z++) {
+          children[cursors[dom.idom[z]]++] = z;
+        }
+      }
+
+      struct TypeStats {
+        size_t count = 0;
+        size_t own_size = 0;
+        size_t retained_size = 0;
+        size_t active_count = 0;
+      };
+      std::unordered_map<MappedPtr<PyTypeObject>, TypeStats> stats_for_type;
+      std::vector<TypeStats*> stats_for_index(dom.size(), nullptr);
+      std::vector<std::pair<uint32_t, uint64_t>> stack; // (index, next child offset)
+      stack.emplace_back(0, child_offsets[0]);
+      while (!stack.empty()) {
+        auto [index, next_child] = stack.back();
+        if (next_child < child_offsets[index + 1]) {
+          stack.back().second++;
+          uint32_t child_index = children[next_child];
+          uint32_t id = dom.id_for_index[child_index];
+          auto& stats = stats_for_type[shell.env.r.get(graph.addr_for_id(id)).ob_type];
+          stats.count++;
+          stats.own_size += sizes[id];
+          if (stats.active_count++ == 0) {
+            stats.retained_size += retained[child_index];
+          }
+          stats_for_index[child_index] = &stats;
+          stack.emplace_back(child_index, child_offsets[child_index]);
+        } else {
+          if (stats_for_index[index]) {
+            stats_for_index[index]->active_count--;
+          }
+          stack.pop_back();
+        }
+      }
+
+      std::vector<std::pair<uint64_t, uint32_t>> top_objects;
+      for (size_t z = 1; z < dom.size(); z++) {
+        top_objects.emplace_back(retained[z], z);
+      }
+      size_t num_top_objects = std::min<size_t>(top_count, top_objects.size());
+      std::partial_sort(top_objects.begin(), top_objects.begin() + num_top_objects, top_objects.end(),
+          std::greater<std::pair<uint64_t, uint32_t>>());
+      top_objects.resize(num_top_objects);
+
+      phosg::fwrite_fmt(stdout, "Objects with the largest retained sizes:\n");
+      std::vector<MappedPtr<void>> top_addrs;
+      for (const auto& [retained_size, index] : top_objects) {
+        uint32_t id = dom.id_for_index[index];
+        auto addr = graph.addr_for_id(id);
+        auto t = shell.env.traverse(&args);
+        t.is_short = true;
+        if (t.max_recursion_depth < 0) {
+          t.max_recursion_depth = 0;
+        }
+        const char* root_str = (root_kinds[id] == RootKind::NONE) ? "" : " (root)";
+        phosg::fwrite_fmt(stdout, "  {} retained, {} own{}: {}\n",
+            phosg::format_size(retained_size), phosg::format_size(sizes[id]), root_str, t.repr(addr));
+        top_addrs.emplace_back(addr);
+      }
+
+      auto name_for_type = shell.env.names_for_types();
+      std::vector<std::tuple<size_t, std::string, const TypeStats*>> top_types;
+      for (const auto& [type_addr, stats] : stats_for_type) {
+        auto name_it = name_for_type.find(type_addr);
+        top_types.emplace_back(
+            stats.retained_size, (name_it == name_for_type.end()) ? "<unknown type>" : name_it->second, &stats);
+      }
+      std::sort(top_types.begin(), top_types.end(), [](const auto& a, const auto& b) -> bool {
+        return (std::get<0>(a) != std::get<0>(b)) ? (std::get<0>(a) > std::get<0>(b)) : (std::get<1>(a) < std::get<1>(b));
+      });
+      if (top_types.size() > top_count) {
+        top_types.resize(top_count);
+      }
+      phosg::fwrite_fmt(stdout, "Types with the largest retained sizes:\n");
+      for (const auto& [retained_size, name, stats] : top_types) {
+        phosg::fwrite_fmt(stdout, "  {} retained, {} own ({} objects): {}\n",
+            phosg::format_size(retained_size), phosg::format_size(stats->own_size), stats->count, name);
+      }
+
+      const auto& set_name = args.get<std::string>("as", false);
+      if (!set_name.empty()) {
+        shell.save_result_set(set_name, std::move(top_addrs));
+      }
+    });
+
+ShellCommand c_path_to_root(
+    "path-to-root", "\
+  path-to-root ADDRESS|@SET [OPTIONS]\n\
+    Show the shortest chain of references from a root to each of the given\n\
+    objects; that is, why the object is still alive. Roots are the same as\n\
+    for retained-sizes. Each step shows how the previous object refers to the\n\
+    next one: a dict key, a list or tuple index, a frame local, a field name,\n\
+    or an offset within the referring object. Run build-graph first. Options:\n\
+      --count=N: Show paths from up to N different roots (default 1).\n\
+      --include-unreferenced: Also treat objects with no known referrers as\n\
+          roots. These are usually referenced from C extension objects.\n\
+    The formatting options to the repr command are also valid here.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      size_t max_paths = args.get<size_t>("count", 1);
+      const auto& graph = shell.get_graph();
+      auto root_kinds = find_roots(shell.env, graph, shell.max_threads, args.get<bool>("include-unreferenced"));
+
+      auto repr = [&](MappedPtr<PyObject> addr) -> std::string {
+        auto t = shell.env.traverse(&args);
+        t.is_short = true;
+        if (t.max_recursion_depth < 0) {
+          t.max_recursion_depth = 0;
+        }
+        return t.repr(addr);
+      };
+
+      for (auto target_addr : shell.parse_addrs(args.get<std::string>(1, true), args.get<bool>("bswap"))) {
+        uint32_t target_id = graph.id_for_addr(target_addr);
+        if (target_id == ObjectGraph::INVALID_ID) {
+          phosg::fwrite_fmt(stderr, "{} is not an object in the graph\n", target_addr);
+          continue;
+        }
+
+        auto paths = paths_to_roots(graph, root_kinds, target_id, max_paths);
+        if (paths.empty()) {
+          phosg::fwrite_fmt(stdout, "{} is not reachable from any root\n", target_addr);
+          continue;
+        }
+        for (size_t path_index = 0; path_index < paths.size(); path_index++) {
+          const auto& path = paths[path_index];
+          phosg::fwrite_fmt(stdout, "Path {} to {} ({} references, from {}):\n", path_index + 1, target_addr,
+              path.size() - 1, name_for_root_kind(root_kinds[path[0]]));
+          phosg::fwrite_fmt(stdout, "  {}\n", repr(graph.addr_for_id(path[0])));
+          for (size_t z = 1; z < path.size(); z++) {
+            auto referrer_addr = graph.addr_for_id(path[z - 1]);
+            auto addr = graph.addr_for_id(path[z]);
+            std::string label = describe_reference(shell.env, referrer_addr, addr);
+            phosg::fwrite_fmt(stdout, "  {} -> {}\n", label.empty() ? "?" : label, repr(addr));
+          }
+        }
+      }
+    });
+
+ShellCommand c_scc(
+    "scc", "\
+  scc [OPTIONS]\n\
+    Find reference cycles: sets of objects that all refer to each other,\n\
+    directly or indirectly (strongly connected components of the object\n\
+    graph). Cycles are grouped by the types of their members, and groups are\n\
+    shown in decreasing order of total size. Run build-graph first. Options:\n\
+      --min-size=N: Only show cycles of at least N objects (default 2).\n\
+      --top=N: Show this many groups (default 20).\n\
+      --as=NAME: Save the addresses of all objects in the shown cycles as the\n\
+          result set NAME.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      size_t min_size = args.get<size_t>("min-size", 2);
+      size_t top_count = args.get<size_t>("top", 20);
+      const auto& set_name = args.get<std::string>("as", false);
+      const auto& graph = shell.get_graph();
+      auto sizes = object_sizes(shell.env, graph, shell.max_threads);
+      size_t num_components;
+      auto component_for_id = strongly_connected_components(graph, &num_components);
+
+      std::vector<std::vector<uint32_t>> members(num_components);
+      for (size_t id = 0; id < component_for_id.size(); id++) {
+        members[component_for_id[id]].emplace_back(id);
+      }
+
+      struct Group {
+        size_t num_cycles = 0;
+        size_t num_objects = 0;
+        size_t total_size = 0;
+        MappedPtr<PyObject> example_addr;
+        std::vector<uint32_t> ids;
+      };
+      auto name_for_type = shell.env.names_for_types();
+      std::unordered_map<std::string, Group> groups;
+      size_t num_cycles = 0;
+      for (const auto& ids : members) {
+        if (ids.size() < min_size) {
+          continue;
+        }
+        num_cycles++;
+        std::map<std::string, size_t> count_for_type_name;
+        size_t total_size = 0;
+        for (uint32_t id : ids) {
+          auto name_it = name_for_type.find(shell.env.r.get(graph.addr_for_id(id)).ob_type);
+          count_for_type_name[(name_it == name_for_type.end()) ? "<unknown type>" : name_it->second]++;
+          total_size += sizes[id];
+        }
+        std::string key;
+        for (const auto& [name, count] : count_for_type_name) {
+          key += key.empty() ? "" : ", ";
+          key += std::format("{} x{}", name, count);
+        }
+        auto& group = groups[key];
+        group.num_cycles++;
+        group.num_objects += ids.size();
+        group.total_size += total_size;
+        if (group.example_addr.is_null()) {
+          group.example_addr = graph.addr_for_id(ids[0]);
+        }
+        if (!set_name.empty()) {
+          group.ids.insert(group.ids.end(), ids.begin(), ids.end());
+        }
+      }
+
+      std::vector<std::pair<const std::string*, const Group*>> sorted_groups;
+      for (const auto& [key, group] : groups) {
+        sorted_groups.emplace_back(&key, &group);
+      }
+      std::sort(sorted_groups.begin(), sorted_groups.end(), [](const auto& a, const auto& b) -> bool {
+        return (a.second->total_size != b.second->total_size)
+            ? (a.second->total_size > b.second->total_size)
+            : (*a.first < *b.first);
+      });
+      if (sorted_groups.size() > top_count) {
+        sorted_groups.resize(top_count);
+      }
+
+      phosg::fwrite_fmt(stdout, "Found {} cycles of at least {} objects, in {} groups\n",
+          num_cycles, min_size, groups.size());
+      std::vector<MappedPtr<void>> shown_addrs;
+      for (const auto& [key, group] : sorted_groups) {
+        phosg::fwrite_fmt(stdout, "{} in {} cycles ({} objects, e.g. @{}): {}\n",
+            phosg::format_size(group->total_size), group->num_cycles, group->num_objects, group->example_addr, *key);
+        for (uint32_t id : group->ids) {
+          shown_addrs.emplace_back(graph.addr_for_id(id));
+        }
+      }
+
+      if (!set_name.empty()) {
+        shell.save_result_set(set_name, std::move(shown_addrs));
+      }
+    });
+
+// Returns the number of references from referrer to target, counted as the number of aligned pointers to target in the
+// referrer's own memory and the buffers it owns (see Environment::object_extents). The graph only records whether there
+// is a reference, but a list or tuple may hold the same object many times, and a dict may hold it as both a key and a
+// value. This is called only for referrers the graph already found, so it returns at least 1, even if the reference is
+// held in memory the referrer doesn't own (like a split dict's shared keys table).
+static size_t count_references(const Environment& env, MappedPtr<PyObject> referrer, MappedPtr<PyObject> target) {
+  size_t count = 0;
+  try {
+    auto extents = env.object_extents(referrer);
+    // Skip the GC header, which points to other objects' GC headers rather than to objects
+    size_t header_size = referrer.addr - extents.start.addr;
+    std::vector<std::pair<MappedPtr<void>, size_t>> ranges = {{referrer.cast<void>(), extents.size - header_size}};
+    ranges.insert(ranges.end(), extents.buffers.begin(), extents.buffers.end());
+    for (const auto& [addr, size] : ranges) {
+      auto r = env.r.read(addr, size & ~7);
+      while (!r.eof()) {
+        count += (r.get_u64l() == target.addr);
+      }
+    }
+  } catch (const std::out_of_range&) {
+  }
+  return std::max<size_t>(count, 1);
+}
+
+ShellCommand c_refcount_audit(
+    "refcount-audit", "\
+  refcount-audit [OPTIONS]\n\
+    Compare each object\'s reference count to the number of references to it\n\
+    found in the object graph, and show the types with the most unexplained\n\
+    references. Many objects of one type with excess references often means a\n\
+    C extension is leaking references to them. References from instances to\n\
+    their types are counted, and a referrer that holds the same object in\n\
+    several places (like a list containing it many times) counts once for\n\
+    each; references from objects of types that python-memtools doesn\'t\n\
+    decode, and from C code, are not counted, so singletons like None always\n\
+    appear here. Run build-graph first. Options:\n\
+      --min-excess=N: Only count objects with at least N unexplained\n\
+          references (default 10).\n\
+      --top=N: Show this many types (default 20).\n\
+      --examples=N: Show this many objects with the most unexplained\n\
+          references for each type (default 3).\n\
+      --as=NAME: Save the addresses of all counted objects of the shown types\n\
+          as the result set NAME.\n\
+    The formatting options to the repr command are also valid here.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      int64_t min_excess = args.get<int64_t>("min-excess", 10);
+      size_t top_count = args.get<size_t>("top", 20);
+      size_t num_examples = args.get<size_t>("examples", 3);
+      const auto& set_name = args.get<std::string>("as", false);
+      const auto& graph = shell.get_graph();
+
+      // Instances refer to their types via ob_type, but the graph doesn't include these references, so count them
+      // separately
+      std::vector<std::unordered_map<MappedPtr<PyTypeObject>, size_t>> thread_instance_counts(shell.max_threads);
+      ObjectGraph::parallel_ranges(shell.env.r, graph.node_count(), shell.max_threads,
+          [&](size_t start, size_t end, size_t thread_index) -> void {
+            auto& instance_counts = thread_instance_counts[thread_index];
+            for (size_t id = start; id < end; id++) {
+              instance_counts[shell.env.r.get(graph.addr_for_id(id)).ob_type]++;
+            }
+          });
+      std::unordered_map<MappedPtr<PyTypeObject>, size_t> instance_counts;
+      for (const auto& thread_counts : thread_instance_counts) {
+        for (const auto& [type, count] : thread_counts) {
+          instance_counts[type] += count;
+        }
+      }
+
+      struct TypeStats {
+        size_t num_objects = 0;
+        size_t num_excess_objects = 0;
+        size_t total_excess = 0;
+        std::vector<std::pair<int64_t, uint32_t>> excess_ids; // (excess, id)
+      };
+      std::vector<std::unordered_map<MappedPtr<PyTypeObject>, TypeStats>> thread_stats(shell.max_threads);
+      ObjectGraph::parallel_ranges(shell.env.r, graph.node_count(), shell.max_threads,
+          [&](size_t start, size_t end, size_t thread_index) -> void {
+            auto& stats_for_type = thread_stats[thread_index];
+            for (size_t id = start; id < end; id++) {
+              auto addr = graph.addr_for_id(id);
+              const auto& obj = shell.env.r.get(addr);
+              auto& stats = stats_for_type[obj.ob_type];
+              stats.num_objects++;
+              int64_t instance_refs = 0;
+              auto instances_it = instance_counts.find(addr.cast<PyTypeObject>());
+              if (instances_it != instance_counts.end()) {
+                instance_refs = instances_it->second;
+              }
+              // The graph has one edge per referrer, which is a lower bound on the number of references, so only
+              // count each referrer's references for objects that might have excess references
+              const auto& referrers = graph.referrers(id);
+              int64_t excess = obj.ob_refcnt - instance_refs - static_cast<int64_t>(referrers.size());
+              if (excess < min_excess) {
+                continue;
+              }
+              int64_t known_refs = instance_refs;
+              for (uint32_t referrer_id : referrers) {
+                known_refs += count_references(shell.env, graph.addr_for_id(referrer_id), addr);
+              }
+              excess = obj.ob_refcnt - known_refs;
+              if (excess >= min_excess) {
+                stats.num_excess_objects++;
+                stats.total_excess += excess;
+                stats.excess_ids.emplace_back(excess, id);
+              }
+            }
+          });
+
+      std::unordered_map<MappedPtr<PyTypeObject>, TypeStats> stats_for_type;
+      for (auto& thread_stats_for_type : thread_stats) {
+        for (auto& [type, stats] : thread_stats_for_type) {
+          auto& overall_stats = stats_for_type[type];
+          overall_stats.num_objects += stats.num_objects;
+          overall_stats.num_excess_objects += stats.num_excess_objects;
+          overall_stats.total_excess += stats.total_excess;
+          overall_stats.excess_ids.insert(overall_stats.excess_ids.end(), stats.excess_ids.begin(), stats.excess_ids.end());
+        }
+        thread_stats_for_type.clear();
+      }
+
+      auto name_for_type = shell.env.names_for_types();
+      std::vector<std::tuple<size_t, std::string, TypeStats*>> top_types;
+      for (auto& [type_addr, stats] : stats_for_type) {
+        if (stats.num_excess_objects == 0) {
+          continue;
+        }
+        auto name_it = name_for_type.find(type_addr);
+        top_types.emplace_back(
+            stats.total_excess, (name_it == name_for_type.end()) ? "<unknown type>" : name_it->second, &stats);
+      }
+      std::sort(top_types.begin(), top_types.end(), [](const auto& a, const auto& b) -> bool {
+        return (std::get<0>(a) != std::get<0>(b)) ? (std::get<0>(a) > std::get<0>(b)) : (std::get<1>(a) < std::get<1>(b));
+      });
+      phosg::fwrite_fmt(stdout, "Found {} types with at least {} unexplained references on some objects\n",
+          top_types.size(), min_excess);
+      if (top_types.size() > top_count) {
+        top_types.resize(top_count);
+      }
+
+      std::vector<MappedPtr<void>> found_addrs;
+      for (const auto& [total_excess, name, stats] : top_types) {
+        phosg::fwrite_fmt(stdout, "({} unexplained references on {} of {} objects) {}\n",
+            total_excess, stats->num_excess_objects, stats->num_objects, name);
+        size_t num_type_examples = std::min<size_t>(num_examples, stats->excess_ids.size());
+        std::partial_sort(stats->excess_ids.begin(), stats->excess_ids.begin() + num_type_examples,
+            stats->excess_ids.end(), std::greater<std::pair<int64_t, uint32_t>>());
+        for (size_t z = 0; z < num_type_examples; z++) {
+          const auto& [excess, id] = stats->excess_ids[z];
+          auto addr = graph.addr_for_id(id);
+          auto t = shell.env.traverse(&args);
+          t.is_short = true;
+          if (t.max_recursion_depth < 0) {
+            t.max_recursion_depth = 0;
+          }
+          phosg::fwrite_fmt(stdout, "  refcount {}, {} known references: {}\n",
+              shell.env.r.get(addr).ob_refcnt, shell.env.r.get(addr).ob_refcnt - excess, t.repr(addr));
+        }
+        if (!set_name.empty()) {
+          for (const auto& [excess, id] : stats->excess_ids) {
+            found_addrs.emplace_back(graph.addr_for_id(id));
+          }
+        }
+      }
+
+      if (!set_name.empty()) {
+        shell.save_result_set(set_name, std::move(found_addrs));
+      }
+    });
+
+ShellCommand c_unreachable(
+    "unreachable", "\
+  unreachable [OPTIONS]\n\
+    Find valid objects that aren\'t reachable from any root, and show them\n\
+    grouped by type. Roots are what the interpreter itself refers to: the\n\
+    sys.modules dict, the sys and builtins modules\' dicts, the interned\n\
+    string dict, static (non-heap) types, running frames, immortal interned\n\
+    strings, and the objects referred to by thread states (each thread\'s\n\
+    frame chain, thread dict, context, and exception state). Modules and\n\
+    classes are not roots, so leaked ones (for example, modules removed from\n\
+    sys.modules but still alive) are reported. Unreachable objects are kept\n\
+    alive only by references from C code, from objects of types\n\
+    python-memtools doesn\'t decode, or by leaked reference counts. Finding\n\
+    thread states requires a full scan of the snapshot. Run build-graph first.\n\
+    Options:\n\
+      --top=N: Show this many types (default 20).\n\
+      --as=NAME: Save the addresses of all unreachable objects of the shown\n\
+          types as the result set NAME.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      size_t top_count = args.get<size_t>("top", 20);
+      const auto& set_name = args.get<std::string>("as", false);
+      const auto& graph = shell.get_graph();
+      auto root_kinds = find_interpreter_roots(shell.env, graph, shell.max_threads);
+      add_thread_state_roots(shell.env, graph, root_kinds, shell.max_threads);
+      phosg::fwrite_fmt(stderr, CLEAR_LINE);
+      auto reachable = find_reachable(shell.env, graph, root_kinds, shell.max_threads);
+      root_kinds.clear();
+      root_kinds.shrink_to_fit();
+
+      struct TypeStats {
+        size_t count = 0;
+        size_t total_size = 0;
+        std::vector<uint32_t> ids;
+      };
+      std::vector<std::unordered_map<MappedPtr<PyTypeObject>, TypeStats>> thread_stats(shell.max_threads);
+      ObjectGraph::parallel_ranges(shell.env.r, graph.node_count(), shell.max_threads,
+          [&](size_t start, size_t end, size_t thread_index) -> void {
+            auto& stats_for_type = thread_stats[thread_index];
+            for (size_t id = start; id < end; id++) {
+              if (reachable[id >> 6] & (1ULL << (id & 63))) {
+                continue;
+              }
+              auto addr = graph.addr_for_id(id);
+              auto& stats = stats_for_type[shell.env.r.get(addr).ob_type];
+              stats.count++;
+              try {
+                stats.total_size += shell.env.object_extents(addr).total_size();
+              } catch (const std::out_of_range&) {
+              }
+              if (!set_name.empty()) {
+                stats.ids.emplace_back(id);
+              }
+            }
+          });
+
+      std::unordered_map<MappedPtr<PyTypeObject>, TypeStats> stats_for_type;
+      for (auto& thread_stats_for_type : thread_stats) {
+        for (auto& [type, stats] : thread_stats_for_type) {
+          auto& overall_stats = stats_for_type[type];
+          overall_stats.count += stats.count;
+          overall_stats.total_size += stats.total_size;
+          overall_stats.ids.insert(overall_stats.ids.end(), stats.ids.begin(), stats.ids.end());
+        }
+        thread_stats_for_type.clear();
+      }
+
+      auto name_for_type = shell.env.names_for_types();
+      std::vector<std::tuple<size_t, std::string, const TypeStats*>> top_types;
+      size_t total_count = 0;
+      size_t total_size = 0;
+      for (const auto& [type_addr, stats] : stats_for_type) {
+        auto name_it = name_for_type.find(type_addr);
+        top_types.emplace_back(
+            stats.total_size, (name_it == name_for_type.end()) ? "<unknown type>" : name_it->second, &stats);
+        total_count += stats.count;
+        total_size += stats.total_size;
+      }
+      std::sort(top_types.begin(), top_types.end(), [](const auto& a, const auto& b) -> bool {
+        return (std::get<0>(a) != std::get<0>(b)) ? (std::get<0>(a) > std::get<0>(b)) : (std::get<1>(a) < std::get<1>(b));
+      });
+      phosg::fwrite_fmt(stdout, "{} of {} objects ({}) in {} types are not reachable from roots\n",
+          total_count, graph.node_count(), phosg::format_size(total_size), top_types.size());
+      if (top_types.size() > top_count) {
+        top_types.resize(top_count);
+      }
+
+      std::vector<MappedPtr<void>> found_addrs;
+      for (const auto& [type_size, name, stats] : top_types) {
+        phosg::fwrite_fmt(stdout, "({} in {} objects) {}\n", phosg::format_size(type_size), stats->count, name);
+        for (uint32_t id : stats->ids) {
+          found_addrs.emplace_back(graph.addr_for_id(id));
+        }
+      }
+
+      if (!set_name.empty()) {
+        shell.save_result_set(set_name, std::move(found_addrs));
+      }
+    });
+
+ShellCommand c_find_module(
+    "find-module", "\
+  find-module NAME [--as=SET]\n\
+    Find all modules with the given name (as in the __name__ attribute). Note\n\
+    that the `sys` module typically contains a dict of all other modules; to\n\
+    find this, use `find-module sys`. If --as is given, saves the modules\'\n\
+    addresses as the result set SET.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      auto module_name = args.get<std::string>(1);
+      auto module_type = shell.env.get_type("module");
+      auto dict_type = shell.env.get_type_if_exists("dict");
+
+      OrderedOutput output(shell.max_threads);
+      ResultSetCollector result_set(shell, args);
+      std::atomic<size_t> result_count = 0;
+      shell.env.r.map_all_addresses<PyObject>([&](const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) -> void {
+        if ((obj.ob_type != module_type) || shell.env.invalid_reason(addr)) {
+          return;
+        }
 
         auto dict_addr = shell.env.r.get(addr.offset_bytes(0x10).cast<MappedPtr<PyDictObject>>());
         const auto& dict_obj = shell.env.r.get(dict_addr);
@@ -442,12 +2252,13 @@ ShellCommand c_find_module(
 
         try {
           MappedPtr<PyObject> name_addr = dict_obj.value_for_key<PyObject>(shell.env.r, "__name__");
-          auto name_dec = decode_string_types(shell.env.r, name_addr);
-          if (name_dec.data != module_name) {
+          if (!string_equals(shell.env.r, name_addr, module_name)) {
             return;
           }
         } catch (const std::out_of_range&) {
           return;
+        } catch (const invalid_object&) {
+          return;
         }
 
         auto t = shell.env.traverse(&args);
@@ -456,13 +2267,15 @@ ShellCommand c_find_module(
           return;
         }
         result_count++;
-
-        std::lock_guard<std::mutex> g(output_lock);
-        phosg::fwrite_fmt(stderr, CLEAR_LINE);
-        phosg::fwrite_fmt(stdout, "{}\n", repr);
+        repr.push_back('\n');
+        output.add(thread_index, addr.addr, std::move(repr));
+        result_set.add(thread_index, addr);
       },
           8, shell.max_threads);
-      phosg::fwrite_fmt(stderr, CLEAR_LINE "{} modules found\n", result_count.load());
+      phosg::fwrite_fmt(stderr, CLEAR_LINE);
+      output.write(stdout);
+      phosg::fwrite_fmt(stderr, "{} modules found\n", result_count.load());
+      result_set.save();
     });
 
 ShellCommand c_find_all_threads(
@@ -470,9 +2283,9 @@ ShellCommand c_find_all_threads(
   find-all-threads\n\
     Finds all active thread states.\n",
     +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
-      std::mutex output_lock;
+      OrderedOutput output(shell.max_threads);
       shell.env.r.map_all_addresses<PyThreadState>(
-          [&](const PyThreadState& obj, MappedPtr<PyThreadState> addr, size_t) -> void {
+          [&](const PyThreadState& obj, MappedPtr<PyThreadState> addr, size_t thread_index) -> void {
             if (obj.invalid_reason(shell.env)) {
               return;
             }
@@ -483,293 +2296,1243 @@ ShellCommand c_find_all_threads(
               return;
             }
 
-            std::lock_guard<std::mutex> g(output_lock);
-            phosg::fwrite_fmt(stderr, CLEAR_LINE "{}\n", repr);
+            repr.push_back('\n');
+            output.add(thread_index, addr.addr, std::move(repr));
           },
           8, shell.max_threads);
+      phosg::fwrite_fmt(stderr, CLEAR_LINE);
+      output.write(stderr);
     });
 
+class FindAllStacksVisitor : public ObjectVisitor {
+public:
+  FindAllStacksVisitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress& progress)
+      : shell(shell),
+        args(args),
+        include_runnable(args.get<bool>("include-runnable")),
+        verbose(ScanProgress::verbose || args.get<bool>("verbose")),
+        num_runnable_frames(progress.add_counter("runnable frames")),
+        num_non_runnable_frames(progress.add_counter("non-runnable frames")),
+        back_for_frame(shell.max_threads) {
+    try {
+      this->frame_type_addr = shell.env.type_objects.at("frame");
+    } catch (const std::out_of_range&) {
+      throw std::runtime_error("Frame type is missing from analysis data");
+    }
+  }
+
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> obj_addr, size_t thread_index) {
+    if (obj.ob_type != this->frame_type_addr || obj.invalid_reason(this->shell.env)) {
+      return;
+    }
+    auto addr = obj_addr.cast<PyFrameObject>();
+
+    auto t = this->shell.env.traverse(&this->args);
+    t.max_recursion_depth = 1;
+    t.frame_omit_locals = true;
+    std::string repr = t.repr(addr);
+    if (!t.is_valid) {
+      return;
+    }
+
+    const auto& f_obj = this->shell.env.r.get<PyFrameObject>(addr);
+    bool is_runnable = this->include_runnable ? f_obj.is_runnable_or_running() : f_obj.is_running();
+    if (is_runnable) {
+      this->num_runnable_frames.fetch_add(1, std::memory_order_relaxed);
+      this->back_for_frame[thread_index].emplace(addr, f_obj.f_back);
+    } else {
+      this->num_non_runnable_frames.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (this->verbose) {
+      std::lock_guard<std::mutex> g(this->output_lock);
+      phosg::fwrite_fmt(stderr, CLEAR_LINE "... {} {} from {}\n", addr, f_obj.name_for_state(f_obj.f_state), f_obj.f_back);
+    }
+  }
+
+  virtual void finish() {
+    std::unordered_map<MappedPtr<PyFrameObject>, MappedPtr<PyFrameObject>> back_for_frame;
+    for (auto& thread_back_for_frame : this->back_for_frame) {
+      back_for_frame.merge(thread_back_for_frame);
+    }
+
+    // Roots are all frames that are not the f_back of any other frame
+    std::set<MappedPtr<PyFrameObject>> roots;
+    for (const auto& it : back_for_frame) {
+      roots.emplace(it.first);
+    }
+    for (const auto& it : back_for_frame) {
+      roots.erase(it.second);
+    }
+
+    phosg::fwrite_fmt(stderr, CLEAR_LINE "\n");
+    for (MappedPtr<PyFrameObject> addr : roots) {
+      phosg::fwrite_fmt(stderr, "Traceback (most recent call FIRST):\n");
+      auto t = this->shell.env.traverse(&this->args);
+      t.frame_omit_back = true;
+      t.is_short = true;
+      t.recursion_depth = 1;
+      while (!addr.is_null()) {
+        std::string repr = t.repr(addr);
+        for (ssize_t z = 0; z < t.recursion_depth * 2; z++) {
+          fputc(' ', stderr);
+        }
+        phosg::fwrite_fmt(stderr, "{}\n", repr);
+        try {
+          addr = back_for_frame.at(addr);
+        } catch (const std::out_of_range&) {
+          for (ssize_t z = 0; z < t.recursion_depth * 2; z++) {
+            fputc(' ', stderr);
+          }
+          phosg::fwrite_fmt(stderr,
+              "<warning: frame points to f_back=@{} which is missing from the found frame list>\n", addr);
+          addr = nullptr;
+        }
+      }
+    }
+  }
+
+private:
+  AnalysisShell& shell;
+  phosg::Arguments& args;
+  MappedPtr<PyTypeObject> frame_type_addr;
+  bool include_runnable;
+  bool verbose;
+  std::mutex output_lock;
+  std::atomic<size_t>& num_runnable_frames;
+  std::atomic<size_t>& num_non_runnable_frames;
+  std::vector<std::unordered_map<MappedPtr<PyFrameObject>, MappedPtr<PyFrameObject>>> back_for_frame;
+};
+
 ShellCommand c_find_all_stacks(
     "find-all-stacks", "\
   find-all-stacks [OPTIONS]\n\
     Generates the graph of all running frames, then organizes them into\n\
     stacks. This shows what all threads were doing at snapshot time. Options:\n\
       --include-runnable: Include frames that were paused but later runnable.\n\
+      --verbose: Print each frame as it\'s found.\n\
+    The formatting options to the repr command are also valid here.\n",
+    &run_visitor<FindAllStacksVisitor>, &make_visitor<FindAllStacksVisitor>);
+
+template <bool IsBytes>
+class AggregateStringsVisitor : public ObjectVisitor {
+public:
+  AggregateStringsVisitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress&)
+      : shell(shell),
+        args(args),
+        print_smaller_than(args.get<uint64_t>("print-smaller-than", 0)),
+        print_larger_than(args.get<uint64_t>("print-larger-than", 0)),
+        type_addr(shell.env.get_type(IsBytes ? "bytes" : "str")),
+        size_buckets(parse_buckets(args.get<std::string>("buckets", false))),
+        thread_stats(shell.max_threads),
+        output(shell.max_threads, OrderedOutput::parse_order(args.get<std::string>("sort", false))) {}
+
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    if ((obj.ob_type != this->type_addr) || obj.invalid_reason(this->shell.env)) {
+      return;
+    }
+
+    size_t data_size;
+    try {
+      if constexpr (IsBytes) {
+        data_size = this->shell.env.r.get(addr.cast<PyBytesObject>()).ob_size;
+      } else {
+        auto data_dec = decode_string_types(this->shell.env.r, addr, 1);
+        data_size = data_dec.data.size() + data_dec.excess_bytes;
+      }
+    } catch (const std::exception&) {
+      return;
+    }
+    auto size_it = lower_bound(this->size_buckets.begin(), this->size_buckets.end(), data_size);
+    size_t bucket_index = size_it - this->size_buckets.begin();
+
+    auto& stats = this->thread_stats[thread_index];
+    if (bucket_index >= stats.histogram_data.size()) {
+      stats.histogram_data.resize(bucket_index + 1);
+    }
+    stats.histogram_data[bucket_index].count++;
+    stats.histogram_data[bucket_index].size += data_size;
+    stats.total_objects++;
+    stats.total_size += data_size;
+
+    if ((data_size >= this->print_larger_than) && (data_size < this->print_smaller_than)) {
+      this->output.add(thread_index, addr.addr, this->shell.env.traverse(&this->args).repr(addr) + "\n");
+    }
+  }
+
+  virtual void finish() {
+    std::vector<Bucket> histogram_data;
+    size_t total_size = 0;
+    size_t total_objects = 0;
+    for (const auto& stats : this->thread_stats) {
+      if (stats.histogram_data.size() > histogram_data.size()) {
+        histogram_data.resize(stats.histogram_data.size());
+      }
+      for (size_t z = 0; z < stats.histogram_data.size(); z++) {
+        histogram_data[z].count += stats.histogram_data[z].count;
+        histogram_data[z].size += stats.histogram_data[z].size;
+      }
+      total_size += stats.total_size;
+      total_objects += stats.total_objects;
+    }
+
+    this->output.write(stdout);
+    phosg::fwrite_fmt(stdout, "Found {} objects with {} data bytes overall ({})\n",
+        total_objects, total_size, phosg::format_size(total_size));
+    for (size_t z = 0; z < histogram_data.size(); z++) {
+      std::string bucket_str = (z < this->size_buckets.size())
+          ? std::format("<= {}", this->size_buckets[z])
+          : std::format("> {}", this->size_buckets.back());
+      phosg::fwrite_fmt(stdout, "Length {}: {} objects, {} data bytes ({})\n",
+          bucket_str, histogram_data[z].count, histogram_data[z].size, phosg::format_size(histogram_data[z].size));
+    }
+  }
+
+private:
+  // Returns the upper bounds (inclusive) of the histogram buckets
+  static std::vector<size_t> parse_buckets(const std::string& spec) {
+    if (spec.empty() || (spec == "decimal")) {
+      return {0, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+          1000000, 2000000, 5000000, 10000000, 20000000, 50000000, 100000000, 200000000, 500000000, 1000000000};
+    } else if (spec == "log2") {
+      std::vector<size_t> ret = {0};
+      for (size_t bound = 1; bound <= (1ULL << 40); bound <<= 1) {
+        ret.emplace_back(bound);
+      }
+      return ret;
+    } else {
+      std::vector<size_t> ret;
+      for (const auto& item : phosg::split(spec, ',')) {
+        ret.emplace_back(stoull(item, nullptr, 0));
+      }
+      std::sort(ret.begin(), ret.end());
+      ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+      if (ret.empty()) {
+        throw std::invalid_argument("No histogram buckets given");
+      }
+      return ret;
+    }
+  }
+
+  struct Bucket {
+    size_t count = 0;
+    size_t size = 0;
+  };
+  struct ThreadStats {
+    std::vector<Bucket> histogram_data;
+    size_t total_size = 0;
+    size_t total_objects = 0;
+  };
+
+  AnalysisShell& shell;
+  phosg::Arguments& args;
+  size_t print_smaller_than;
+  size_t print_larger_than;
+  MappedPtr<PyTypeObject> type_addr;
+  std::vector<size_t> size_buckets;
+  std::vector<ThreadStats> thread_stats;
+  OrderedOutput output;
+};
+
+ShellCommand c_aggregate_strings(
+    "aggregate-strings", "\
+  aggregate-strings [OPTIONS]\n\
+    Find all strings and generate a log-scaled histogram of their lengths,\n\
+    with the number of objects and total data bytes in each bucket. Options:\n\
+      --bytes: Aggregate over bytes objects instead of strings.\n\
+      --buckets=BUCKETS: Histogram bucket sizes: decimal (1, 2, 5, 10, 20,\n\
+          ...; the default), log2 (1, 2, 4, 8, ...), or a comma-separated list\n\
+          of upper bounds, like 16,256,4096.\n\
+      --print-smaller-than=N: Print all strings of fewer than N bytes.\n\
+      --print-larger-than=N: Print all strings of N bytes or more.\n\
+      --sort=ORDER: Print strings in this order: address (default) or repr.\n\
     The formatting options to the repr command are also valid here.\n",
     +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
-      bool include_runnable = args.get<bool>("include-runnable");
+      if (args.get<bool>("bytes")) {
+        run_visitor<AggregateStringsVisitor<true>>(shell, args);
+      } else {
+        run_visitor<AggregateStringsVisitor<false>>(shell, args);
+      }
+    },
+    +[](AnalysisShell& shell, phosg::Arguments& args, ScanProgress& progress) -> std::unique_ptr<ObjectVisitor> {
+      if (args.get<bool>("bytes")) {
+        return make_visitor<AggregateStringsVisitor<true>>(shell, args, progress);
+      } else {
+        return make_visitor<AggregateStringsVisitor<false>>(shell, args, progress);
+      }
+    });
 
-      MappedPtr<PyTypeObject> frame_type_addr;
-      try {
-        frame_type_addr = shell.env.type_objects.at("frame");
-      } catch (const std::out_of_range&) {
-        throw std::runtime_error("Frame type is missing from analysis data");
+// A fast non-cryptographic hash, for grouping objects by contents. Values aren't stable across versions of
+// python-memtools, so they shouldn't be saved.
+static uint64_t hash_bytes(const void* data, size_t size, uint64_t seed = 0) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15);
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    h = std::rotl(h ^ (v * 0xBF58476D1CE4E5B9), 31) * 0x94D049BB133111EB;
+  }
+  if (size) {
+    uint64_t v = 0;
+    memcpy(&v, p, size);
+    h = std::rotl(h ^ (v * 0xBF58476D1CE4E5B9), 31) * 0x94D049BB133111EB;
+  }
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EB;
+  h ^= h >> 31;
+  return h;
+}
+
+class DuplicatesVisitor : public ObjectVisitor {
+public:
+  DuplicatesVisitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress& progress)
+      : shell(shell),
+        args(args),
+        top_count(args.get<size_t>("top", 20)),
+        max_tuple_length(args.get<size_t>("max-tuple-length", 8)),
+        set_name(args.get<std::string>("as", false)),
+        str_type(shell.env.get_type_if_exists("str")),
+        bytes_type(shell.env.get_type_if_exists("bytes")),
+        tuple_type(shell.env.get_type_if_exists("tuple")),
+        int_type(shell.env.get_type_if_exists("int")),
+        float_type(shell.env.get_type_if_exists("float")),
+        bool_type(shell.env.get_type_if_exists("bool")),
+        none_type(shell.env.get_type_if_exists("NoneType")),
+        num_hashed(progress.add_counter("hashed objects")),
+        thread_entries(shell.max_threads) {}
+
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    if (((obj.ob_type != this->str_type) && (obj.ob_type != this->bytes_type) && (obj.ob_type != this->tuple_type)) ||
+        this->shell.env.invalid_reason(addr)) {
+      return;
+    }
+    try {
+      uint64_t hash = this->content_hash(obj, addr, true);
+      if (hash == 0) {
+        return;
+      }
+      size_t size = this->shell.env.object_extents(addr).total_size();
+      this->thread_entries[thread_index].emplace_back(Entry{hash, addr, size});
+      this->num_hashed.fetch_add(1, std::memory_order_relaxed);
+    } catch (const std::exception&) {
+    }
+  }
+
+  virtual void finish() {
+    std::vector<Entry> entries;
+    for (auto& thread_entries : this->thread_entries) {
+      entries.insert(entries.end(), thread_entries.begin(), thread_entries.end());
+      thread_entries.clear();
+      thread_entries.shrink_to_fit();
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) -> bool {
+      return (a.hash != b.hash) ? (a.hash < b.hash) : (a.addr < b.addr);
+    });
+
+    struct Group {
+      size_t start_index;
+      size_t count;
+      size_t wasted_size; // Total size of all copies except the first
+    };
+    std::vector<Group> groups;
+    size_t total_wasted_size = 0;
+    size_t total_duplicates = 0;
+    for (size_t z = 0; z < entries.size();) {
+      size_t end_z = z + 1;
+      size_t wasted_size = 0;
+      for (; (end_z < entries.size()) && (entries[end_z].hash == entries[z].hash); end_z++) {
+        wasted_size += entries[end_z].size;
+      }
+      if (end_z - z > 1) {
+        groups.emplace_back(Group{z, end_z - z, wasted_size});
+        total_wasted_size += wasted_size;
+        total_duplicates += end_z - z - 1;
+      }
+      z = end_z;
+    }
+    size_t num_groups = groups.size();
+    std::sort(groups.begin(), groups.end(), [](const Group& a, const Group& b) -> bool {
+      return (a.wasted_size != b.wasted_size) ? (a.wasted_size > b.wasted_size) : (a.start_index < b.start_index);
+    });
+    if (groups.size() > this->top_count) {
+      groups.resize(this->top_count);
+    }
+
+    phosg::fwrite_fmt(stdout, "{} of {} hashed objects are duplicates ({} wasted) in {} groups\n",
+        total_duplicates, entries.size(), phosg::format_size(total_wasted_size), num_groups);
+    std::vector<MappedPtr<void>> found_addrs;
+    for (const auto& group : groups) {
+      const auto& first_entry = entries[group.start_index];
+      auto t = this->shell.env.traverse(&this->args);
+      t.is_short = true;
+      if (t.max_recursion_depth < 0) {
+        t.max_recursion_depth = 1;
+      }
+      std::string samples_str;
+      for (size_t z = 0; z < std::min<size_t>(group.count, 3); z++) {
+        samples_str += std::format("{}{}", z ? ", " : "", entries[group.start_index + z].addr);
       }
+      phosg::fwrite_fmt(stdout, "({} wasted by {} copies of {}; e.g. @ {}{}) {}\n",
+          phosg::format_size(group.wasted_size), group.count, phosg::format_size(first_entry.size), samples_str,
+          (group.count > 3) ? ", ..." : "", t.repr(first_entry.addr));
+      if (!this->set_name.empty()) {
+        for (size_t z = 0; z < group.count; z++) {
+          found_addrs.emplace_back(entries[group.start_index + z].addr);
+        }
+      }
+    }
 
-      std::mutex output_lock;
-      size_t num_non_runnable_frames = 0;
-      std::unordered_map<MappedPtr<PyFrameObject>, MappedPtr<PyFrameObject>> back_for_frame;
-      shell.env.r.map_all_addresses<PyFrameObject>(
-          [&](const PyObject& obj, MappedPtr<PyFrameObject> addr, size_t) -> void {
-            if (obj.ob_type != frame_type_addr || obj.invalid_reason(shell.env)) {
-              return;
-            }
+    if (!this->set_name.empty()) {
+      this->shell.save_result_set(this->set_name, std::move(found_addrs));
+    }
+  }
 
-            auto t = shell.env.traverse(&args);
-            t.max_recursion_depth = 1;
-            t.frame_omit_locals = true;
-            std::string repr = t.repr(addr);
-            if (!t.is_valid) {
-              return;
-            }
+private:
+  struct Entry {
+    uint64_t hash;
+    MappedPtr<PyObject> addr;
+    size_t size;
+  };
+
+  // Returns a hash of the object's type and contents, or 0 if the object isn't eligible for deduplication (tuples
+  // must be short and contain only str, bytes, int, float, bool, and None). Hashes str data in its stored form,
+  // without decoding it.
+  uint64_t content_hash(const PyObject& obj, MappedPtr<PyObject> addr, bool allow_tuple) const {
+    const auto& r = this->shell.env.r;
+    if (obj.ob_type == this->str_type) {
+      // Strings of different kinds are never equal, even if their stored data is the same
+      auto data_r = read_string_storage(r, addr);
+      return hash_bytes(data_r.getv(data_r.size()), data_r.size(), r.get(addr.cast<PyASCIIStringObject>()).char_kind());
+    } else if (obj.ob_type == this->bytes_type) {
+      auto data_r = r.get(addr.cast<PyBytesObject>()).read_contents();
+      return hash_bytes(data_r.getv(data_r.size()), data_r.size(), 8);
+    } else if ((obj.ob_type == this->int_type) || (obj.ob_type == this->float_type)) {
+      // Hash everything after ob_type: ob_size and digits for int, or ob_fval for float
+      size_t size = this->shell.env.shallow_size(addr) - sizeof(PyObject);
+      return hash_bytes(r.readv(addr.offset_bytes(sizeof(PyObject)), size), size, obj.ob_type.addr);
+    } else if ((obj.ob_type == this->bool_type) || (obj.ob_type == this->none_type)) {
+      return hash_bytes(&addr.addr, sizeof(addr.addr), 9); // These are singletons
+    } else if (allow_tuple && (obj.ob_type == this->tuple_type)) {
+      const auto& tuple = r.get(addr.cast<PyTupleObject>());
+      if ((tuple.ob_size <= 0) || (static_cast<size_t>(tuple.ob_size) > this->max_tuple_length)) {
+        return 0;
+      }
+      std::vector<uint64_t> item_hashes;
+      for (const auto& item_addr : tuple.get_items()) {
+        if (this->shell.env.invalid_reason(item_addr)) {
+          return 0;
+        }
+        uint64_t item_hash = this->content_hash(r.get(item_addr), item_addr, false);
+        if (item_hash == 0) {
+          return 0;
+        }
+        item_hashes.emplace_back(item_hash);
+      }
+      return hash_bytes(item_hashes.data(), item_hashes.size() * sizeof(uint64_t), 10);
+    } else {
+      return 0;
+    }
+  }
 
-            const auto& f_obj = shell.env.r.get<PyFrameObject>(addr);
-            std::string state_name = f_obj.name_for_state(f_obj.f_state);
+  AnalysisShell& shell;
+  phosg::Arguments& args;
+  size_t top_count;
+  size_t max_tuple_length;
+  std::string set_name;
+  MappedPtr<PyTypeObject> str_type;
+  MappedPtr<PyTypeObject> bytes_type;
+  MappedPtr<PyTypeObject> tuple_type;
+  MappedPtr<PyTypeObject> int_type;
+  MappedPtr<PyTypeObject> float_type;
+  MappedPtr<PyTypeObject> bool_type;
+  MappedPtr<PyTypeObject> none_type;
+  std::atomic<size_t>& num_hashed;
+  std::vector<std::vector<Entry>> thread_entries;
+};
 
-            std::lock_guard<std::mutex> g(output_lock);
-            if (include_runnable ? !f_obj.is_runnable_or_running() : !f_obj.is_running()) {
-              num_non_runnable_frames++;
-            } else {
-              back_for_frame.emplace(addr, f_obj.f_back);
-            }
-            phosg::fwrite_fmt(stderr,
-                CLEAR_LINE "... {} {} from {} ({} runnable frames, {} non-runnable frames)\n",
-                addr, state_name, f_obj.f_back, back_for_frame.size(), num_non_runnable_frames);
-          },
-          8, shell.max_threads);
+ShellCommand c_duplicates(
+    "duplicates", "\
+  duplicates [OPTIONS]\n\
+    Find str and bytes objects, and short tuples of immutable values, that\n\
+    have the same contents as other objects, and show the groups of equal\n\
+    objects that waste the most memory. Objects are grouped by a 64-bit hash\n\
+    of their contents, so there\'s a very small chance that unequal objects\n\
+    are grouped together. Options:\n\
+      --top=N: Show this many groups (default 20).\n\
+      --max-tuple-length=N: Only consider tuples of at most N items (default\n\
+          8). Tuples are only considered if all of their items are str,\n\
+          bytes, int, float, bool, or None.\n\
+      --as=NAME: Save the addresses of all objects in the shown groups as the\n\
+          result set NAME.\n\
+    The formatting options to the repr command are also valid here.\n",
+    &run_visitor<DuplicatesVisitor>, &make_visitor<DuplicatesVisitor>);
+
+class DictKeyCensusVisitor : public ObjectVisitor {
+public:
+  DictKeyCensusVisitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress& progress)
+      : shell(shell),
+        args(args),
+        top_count(args.get<size_t>("top", 20)),
+        max_keys(args.get<size_t>("max-keys", 256)),
+        dict_type(shell.env.get_type_if_exists("dict")),
+        str_type(shell.env.get_type_if_exists("str")),
+        int_type(shell.env.get_type_if_exists("int")),
+        float_type(shell.env.get_type_if_exists("float")),
+        num_dicts(progress.add_counter("dicts")),
+        thread_stats(shell.max_threads) {
+    if (this->dict_type.is_null()) {
+      throw std::runtime_error("dict type not present in analysis data");
+    }
+  }
 
-      // Roots are all frames that are not the f_back of any other frame
-      std::set<MappedPtr<PyFrameObject>> roots;
-      for (const auto& it : back_for_frame) {
-        roots.emplace(it.first);
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    if ((obj.ob_type != this->dict_type) || this->shell.env.invalid_reason(addr)) {
+      return;
+    }
+    auto& stats = this->thread_stats[thread_index];
+    try {
+      const auto& r = this->shell.env.r;
+      const auto& dict = r.get(addr.cast<PyDictObject>());
+      size_t num_items = (dict.ma_used > 0) ? dict.ma_used : 0;
+      size_t size = this->shell.env.object_extents(addr).total_size();
+      bool is_split = !dict.ma_values.is_null();
+
+      size_t bucket_index = std::bit_width(num_items);
+      if (bucket_index >= stats.size_histogram.size()) {
+        stats.size_histogram.resize(bucket_index + 1);
       }
-      for (const auto& it : back_for_frame) {
-        roots.erase(it.second);
+      auto& bucket = stats.size_histogram[bucket_index];
+      (is_split ? bucket.split_count : bucket.combined_count)++;
+      bucket.total_size += size;
+      this->num_dicts.fetch_add(1, std::memory_order_relaxed);
+
+      if (num_items > this->max_keys) {
+        stats.large_dicts.emplace_back(num_items, addr);
+        return;
+      }
+      if (dict.ma_keys.is_null()) {
+        return;
       }
 
-      phosg::fwrite_fmt(stderr, CLEAR_LINE "\n");
-      for (MappedPtr<PyFrameObject> addr : roots) {
-        phosg::fwrite_fmt(stderr, "Traceback (most recent call FIRST):\n");
-        auto t = shell.env.traverse(&args);
-        t.frame_omit_back = true;
-        t.is_short = true;
-        t.recursion_depth = 1;
-        while (!addr.is_null()) {
-          std::string repr = t.repr(addr);
-          for (ssize_t z = 0; z < t.recursion_depth * 2; z++) {
-            fputc(' ', stderr);
-          }
-          phosg::fwrite_fmt(stderr, "{}\n", repr);
-          try {
-            addr = back_for_frame.at(addr);
-          } catch (const std::out_of_range&) {
-            for (ssize_t z = 0; z < t.recursion_depth * 2; z++) {
-              fputc(' ', stderr);
-            }
-            phosg::fwrite_fmt(stderr,
-                "<warning: frame points to f_back=@{} which is missing from the found frame list>\n", addr);
-            addr = nullptr;
-          }
+      // str keys are identified by the hash stored in the dict entry (the string's cached hash, so no string data
+      // needs to be read or decoded here). The hashes of other types collide far more often (for example, hash(-1) ==
+      // hash(-2), and many types hash by address), so int and float keys are identified by their values, and all
+      // other keys by their addresses.
+      auto values_r = dict.read_values(r);
+      auto entries_r = dict.read_entries(r);
+      std::vector<uint64_t> key_ids;
+      for (int64_t table_v : dict.get_table(r)) {
+        if (table_v < 0) {
+          continue;
+        }
+        const auto& entry = entries_r.pget<PyDictKeyEntry>(table_v * sizeof(PyDictKeyEntry));
+        if (entry.me_key.is_null() || (is_split && (values_r.pget_u64l(sizeof(uint64_t) * table_v) == 0))) {
+          continue; // Deleted entry, or a shared key that this instance doesn't have
+        }
+        auto key_type = r.get(entry.me_key).ob_type;
+        uint64_t key_id;
+        if (key_type == this->str_type) {
+          uint64_t key_id_data[2] = {entry.me_hash, key_type.addr};
+          key_id = hash_bytes(key_id_data, sizeof(key_id_data));
+        } else if ((key_type == this->int_type) || (key_type == this->float_type)) {
+          // Hash everything after ob_type: ob_size and digits for int, or ob_fval for float
+          size_t size = this->shell.env.shallow_size(entry.me_key) - sizeof(PyObject);
+          key_id = hash_bytes(r.readv(entry.me_key.offset_bytes(sizeof(PyObject)), size), size, key_type.addr);
+        } else {
+          key_id = hash_bytes(&entry.me_key.addr, sizeof(entry.me_key.addr), 1);
+        }
+        key_ids.emplace_back(key_id);
+        auto& key_stats = stats.key_stats[key_id];
+        if (key_stats.dict_count++ == 0) {
+          key_stats.example_key = entry.me_key;
         }
       }
-    });
-
-template <bool IsBytes>
-void fn_aggregate_strings(AnalysisShell& shell, phosg::Arguments& args) {
-  size_t print_smaller_than = args.get<uint64_t>("print-smaller-than", 0);
-  size_t print_larger_than = args.get<uint64_t>("print-larger-than", 0);
 
-  const char* type_name = IsBytes ? "bytes" : "str";
-  auto type_addr = shell.env.get_type(type_name);
+      // The signature doesn't depend on the order in which the keys were inserted
+      std::sort(key_ids.begin(), key_ids.end());
+      uint64_t signature = hash_bytes(key_ids.data(), key_ids.size() * sizeof(uint64_t));
+      auto& sig_stats = stats.signature_stats[signature];
+      if (sig_stats.dict_count == 0) {
+        sig_stats.num_keys = key_ids.size();
+        sig_stats.example_dict = addr;
+        sig_stats.min_size = size;
+      }
+      sig_stats.dict_count++;
+      sig_stats.split_count += is_split;
+      sig_stats.total_size += size;
+      sig_stats.min_size = std::min(sig_stats.min_size, size);
+      sig_stats.max_size = std::max(sig_stats.max_size, size);
+    } catch (const std::exception&) {
+    }
+  }
 
-  static const std::vector<size_t> size_buckets = {
-      0, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000,
-      2000000, 5000000, 10000000, 20000000, 50000000, 100000000, 200000000, 500000000, 1000000000};
-  std::vector<size_t> histogram_data;
-  size_t total_size = 0;
-  size_t total_objects = 0;
+  virtual void finish() {
+    std::vector<SizeBucket> size_histogram;
+    std::vector<std::pair<size_t, MappedPtr<PyObject>>> large_dicts;
+    std::unordered_map<uint64_t, KeyStats> key_stats;
+    std::unordered_map<uint64_t, SignatureStats> signature_stats;
+    for (auto& stats : this->thread_stats) {
+      if (size_histogram.size() < stats.size_histogram.size()) {
+        size_histogram.resize(stats.size_histogram.size());
+      }
+      for (size_t z = 0; z < stats.size_histogram.size(); z++) {
+        size_histogram[z].split_count += stats.size_histogram[z].split_count;
+        size_histogram[z].combined_count += stats.size_histogram[z].combined_count;
+        size_histogram[z].total_size += stats.size_histogram[z].total_size;
+      }
+      large_dicts.insert(large_dicts.end(), stats.large_dicts.begin(), stats.large_dicts.end());
+      for (const auto& [key_id, thread_key_stats] : stats.key_stats) {
+        auto& overall = key_stats[key_id];
+        if (overall.dict_count == 0) {
+          overall.example_key = thread_key_stats.example_key;
+        }
+        overall.dict_count += thread_key_stats.dict_count;
+      }
+      for (const auto& [signature, thread_sig_stats] : stats.signature_stats) {
+        auto& overall = signature_stats[signature];
+        if (overall.dict_count == 0) {
+          overall = thread_sig_stats;
+          continue;
+        }
+        overall.dict_count += thread_sig_stats.dict_count;
+        overall.split_count += thread_sig_stats.split_count;
+        overall.total_size += thread_sig_stats.total_size;
+        overall.min_size = std::min(overall.min_size, thread_sig_stats.min_size);
+        overall.max_size = std::max(overall.max_size, thread_sig_stats.max_size);
+      }
+      stats = ThreadStats();
+    }
 
-  std::mutex output_lock;
-  shell.env.r.map_all_addresses<PyObject>([&](const PyObject& obj, MappedPtr<PyObject> addr, size_t) -> void {
-    if ((obj.ob_type != type_addr) || obj.invalid_reason(shell.env)) {
-      return;
+    auto t = this->shell.env.traverse(&this->args);
+    t.is_short = true;
+    if (t.max_recursion_depth < 0) {
+      t.max_recursion_depth = 0;
     }
 
-    size_t data_size;
-    try {
-      if constexpr (IsBytes) {
-        data_size = shell.env.r.get(addr.cast<PyBytesObject>()).ob_size;
-      } else {
-        auto data_dec = decode_string_types(shell.env.r, addr, 1);
-        data_size = data_dec.data.size() + data_dec.excess_bytes;
+    phosg::fwrite_fmt(stdout, "Dict sizes:\n");
+    size_t total_split = 0, total_combined = 0, total_size = 0;
+    for (size_t z = 0; z < size_histogram.size(); z++) {
+      const auto& bucket = size_histogram[z];
+      if (bucket.split_count + bucket.combined_count == 0) {
+        continue;
+      }
+      std::string range_str = (z < 2) ? std::format("{}", z) : std::format("{}-{}", 1ULL << (z - 1), (1ULL << z) - 1);
+      phosg::fwrite_fmt(stdout, "  ({} dicts: {} split, {} combined; {}) {} items\n",
+          bucket.split_count + bucket.combined_count, bucket.split_count, bucket.combined_count,
+          phosg::format_size(bucket.total_size), range_str);
+      total_split += bucket.split_count;
+      total_combined += bucket.combined_count;
+      total_size += bucket.total_size;
+    }
+    phosg::fwrite_fmt(stdout, "{} dicts: {} split, {} combined; {}\n",
+        total_split + total_combined, total_split, total_combined, phosg::format_size(total_size));
+
+    if (!large_dicts.empty()) {
+      std::sort(large_dicts.begin(), large_dicts.end(), [](const auto& a, const auto& b) -> bool {
+        return (a.first != b.first) ? (a.first > b.first) : (a.second < b.second);
+      });
+      phosg::fwrite_fmt(stdout, "Largest dicts (keys of dicts with more than {} items are not counted below):\n",
+          this->max_keys);
+      for (size_t z = 0; z < std::min<size_t>(large_dicts.size(), this->top_count); z++) {
+        phosg::fwrite_fmt(stdout, "  ({} items) {}\n", large_dicts[z].first, t.repr(large_dicts[z].second));
       }
-    } catch (const std::exception&) {
-      return;
     }
-    auto size_it = lower_bound(size_buckets.begin(), size_buckets.end(), data_size);
-    size_t bucket_index = size_it - size_buckets.begin();
 
-    std::lock_guard<std::mutex> g(output_lock);
-    if (bucket_index >= histogram_data.size()) {
-      histogram_data.resize(bucket_index + 1, 0);
+    std::vector<std::pair<size_t, MappedPtr<PyObject>>> key_entries;
+    key_entries.reserve(key_stats.size());
+    for (const auto& [key_id, stats] : key_stats) {
+      key_entries.emplace_back(stats.dict_count, stats.example_key);
     }
-    histogram_data[bucket_index]++;
-    total_objects++;
-    total_size += data_size;
-    if ((data_size >= print_larger_than) && (data_size < print_smaller_than)) {
-      phosg::fwrite_fmt(stdout, CLEAR_LINE "{}\n", shell.env.traverse(&args).repr(addr));
+    std::sort(key_entries.begin(), key_entries.end(), [](const auto& a, const auto& b) -> bool {
+      return (a.first != b.first) ? (a.first > b.first) : (a.second < b.second);
+    });
+    phosg::fwrite_fmt(stdout, "Most common keys ({} distinct):\n", key_entries.size());
+    for (size_t z = 0; z < std::min<size_t>(key_entries.size(), this->top_count); z++) {
+      phosg::fwrite_fmt(stdout, "  ({} dicts) {}\n", key_entries[z].first, t.repr(key_entries[z].second));
     }
-  },
-      8, shell.max_threads);
 
-  phosg::fwrite_fmt(stdout, "Found {} objects with {} data bytes overall ({})\n",
-      total_objects, total_size, phosg::format_size(total_size));
-  for (size_t z = 0; z < histogram_data.size(); z++) {
-    std::string bucket_str = (z < size_buckets.size())
-        ? std::format("{}", size_buckets[z])
-        : std::format(">{}", size_buckets.back());
-    phosg::fwrite_fmt(stdout, "Length <= {}: {} objects\n", bucket_str, histogram_data[z]);
+    std::vector<const SignatureStats*> sig_entries;
+    sig_entries.reserve(signature_stats.size());
+    for (const auto& [signature, stats] : signature_stats) {
+      sig_entries.emplace_back(&stats);
+    }
+    std::sort(sig_entries.begin(), sig_entries.end(), [](const auto* a, const auto* b) -> bool {
+      return (a->dict_count != b->dict_count) ? (a->dict_count > b->dict_count) : (a->example_dict < b->example_dict);
+    });
+    phosg::fwrite_fmt(stdout, "Most common key sets ({} distinct):\n", sig_entries.size());
+    const auto& r = this->shell.env.r;
+    for (size_t z = 0; z < std::min<size_t>(sig_entries.size(), this->top_count); z++) {
+      const auto& stats = *sig_entries[z];
+      std::string keys_str;
+      try {
+        size_t num_shown = 0;
+        for (const auto& [key, value] : r.get(stats.example_dict.cast<PyDictObject>()).get_items(r)) {
+          if (value.is_null()) {
+            continue;
+          }
+          if (num_shown == 8) {
+            keys_str += ", ...";
+            break;
+          }
+          keys_str += std::format("{}{}", num_shown ? ", " : "", t.repr(key));
+          num_shown++;
+        }
+      } catch (const std::exception& e) {
+        keys_str = std::format("<!{}>", e.what());
+      }
+      phosg::fwrite_fmt(stdout, "  ({} dicts: {} split, {} combined; {} keys; {} total, {}-{} each; e.g. @ {}) {{{}}}\n",
+          stats.dict_count, stats.split_count, stats.dict_count - stats.split_count, stats.num_keys,
+          phosg::format_size(stats.total_size), phosg::format_size(stats.min_size), phosg::format_size(stats.max_size),
+          stats.example_dict, keys_str);
+    }
   }
-}
 
-ShellCommand c_aggregate_strings(
-    "aggregate-strings", "\
-  aggregate-strings [OPTIONS]\n\
-    Find all strings and generate a log-scaled histogram of their lengths.\n\
-    Options:\n\
-      --bytes: Aggregate over bytes objects instead of strings.\n\
-      --print-smaller-than=N: Print all strings of fewer than N bytes.\n\
-      --print-larger-than=N: Print all strings of N bytes or more.\n\
+private:
+  struct SizeBucket {
+    size_t split_count = 0;
+    size_t combined_count = 0;
+    size_t total_size = 0;
+  };
+  struct KeyStats {
+    size_t dict_count = 0;
+    MappedPtr<PyObject> example_key;
+  };
+  struct SignatureStats {
+    size_t dict_count = 0;
+    size_t split_count = 0;
+    size_t num_keys = 0;
+    size_t total_size = 0;
+    size_t min_size = 0;
+    size_t max_size = 0;
+    MappedPtr<PyObject> example_dict;
+  };
+  struct ThreadStats {
+    std::vector<SizeBucket> size_histogram; // Indexed by bit width of the number of items
+    std::vector<std::pair<size_t, MappedPtr<PyObject>>> large_dicts;
+    std::unordered_map<uint64_t, KeyStats> key_stats;
+    std::unordered_map<uint64_t, SignatureStats> signature_stats;
+  };
+
+  AnalysisShell& shell;
+  phosg::Arguments& args;
+  size_t top_count;
+  size_t max_keys;
+  MappedPtr<PyTypeObject> dict_type;
+  MappedPtr<PyTypeObject> str_type;
+  MappedPtr<PyTypeObject> int_type;
+  MappedPtr<PyTypeObject> float_type;
+  std::atomic<size_t>& num_dicts;
+  std::vector<ThreadStats> thread_stats;
+};
+
+ShellCommand c_dict_key_census(
+    "dict-key-census", "\
+  dict-key-census [OPTIONS]\n\
+    Find all dicts, and show how many there are of each size, which keys\n\
+    appear in the most dicts, and which sets of keys are most common. Each\n\
+    set of keys is shown with the number of dicts that have exactly those\n\
+    keys (in any order) and how many of them use split tables (shared keys,\n\
+    as for most instance __dict__s) or combined tables. str keys are compared\n\
+    by the hashes stored in the dicts, so they\'re never decoded during the\n\
+    scan (there\'s a very small chance that different strings are counted\n\
+    together). int and float keys are compared by value, and keys of all\n\
+    other types by identity, so equal tuples or bytes objects that are\n\
+    separate objects are counted as different keys. Options:\n\
+      --top=N: Show this many keys and key sets (default 20).\n\
+      --max-keys=N: Don\'t count the keys of dicts with more than N items\n\
+          (default 256). The largest of these dicts are listed separately.\n\
     The formatting options to the repr command are also valid here.\n",
-    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
-      if (args.get<bool>("bytes")) {
-        fn_aggregate_strings<true>(shell, args);
+    &run_visitor<DictKeyCensusVisitor>, &make_visitor<DictKeyCensusVisitor>);
+
+// Returns a substring that every match of the given regular expression must contain, or an empty string if no such
+// substring can be determined. This only understands a subset of regex syntax, and gives up if the pattern has any
+// alternations; it's used to skip objects that can't match before running the regex. Some examples:
+//   customer-12345       -> customer-12345
+//   \.foo\.bar           -> .foo.bar
+//   ab*cdef              -> cdef      (b is optional, so a isn't adjacent to c)
+//   colou?r-code         -> r-code
+//   abc(def)?ghi         -> abc       (groups aren't looked into)
+//   ID=\d+;name=[a-z]+   -> ;name=
+//   a.b{2,3}cccc         -> cccc
+//   abc\x41def           -> abc       (escapes other than \ followed by punctuation end the run)
+//   [\]x]abc             -> abc       (\] doesn't end a character class)
+//   a|bcdef              -> (none)
+static std::string required_literal_for_regex(const std::string& pattern) {
+  if (pattern.find('|') != std::string::npos) {
+    return "";
+  }
+  std::string longest;
+  std::string current;
+  auto end_run = [&]() -> void {
+    if (current.size() > longest.size()) {
+      longest = current;
+    }
+    current.clear();
+  };
+  size_t paren_depth = 0;
+  for (size_t z = 0; z < pattern.size(); z++) {
+    char ch = pattern[z];
+    if (ch == '\\') {
+      if ((z + 1 < pattern.size()) && !isalnum(pattern[z + 1]) && (paren_depth == 0)) {
+        current.push_back(pattern[++z]);
       } else {
-        fn_aggregate_strings<false>(shell, args);
+        // Character class like \d, assertion like \b, backreference, or character escape like \n or \x41. None of
+        // these are added to the literal, so skip the whole escape sequence and end the run here.
+        end_run();
+        z++;
+        if (z < pattern.size()) {
+          char escape_ch = pattern[z];
+          if (escape_ch == 'x') {
+            z = std::min<size_t>(z + 2, pattern.size() - 1);
+          } else if (escape_ch == 'u') {
+            z = std::min<size_t>(z + 4, pattern.size() - 1);
+          } else if (escape_ch == 'c') {
+            z = std::min<size_t>(z + 1, pattern.size() - 1);
+          } else if (isdigit(escape_ch)) {
+            for (; (z + 1 < pattern.size()) && isdigit(pattern[z + 1]); z++) {
+            }
+          }
+        }
       }
-    });
+    } else if ((ch == '*') || (ch == '?') || (ch == '{')) {
+      // The previous character is optional
+      if (!current.empty()) {
+        current.pop_back();
+      }
+      end_run();
+      if (ch == '{') {
+        for (; (z < pattern.size()) && (pattern[z] != '}'); z++) {
+        }
+      }
+    } else if (ch == '[') {
+      end_run();
+      for (z += (((z + 1 < pattern.size()) && (pattern[z + 1] == ']')) ? 2 : 1);
+          (z < pattern.size()) && (pattern[z] != ']'); z++) {
+        if (pattern[z] == '\\') {
+          z++; // An escaped character (like \]) doesn't end the class
+        }
+      }
+    } else if (ch == '(') {
+      end_run();
+      paren_depth++;
+    } else if (ch == ')') {
+      end_run();
+      paren_depth = paren_depth ? (paren_depth - 1) : 0;
+    } else if ((ch == '.') || (ch == '^') || (ch == '$') || (ch == '+') || (paren_depth > 0)) {
+      end_run(); // + means the previous character is required, but not that the following one is adjacent to it
+    } else {
+      current.push_back(ch);
+    }
+  }
+  end_run();
+  return longest;
+}
 
-ShellCommand c_async_task_graph(
-    "async-task-graph", "\
-  async-task-graph\n\
-    Find all async tasks and futures, and show the graph of awaiters.\n\
-    The formatting options to the repr command are also valid here.\n",
-    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
-      MappedPtr<PyTypeObject> task_type_addr, future_type_addr, gathering_future_type_addr;
-      try {
-        task_type_addr = shell.env.get_type("_asyncio.Task");
-        future_type_addr = shell.env.get_type("_asyncio.Future");
-        gathering_future_type_addr = shell.env.get_type("_GatheringFuture");
-      } catch (const std::out_of_range&) {
-        throw std::runtime_error("_asyncio.Task, _asyncio.Future, and _GatheringFuture must not be missing");
+class GrepObjectsVisitor : public ObjectVisitor {
+public:
+  GrepObjectsVisitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress& progress)
+      : shell(shell),
+        args(args),
+        context_bytes(args.get<size_t>("context", 32)),
+        regex_max_size(args.get<size_t>("regex-max-size", 0x1000)),
+        show_referrers(args.get<bool>("referrers")),
+        str_type(shell.env.get_type_if_exists("str")),
+        bytes_type(shell.env.get_type_if_exists("bytes")),
+        bytearray_type(shell.env.get_type_if_exists("bytearray")),
+        output(shell.max_threads),
+        result_set(shell, args),
+        result_count(progress.add_counter("matching objects")),
+        thread_addrs(shell.max_threads) {
+    if (args.get<bool>("regex")) {
+      const auto& pattern = args.get<std::string>(1);
+      this->regex = std::make_unique<std::regex>(pattern, std::regex::ECMAScript | std::regex::optimize);
+      this->literal = required_literal_for_regex(pattern);
+    } else {
+      this->literal = phosg::parse_data_string(args.get<std::string>(1));
+      if (this->literal.empty()) {
+        throw std::invalid_argument("Search pattern must not be empty");
       }
-      phosg::fwrite_fmt(stderr, "Looking for objects of types {} (Task), {} (Future), and {} (GatheringFuture)\n",
-          task_type_addr, future_type_addr, gathering_future_type_addr);
+    }
+    if (this->show_referrers) {
+      this->graph = &shell.get_graph(); // Fail early if the graph hasn't been built
+    }
+  }
 
-      std::mutex output_lock;
-      std::unordered_map<MappedPtr<PyObject>, std::unordered_set<MappedPtr<PyObject>>> await_targets_for_obj;
-      shell.env.r.map_all_addresses<PyObject>([&](const PyObject& obj, MappedPtr<PyObject> addr, size_t) -> void {
-        if ((obj.ob_type != task_type_addr) && (obj.ob_type != future_type_addr) && (obj.ob_type != gathering_future_type_addr)) {
-          return;
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    const char* type_name;
+    if (obj.ob_type == this->str_type) {
+      type_name = "str";
+    } else if (obj.ob_type == this->bytes_type) {
+      type_name = "bytes";
+    } else if (obj.ob_type == this->bytearray_type) {
+      type_name = "bytearray";
+    } else {
+      return;
+    }
+    if (this->shell.env.invalid_reason(addr)) {
+      return;
+    }
+
+    try {
+      // Search the payload in place when possible. The pattern is UTF-8, so str objects that aren't pure ASCII must
+      // be decoded first.
+      std::string decoded;
+      phosg::StringReader data_r;
+      if (obj.ob_type == this->str_type) {
+        if (this->shell.env.r.get(addr.cast<PyASCIIStringObject>()).is_ascii()) {
+          data_r = read_string_storage(this->shell.env.r, addr);
+        } else {
+          decoded = decode_string_types(this->shell.env.r, addr).data;
+          data_r = phosg::StringReader(decoded);
         }
-        if (shell.env.invalid_reason(addr)) {
+      } else if (obj.ob_type == this->bytes_type) {
+        data_r = this->shell.env.r.get(addr.cast<PyBytesObject>()).read_contents();
+      } else {
+        data_r = this->shell.env.r.get(addr.cast<PyByteArrayObject>()).read_contents(this->shell.env.r);
+      }
+      const char* data = reinterpret_cast<const char*>(data_r.getv(data_r.size()));
+      size_t size = data_r.size();
+
+      size_t match_offset = 0;
+      size_t match_size = 0;
+      if (!this->literal.empty()) {
+        const void* found = memmem(data, size, this->literal.data(), this->literal.size());
+        if (!found) {
           return;
         }
-
-        auto t = shell.env.traverse(&args);
-        t.is_short = true;
-        std::string repr = t.repr(addr);
-        if (!t.is_valid) {
+        match_offset = reinterpret_cast<const char*>(found) - data;
+        match_size = this->literal.size();
+      }
+      if (this->regex) {
+        // libstdc++'s regex matcher recurses for each character it consumes, so long inputs can overflow the scan
+        // thread's stack, which crashes the process rather than throwing regex_error. With an 8MB stack, patterns
+        // like foo.*bar overflow at around 16-30KB of input (less for more complex patterns).
+        if (size > this->regex_max_size) {
+          this->regex_skipped_count.fetch_add(1, std::memory_order_relaxed);
           return;
         }
-
-        if (obj.ob_type == task_type_addr) {
-          const auto& obj = shell.env.r.get(addr.cast<PyAsyncTaskObject>());
-          if (obj.invalid_reason(shell.env)) {
+        std::cmatch match;
+        try {
+          if (!std::regex_search(data, data + size, match, *this->regex)) {
             return;
           }
+        } catch (const std::regex_error&) {
+          // std::regex gives up on some inputs (error_complexity or error_stack), usually long ones
+          this->regex_failure_count.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        match_offset = match.position(0);
+        match_size = match.length(0);
+      }
 
-          std::lock_guard<std::mutex> g(output_lock);
-          phosg::fwrite_fmt(stderr, CLEAR_LINE "... {} task awaits {}\n", addr, obj.task_fut_waiter);
-          await_targets_for_obj[addr].emplace(obj.task_fut_waiter);
+      size_t context_start = (match_offset > this->context_bytes) ? (match_offset - this->context_bytes) : 0;
+      size_t context_end = std::min<size_t>(size, match_offset + match_size + this->context_bytes);
+      std::string context = escape_string_data(data + context_start, context_end - context_start, false);
+      this->output.add(thread_index, addr.addr, std::format("{} {} of {} bytes, match at offset {}: {}{}{}\n",
+          addr, type_name, size, match_offset, context_start ? "..." : "", context, (context_end < size) ? "..." : ""));
+      this->result_set.add(thread_index, addr);
+      if (this->show_referrers) {
+        this->thread_addrs[thread_index].emplace_back(addr);
+      }
+      this->result_count.fetch_add(1, std::memory_order_relaxed);
+    } catch (const std::exception&) {
+    }
+  }
 
-        } else if (obj.ob_type == future_type_addr) {
-          const auto& obj = shell.env.r.get(addr.cast<PyAsyncFutureObject>());
-          if (obj.invalid_reason(shell.env)) {
-            return;
+  virtual void finish() {
+    this->output.write(stdout);
+    phosg::fwrite_fmt(stderr, "{} matching objects found\n", this->result_count.load());
+    if (this->regex_failure_count.load()) {
+      phosg::fwrite_fmt(stderr, "Warning: the regex could not be evaluated on {} objects, which may contain matches\n",
+          this->regex_failure_count.load());
+    }
+    if (this->regex_skipped_count.load()) {
+      phosg::fwrite_fmt(stderr,
+          "Warning: {} objects larger than {} bytes were not searched with the regex, and may contain matches\n",
+          this->regex_skipped_count.load(), this->regex_max_size);
+    }
+
+    if (this->show_referrers) {
+      std::vector<MappedPtr<PyObject>> addrs;
+      for (const auto& thread_addrs : this->thread_addrs) {
+        addrs.insert(addrs.end(), thread_addrs.begin(), thread_addrs.end());
+      }
+      std::sort(addrs.begin(), addrs.end());
+      for (auto addr : addrs) {
+        uint32_t id = this->graph->id_for_addr(addr);
+        if (id == ObjectGraph::INVALID_ID) {
+          phosg::fwrite_fmt(stdout, "{} is not in the object graph; run build-graph again\n", addr);
+          continue;
+        }
+        phosg::fwrite_fmt(stdout, "{} is referred to by:\n", addr);
+        for (uint32_t referrer_id : this->graph->referrers(id)) {
+          auto t = this->shell.env.traverse(&this->args);
+          t.is_short = true;
+          if (t.max_recursion_depth < 0) {
+            t.max_recursion_depth = 0;
           }
+          phosg::fwrite_fmt(stdout, "  {}\n", t.repr(this->graph->addr_for_id(referrer_id)));
+        }
+      }
+    }
+    this->result_set.save();
+  }
 
-          std::lock_guard<std::mutex> g(output_lock);
-          phosg::fwrite_fmt(stderr, CLEAR_LINE "... {} future\n", addr);
-          await_targets_for_obj.emplace(addr, std::unordered_set<MappedPtr<PyObject>>());
+private:
+  AnalysisShell& shell;
+  phosg::Arguments& args;
+  std::string literal; // If regex is also given, this is just a prefilter
+  std::unique_ptr<std::regex> regex;
+  size_t context_bytes;
+  size_t regex_max_size;
+  bool show_referrers;
+  const ObjectGraph* graph = nullptr;
+  MappedPtr<PyTypeObject> str_type;
+  MappedPtr<PyTypeObject> bytes_type;
+  MappedPtr<PyTypeObject> bytearray_type;
+  OrderedOutput output;
+  ResultSetCollector result_set;
+  std::atomic<size_t>& result_count;
+  std::atomic<size_t> regex_failure_count = 0;
+  std::atomic<size_t> regex_skipped_count = 0;
+  std::vector<std::vector<MappedPtr<PyObject>>> thread_addrs;
+};
 
-        } else if (obj.ob_type == gathering_future_type_addr) {
-          const auto& obj = shell.env.r.get(addr.cast<PyAsyncGatheringFutureObject>());
-          if (obj.invalid_reason(shell.env)) {
-            return;
-          }
+ShellCommand c_grep_objects(
+    "grep-objects", "\
+  grep-objects PATTERN [OPTIONS]\n\
+    Search the contents of all valid str, bytes, and bytearray objects for\n\
+    PATTERN, and show the matching objects with the bytes around the first\n\
+    match. Unlike find, this doesn\'t report matches in freed memory or in\n\
+    stale copies of data. PATTERN is parsed like the DATA argument to find,\n\
+    so text should be quoted; it\'s matched against the UTF-8 encoding of str\n\
+    objects. Options:\n\
+      --regex: Treat PATTERN as an ECMAScript regular expression instead.\n\
+          Objects that can\'t contain a match are skipped using a fast\n\
+          substring search when possible. If the regex engine gives up on\n\
+          some objects, or some are skipped because of --regex-max-size, the\n\
+          number of them is shown at the end.\n\
+      --regex-max-size=N: With --regex, don\'t run the regex on objects\n\
+          larger than N bytes (default 4096). The regex engine uses stack\n\
+          space proportional to the input length, so large values may crash\n\
+          the shell.\n\
+      --context=N: Show up to N bytes before and after the match (default\n\
+          32).\n\
+      --referrers: Also show the objects that refer to each matching object.\n\
+          Run build-graph first.\n\
+      --as=NAME: Save the matching objects\' addresses as the result set\n\
+          NAME.\n\
+    The formatting options to the repr command are also valid here.\n",
+    &run_visitor<GrepObjectsVisitor>, &make_visitor<GrepObjectsVisitor>);
+
+class AsyncTaskGraphVisitor : public ObjectVisitor {
+public:
+  AsyncTaskGraphVisitor(AnalysisShell& shell, phosg::Arguments& args, ScanProgress& progress)
+      : shell(shell),
+        args(args),
+        verbose(ScanProgress::verbose || args.get<bool>("verbose")),
+        num_tasks(progress.add_counter("tasks")),
+        num_futures(progress.add_counter("futures")),
+        num_gathers(progress.add_counter("gathers")),
+        await_targets_for_obj(shell.max_threads) {
+    try {
+      this->task_type_addr = shell.env.get_type("_asyncio.Task");
+      this->future_type_addr = shell.env.get_type("_asyncio.Future");
+      this->gathering_future_type_addr = shell.env.get_type("_GatheringFuture");
+    } catch (const std::out_of_range&) {
+      throw std::runtime_error("_asyncio.Task, _asyncio.Future, and _GatheringFuture must not be missing");
+    }
+    phosg::fwrite_fmt(stderr, "Looking for objects of types {} (Task), {} (Future), and {} (GatheringFuture)\n",
+        this->task_type_addr, this->future_type_addr, this->gathering_future_type_addr);
+  }
 
-          std::lock_guard<std::mutex> g(output_lock);
-          auto& targets_set = await_targets_for_obj[addr];
-          try {
-            for (auto child_addr : obj.children(shell.env)) {
-              phosg::fwrite_fmt(stderr, CLEAR_LINE "... {} gather awaits {}\n", addr, child_addr);
-              targets_set.emplace(child_addr);
-            }
-          } catch (const std::exception& e) {
-            phosg::fwrite_fmt(stderr, CLEAR_LINE "... {} gather missing children ({})\n", addr, e.what());
+  virtual void visit(const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) {
+    if ((obj.ob_type != this->task_type_addr) &&
+        (obj.ob_type != this->future_type_addr) &&
+        (obj.ob_type != this->gathering_future_type_addr)) {
+      return;
+    }
+    const auto& env = this->shell.env;
+    if (env.invalid_reason(addr)) {
+      return;
+    }
+
+    auto t = env.traverse(&this->args);
+    t.is_short = true;
+    std::string repr = t.repr(addr);
+    if (!t.is_valid) {
+      return;
+    }
+
+    auto& await_targets_for_obj = this->await_targets_for_obj[thread_index];
+    if (obj.ob_type == this->task_type_addr) {
+      const auto& obj = env.r.get(addr.cast<PyAsyncTaskObject>());
+      if (obj.invalid_reason(env)) {
+        return;
+      }
+      this->num_tasks.fetch_add(1, std::memory_order_relaxed);
+      await_targets_for_obj[addr].emplace(obj.task_fut_waiter);
+      if (this->verbose) {
+        std::lock_guard<std::mutex> g(this->output_lock);
+        phosg::fwrite_fmt(stderr, CLEAR_LINE "... {} task awaits {}\n", addr, obj.task_fut_waiter);
+      }
+
+    } else if (obj.ob_type == this->future_type_addr) {
+      const auto& obj = env.r.get(addr.cast<PyAsyncFutureObject>());
+      if (obj.invalid_reason(env)) {
+        return;
+      }
+      this->num_futures.fetch_add(1, std::memory_order_relaxed);
+      await_targets_for_obj.emplace(addr, std::unordered_set<MappedPtr<PyObject>>());
+      if (this->verbose) {
+        std::lock_guard<std::mutex> g(this->output_lock);
+        phosg::fwrite_fmt(stderr, CLEAR_LINE "... {} future\n", addr);
+      }
+
+    } else if (obj.ob_type == this->gathering_future_type_addr) {
+      const auto& obj = env.r.get(addr.cast<PyAsyncGatheringFutureObject>());
+      if (obj.invalid_reason(env)) {
+        return;
+      }
+      this->num_gathers.fetch_add(1, std::memory_order_relaxed);
+      auto& targets_set = await_targets_for_obj[addr];
+      try {
+        for (auto child_addr : obj.children(env)) {
+          targets_set.emplace(child_addr);
+          if (this->verbose) {
+            std::lock_guard<std::mutex> g(this->output_lock);
+            phosg::fwrite_fmt(stderr, CLEAR_LINE "... {} gather awaits {}\n", addr, child_addr);
           }
         }
-      },
-          8, shell.max_threads);
+      } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> g(this->output_lock);
+        phosg::fwrite_fmt(stderr, CLEAR_LINE "... {} gather missing children ({})\n", addr, e.what());
+      }
+    }
+  }
 
-      // Roots are all task/future objects that are not the await target of any other task/future object
-      std::set<MappedPtr<PyObject>> roots;
-      for (const auto& it : await_targets_for_obj) {
-        roots.emplace(it.first);
+  virtual void finish() {
+    std::unordered_map<MappedPtr<PyObject>, std::unordered_set<MappedPtr<PyObject>>> await_targets_for_obj;
+    for (const auto& thread_await_targets_for_obj : this->await_targets_for_obj) {
+      for (const auto& [addr, targets] : thread_await_targets_for_obj) {
+        await_targets_for_obj[addr].insert(targets.begin(), targets.end());
       }
-      for (const auto& it : await_targets_for_obj) {
-        for (const auto& target : it.second) {
-          roots.erase(target);
-        }
+    }
+
+    // Roots are all task/future objects that are not the await target of any other task/future object
+    std::set<MappedPtr<PyObject>> roots;
+    for (const auto& it : await_targets_for_obj) {
+      roots.emplace(it.first);
+    }
+    for (const auto& it : await_targets_for_obj) {
+      for (const auto& target : it.second) {
+        roots.erase(target);
+      }
+    }
+
+    // This can't be auto because it's recursive; fortunately we don't need to hyper-optimize this function
+    std::function<void(Traversal&, MappedPtr<PyObject>, std::unordered_set<MappedPtr<PyObject>>&)> print_entry =
+        [&](Traversal& t, MappedPtr<PyObject> addr, std::unordered_set<MappedPtr<PyObject>>& seen) -> void {
+      if (addr.is_null()) {
+        return;
+      }
+      bool addr_seen = !seen.emplace(addr).second;
+
+      std::string repr = addr_seen ? std::format("<!seen>@{}", addr) : t.repr(addr);
+      for (ssize_t z = 0; z < t.recursion_depth * 2; z++) {
+        fputc(' ', stderr);
       }
+      phosg::fwrite_fmt(stderr, "{}\n", repr);
 
-      // This can't be auto because it's recursive; fortunately we don't need to hyper-optimize this function
-      std::function<void(Traversal&, MappedPtr<PyObject>, std::unordered_set<MappedPtr<PyObject>>&)> print_entry =
-          [&](Traversal& t, MappedPtr<PyObject> addr, std::unordered_set<MappedPtr<PyObject>>& seen) -> void {
-        if (addr.is_null()) {
+      if (!addr_seen) {
+        std::unordered_set<MappedPtr<PyObject>>* next_addrs;
+        try {
+          next_addrs = &await_targets_for_obj.at(addr);
+        } catch (const std::out_of_range&) {
+          phosg::fwrite_fmt(stderr, "Warning: await target {} missing from graph\n", addr);
           return;
         }
-        bool addr_seen = !seen.emplace(addr).second;
 
-        std::string repr = addr_seen ? std::format("<!seen>@{}", addr) : t.repr(addr);
-        for (ssize_t z = 0; z < t.recursion_depth * 2; z++) {
-          fputc(' ', stderr);
+        t.recursion_depth++;
+        for (auto next_addr : *next_addrs) {
+          print_entry(t, next_addr, seen);
         }
-        phosg::fwrite_fmt(stderr, "{}\n", repr);
+        t.recursion_depth--;
+      }
+    };
 
-        if (!addr_seen) {
-          std::unordered_set<MappedPtr<PyObject>>* next_addrs;
-          try {
-            next_addrs = &await_targets_for_obj.at(addr);
-          } catch (const std::out_of_range&) {
-            phosg::fwrite_fmt(stderr, "Warning: await target {} missing from graph\n", addr);
-            return;
-          }
+    for (auto addr : roots) {
+      auto t = this->shell.env.traverse(&this->args);
+      t.is_short = true;
+      std::unordered_set<MappedPtr<PyObject>> seen;
+      print_entry(t, addr, seen);
+    }
+  }
 
-          t.recursion_depth++;
-          for (auto next_addr : *next_addrs) {
-            print_entry(t, next_addr, seen);
-          }
-          t.recursion_depth--;
+private:
+  AnalysisShell& shell;
+  phosg::Arguments& args;
+  MappedPtr<PyTypeObject> task_type_addr;
+  MappedPtr<PyTypeObject> future_type_addr;
+  MappedPtr<PyTypeObject> gathering_future_type_addr;
+  bool verbose;
+  std::mutex output_lock;
+  std::atomic<size_t>& num_tasks;
+  std::atomic<size_t>& num_futures;
+  std::atomic<size_t>& num_gathers;
+  std::vector<std::unordered_map<MappedPtr<PyObject>, std::unordered_set<MappedPtr<PyObject>>>> await_targets_for_obj;
+};
+
+ShellCommand c_async_task_graph(
+    "async-task-graph", "\
+  async-task-graph [OPTIONS]\n\
+    Find all async tasks and futures, and show the graph of awaiters. Options:\n\
+      --verbose: Print each task and future as it\'s found.\n\
+    The formatting options to the repr command are also valid here.\n",
+    &run_visitor<AsyncTaskGraphVisitor>, &make_visitor<AsyncTaskGraphVisitor>);
+
+ShellCommand c_fused_scan(
+    "fused-scan", "\
+  fused-scan COMMAND [; COMMAND ...]\n\
+    Runs several scan-based commands in a single pass over memory, instead of\n\
+    one pass per command. Each COMMAND may have its own options. Results are\n\
+    printed for each command in order after the scan. The commands that can\n\
+    be used here are count-by-type, memory-by-type, largest,\n\
+    container-slack, find-all-objects, find-all-stacks, aggregate-strings,\n\
+    duplicates, dict-key-census, grep-objects, and async-task-graph.\n",
+    +[](AnalysisShell& shell, const std::string& commands_str) -> void {
+      std::vector<std::string> commands;
+      for (std::string command : phosg::split(commands_str, ';')) {
+        phosg::strip_whitespace(command);
+        if (!command.empty()) {
+          commands.emplace_back(std::move(command));
         }
-      };
+      }
+      if (commands.empty()) {
+        throw std::invalid_argument("No commands given");
+      }
 
-      for (auto addr : roots) {
-        auto t = shell.env.traverse(&args);
-        t.is_short = true;
-        std::unordered_set<MappedPtr<PyObject>> seen;
-        print_entry(t, addr, seen);
+      // The visitors keep references to their arguments, so these must outlive the visitors
+      ScanProgress progress;
+      std::vector<std::unique_ptr<phosg::Arguments>> all_args;
+      std::vector<std::unique_ptr<ObjectVisitor>> visitors;
+      std::vector<ObjectVisitor*> visitor_ptrs;
+      for (const auto& command : commands) {
+        auto& args = all_args.emplace_back(std::make_unique<phosg::Arguments>(command));
+        const auto* def = ShellCommand::find(args->get<std::string>(0, true));
+        if (!def->make_visitor) {
+          throw std::invalid_argument(std::format("{} cannot be used in a fused scan", def->name));
+        }
+        visitor_ptrs.emplace_back(visitors.emplace_back(def->make_visitor(shell, *args, progress)).get());
+      }
+
+      run_object_visitors(shell, visitor_ptrs, progress);
+      for (size_t z = 0; z < visitors.size(); z++) {
+        phosg::fwrite_fmt(stderr, "{}> {}\n", shell.env.data_path, commands[z]);
+        fflush(stderr);
+        visitors[z]->finish();
+        fflush(stdout);
       }
     });
 
@@ -792,12 +3555,47 @@ ShellCommand c_context(
       phosg::print_data(stdout, data, bytes_to_read, read_start_addr.addr);
     });
 
+ShellCommand c_whose(
+    "whose", "\
+  whose ADDRESS|@SET [OPTIONS]\n\
+    Show which object contains ADDRESS: either the object\'s own memory (from\n\
+    its GC header, if any, to the end of its inline data) or a buffer it owns,\n\
+    like a list\'s item array or a dict\'s keys table. Keys tables shared by\n\
+    the split __dict__s of a class\'s instances are shown as belonging to the\n\
+    class. The first time this is used, this builds an index of all objects,\n\
+    which requires a full scan.\n\
+    Options:\n\
+      --bswap: Byteswap ADDRESS before looking it up.\n\
+    The formatting options to the repr command are also valid here.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      auto addrs = shell.parse_addrs(args.get<std::string>(1, true), args.get<bool>("bswap"));
+      const auto& owner_index = shell.get_owner_index();
+      auto name_for_type = shell.env.names_for_types();
+      for (auto addr : addrs) {
+        auto owners = owner_index.owners_of(addr);
+        if (owners.empty()) {
+          phosg::fwrite_fmt(stdout, "{} is not in any known object\n", addr);
+          continue;
+        }
+        for (const auto* interval : owners) {
+          auto t = shell.env.traverse(&args);
+          t.is_short = true;
+          if (t.max_recursion_depth < 0) {
+            t.max_recursion_depth = 0;
+          }
+          phosg::fwrite_fmt(stdout, "{} is {}: {}\n",
+              addr, describe_owner(shell.env, name_for_type, *interval, addr), t.repr(interval->owner));
+        }
+      }
+    });
+
 ShellCommand c_repr(
     "repr", "\
-  repr ADDRESS\n\
+  repr ADDRESS|@SET\n\
     Print the Python object at ADDRESS. If ADDRESS is preceded by one or more\n\
     asterisks, dereferences that many levels of pointers, and prints the\n\
-    pointed-to object at the end of the pointer chain. Options:\n\
+    pointed-to object at the end of the pointer chain. If a result set name\n\
+    preceded by @ is given instead, prints all objects in the set. Options:\n\
       --max-recursion-depth=N: Limit how deeply to print the found objects.\n\
       --max-entries=N: Limit how many items to print from each list/dict/etc.\n\
       --max-string-length=N: Limit, in bytes, how much data to print from each\n\
@@ -810,7 +3608,87 @@ ShellCommand c_repr(
     All of these options are also valid for other commands that print object\n\
     representations.\n",
     +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
-      auto addr = shell.parse_addr<PyObject>(args.get<std::string>(1, true), args.get<bool>("bswap"));
-      std::string repr = shell.env.traverse(&args).repr(addr);
-      phosg::fwrite_fmt(stderr, "{}\n", repr);
+      for (auto addr : shell.parse_addrs(args.get<std::string>(1, true), args.get<bool>("bswap"))) {
+        std::string repr = shell.env.traverse(&args).repr(addr.cast<PyObject>());
+        phosg::fwrite_fmt(stderr, "{}\n", repr);
+      }
+    });
+
+ShellCommand c_list_sets(
+    "list-sets", "\
+  list-sets\n\
+    Show the names and sizes of all saved result sets. Result sets are saved\n\
+    by commands that support the --as option, and can be used as inputs to\n\
+    some commands (for example, find-references and repr) by writing their\n\
+    names preceded by @.\n",
+    +[](AnalysisShell& shell, phosg::Arguments&) -> void {
+      for (const auto& [name, addrs] : shell.result_sets) {
+        phosg::fwrite_fmt(stdout, "@{}: {} addresses\n", name, addrs.size());
+      }
+      phosg::fwrite_fmt(stderr, "{} result sets\n", shell.result_sets.size());
+    });
+
+ShellCommand c_delete_set(
+    "delete-set", "\
+  delete-set NAME\n\
+    Delete a saved result set.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      std::string name = args.get<std::string>(1, true);
+      if (name.starts_with("@")) {
+        name = name.substr(1);
+      }
+      if (!shell.result_sets.erase(name)) {
+        throw std::out_of_range(std::format("There is no result set named {}", name));
+      }
+    });
+
+template <typename FnT>
+void fn_set_operation(AnalysisShell& shell, phosg::Arguments& args, FnT&& combine) {
+  const auto& dest_name = args.get<std::string>(1, true);
+  std::vector<MappedPtr<void>> result = shell.parse_addrs(args.get<std::string>(2, true), args.get<bool>("bswap"));
+  for (size_t z = 3;; z++) {
+    const auto& operand_str = args.get<std::string>(z, false);
+    if (operand_str.empty()) {
+      break;
+    }
+    auto operand = shell.parse_addrs(operand_str, args.get<bool>("bswap"));
+    std::vector<MappedPtr<void>> combined;
+    combine(result, operand, std::back_inserter(combined));
+    result = std::move(combined);
+  }
+  shell.save_result_set(dest_name, std::move(result));
+}
+
+ShellCommand c_set_union(
+    "set-union", "\
+  set-union DEST ADDRESS|@SET [ADDRESS|@SET ...]\n\
+    Save all addresses that are in any of the given sets as the result set\n\
+    DEST. Individual addresses are treated as sets of one address.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      fn_set_operation(shell, args, [](const auto& a, const auto& b, auto out) -> void {
+        std::set_union(a.begin(), a.end(), b.begin(), b.end(), out);
+      });
+    });
+
+ShellCommand c_set_intersection(
+    "set-intersection", "\
+  set-intersection DEST @SET [ADDRESS|@SET ...]\n\
+    Save all addresses that are in all of the given sets as the result set\n\
+    DEST. Individual addresses are treated as sets of one address.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      fn_set_operation(shell, args, [](const auto& a, const auto& b, auto out) -> void {
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), out);
+      });
+    });
+
+ShellCommand c_set_difference(
+    "set-difference", "\
+  set-difference DEST @SET [ADDRESS|@SET ...]\n\
+    Save all addresses that are in the first set but not in any of the other\n\
+    given sets as the result set DEST. Individual addresses are treated as\n\
+    sets of one address.\n",
+    +[](AnalysisShell& shell, phosg::Arguments& args) -> void {
+      fn_set_operation(shell, args, [](const auto& a, const auto& b, auto out) -> void {
+        std::set_difference(a.begin(), a.end(), b.begin(), b.end(), out);
+      });
     });
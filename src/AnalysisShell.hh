@@ -1,11 +1,17 @@
+#pragma once
+
 #include <stdint.h>
 
+#include <map>
 #include <memory>
 #include <phosg/Encoding.hh>
 #include <string>
+#include <vector>
 
 #include "Common.hh"
 #include "MemoryReader.hh"
+#include "ObjectGraph.hh"
+#include "OwnerIndex.hh"
 #include "Types/Base.hh"
 
 class AnalysisShell {
@@ -21,6 +27,11 @@ public:
   void prepare();
 
   void run();
+  // Runs each command in the given file (or stdin, if filename is "-") in order. Blank lines and lines beginning with
+  // # are ignored. Errors (including unknown commands) are reported but don't stop the script. Returns the number of
+  // commands that failed. Throws if scripts are nested more than MAX_SCRIPT_DEPTH levels deep via the source command.
+  static constexpr size_t MAX_SCRIPT_DEPTH = 16;
+  size_t run_script(const std::string& filename);
 
   template <typename T>
   MappedPtr<T> parse_addr(std::string addr_str, bool bswap) {
@@ -39,9 +50,31 @@ public:
     return addr;
   }
 
+  // Parses an address as parse_addr does, or a result set name preceded by @, which is replaced with all of the
+  // addresses in that set
+  std::vector<MappedPtr<void>> parse_addrs(const std::string& addr_str, bool bswap);
+
+  // Result sets are named sets of object addresses, saved by commands that support --as=NAME. Each set is sorted and
+  // contains no duplicates.
+  void save_result_set(const std::string& name, std::vector<MappedPtr<void>>&& addrs);
+  const std::vector<MappedPtr<void>>& get_result_set(const std::string& name) const;
+
+  // Returns the object graph, loading it from the snapshot's graph file if needed. Throws if build-graph hasn't been
+  // run for this snapshot.
+  const ObjectGraph& get_graph();
+  // Returns the index of which object owns each address, building it with a full scan the first time it's needed
+  const OwnerIndex& get_owner_index();
+
   void run_command(const std::string& command);
+  // Returns true if the command may change the shell's state (result sets, the loaded graph, or the owner index), so
+  // it can't run in a child process without losing its effects
+  bool command_changes_state(const std::string& command);
 
   bool should_exit = false;
+  size_t script_depth = 0;
   size_t max_threads;
   Environment env;
+  std::map<std::string, std::vector<MappedPtr<void>>> result_sets;
+  std::unique_ptr<ObjectGraph> graph;
+  std::unique_ptr<OwnerIndex> owner_index;
 };
@@ -0,0 +1,51 @@
+#include "Census.hh"
+
+#include <format>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Types/PyObject.hh"
+
+Census take_census(const Environment& env, size_t num_threads, ScanProgress* progress, const CensusObjectFn& object_fn) {
+  if (env.base_type_object.is_null()) {
+    throw std::runtime_error(std::format("Base type object not present in analysis data for {}", env.data_path));
+  }
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+
+  auto name_for_type = env.names_for_types();
+  std::vector<std::unordered_map<MappedPtr<PyTypeObject>, TypeCensus>> thread_censuses(num_threads);
+  env.r.map_all_addresses<PyObject>(
+      [&](const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) -> void {
+        auto name_it = name_for_type.find(obj.ob_type);
+        if ((name_it == name_for_type.end()) || env.invalid_reason(addr)) {
+          return;
+        }
+        ObjectExtents extents;
+        try {
+          extents = env.object_extents(addr);
+        } catch (const std::out_of_range&) {
+          return;
+        }
+        auto& type_census = thread_censuses[thread_index][obj.ob_type];
+        type_census.count++;
+        type_census.total_size += extents.total_size();
+        if (object_fn) {
+          object_fn(obj, addr, name_it->second, extents, thread_index);
+        }
+      },
+      8, num_threads, progress);
+
+  Census ret;
+  for (const auto& thread_census : thread_censuses) {
+    for (const auto& [type, type_census] : thread_census) {
+      auto& overall_census = ret[name_for_type.at(type)];
+      overall_census.count += type_census.count;
+      overall_census.total_size += type_census.total_size;
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <string>
+
+#include "ScanProgress.hh"
+#include "Types/Base.hh"
+
+// Per-type object counts and sizes for a whole snapshot. These are keyed by type name rather than by type object
+// address, so censuses of different snapshots (or different processes) can be compared.
+struct TypeCensus {
+  size_t count = 0;
+  size_t total_size = 0; // Full sizes, as returned by Environment::object_extents
+};
+using Census = std::map<std::string, TypeCensus>;
+
+// Called for each object counted by take_census, from the scan's worker threads
+using CensusObjectFn = std::function<void(
+    const PyObject& obj, MappedPtr<PyObject> addr, const std::string& type_name, const ObjectExtents& extents,
+    size_t thread_index)>;
+
+// Counts the valid objects of each known type in one parallel scan over the snapshot. Throws if the snapshot's base
+// type object hasn't been found yet.
+Census take_census(
+    const Environment& env, size_t num_threads, ScanProgress* progress = nullptr, const CensusObjectFn& object_fn = nullptr);
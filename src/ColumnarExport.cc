@@ -0,0 +1,81 @@
+#include "ColumnarExport.hh"
+
+#include <string.h>
+
+#include <algorithm>
+#include <format>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+
+ColumnTableWriter::RowGroup::RowGroup(ColumnTableWriter& table) : table(table) {
+  this->column_values.resize(this->table.columns.size());
+  for (auto& values : this->column_values) {
+    values.reserve(ColumnTableWriter::ROW_GROUP_SIZE);
+  }
+}
+
+void ColumnTableWriter::RowGroup::add_row(std::initializer_list<uint64_t> values) {
+  if (values.size() != this->column_values.size()) {
+    throw std::logic_error("Incorrect column count in row");
+  }
+  auto it = values.begin();
+  for (auto& column : this->column_values) {
+    column.emplace_back(*(it++));
+  }
+  if (this->column_values[0].size() >= ColumnTableWriter::ROW_GROUP_SIZE) {
+    this->flush();
+  }
+}
+
+void ColumnTableWriter::RowGroup::flush() {
+  if (this->column_values.empty() || this->column_values[0].empty()) {
+    return;
+  }
+  this->table.write_row_group(this->column_values);
+  for (auto& values : this->column_values) {
+    values.clear();
+  }
+}
+
+ColumnTableWriter::ColumnTableWriter(
+    const std::string& directory, const std::string& table_name, std::vector<Column> columns)
+    : table_name(table_name),
+      columns(std::move(columns)),
+      next_row(0) {
+  for (const auto& column : this->columns) {
+    std::string filename = std::format("{}/{}.{}.col", directory, this->table_name, column.name);
+    this->fds.emplace_back(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  }
+}
+
+ColumnTableWriter::RowGroup ColumnTableWriter::row_group() {
+  return RowGroup(*this);
+}
+
+void ColumnTableWriter::write_row_group(const std::vector<std::vector<uint64_t>>& column_values) {
+  // Reserving the row range is the only synchronization needed; each thread then writes its own disjoint range of
+  // every column file
+  size_t num_rows = column_values[0].size();
+  uint64_t start_row = this->next_row.fetch_add(num_rows);
+  for (size_t z = 0; z < this->fds.size(); z++) {
+    phosg::pwritex(this->fds[z], column_values[z].data(), num_rows * sizeof(uint64_t),
+        HEADER_SIZE + start_row * sizeof(uint64_t));
+  }
+}
+
+void ColumnTableWriter::finalize() {
+  for (size_t z = 0; z < this->fds.size(); z++) {
+    uint8_t header[HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, "PMTCOL01", 8);
+    header[0x08] = this->columns[z].type;
+    header[0x09] = sizeof(uint64_t);
+    uint64_t row_count = this->next_row.load();
+    for (size_t b = 0; b < sizeof(row_count); b++) {
+      header[0x10 + b] = static_cast<uint8_t>(row_count >> (b * 8));
+    }
+    memcpy(&header[0x18], this->table_name.data(), std::min<size_t>(this->table_name.size(), 20));
+    memcpy(&header[0x2C], this->columns[z].name.data(), std::min<size_t>(this->columns[z].name.size(), 20));
+    phosg::pwritex(this->fds[z], header, sizeof(header), 0);
+  }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <phosg/Filesystem.hh>
+#include <string>
+#include <vector>
+
+// Writer for the columnar format produced by export-objects. A table is a set of column files in one directory, named
+// TABLE.COLUMN.col. Each column file is a 64-byte header followed by row_count fixed-width little-endian values, so
+// files can be memory-mapped and indexed directly. The header format is:
+//   /* 00 */ char magic[8]; // "PMTCOL01"
+//   /* 08 */ char type; // 'u' = unsigned integer, 'i' = signed integer
+//   /* 09 */ uint8_t width; // Bytes per value (currently always 8)
+//   /* 0A */ uint8_t unused[6];
+//   /* 10 */ uint64_t row_count;
+//   /* 18 */ char table_name[20]; // Null-padded
+//   /* 2C */ char column_name[20]; // Null-padded
+//   /* 40 */ values follow
+// Rows are written in row groups by independent threads, so they are not in any particular order, but row N of every
+// column in a table always describes the same entity.
+class ColumnTableWriter {
+public:
+  struct Column {
+    std::string name;
+    char type;
+  };
+
+  // Buffers rows for one thread, and writes them to the table as a row group whenever the buffer fills up.
+  class RowGroup {
+  public:
+    explicit RowGroup(ColumnTableWriter& table);
+    RowGroup(const RowGroup&) = delete;
+    RowGroup(RowGroup&&) = default;
+    RowGroup& operator=(const RowGroup&) = delete;
+    RowGroup& operator=(RowGroup&&) = delete;
+    ~RowGroup() = default;
+
+    // values must have the same number of entries as the table has columns
+    void add_row(std::initializer_list<uint64_t> values);
+    void flush();
+
+  private:
+    ColumnTableWriter& table;
+    std::vector<std::vector<uint64_t>> column_values;
+  };
+
+  static constexpr size_t HEADER_SIZE = 0x40;
+  static constexpr size_t ROW_GROUP_SIZE = 0x10000;
+
+  ColumnTableWriter(const std::string& directory, const std::string& table_name, std::vector<Column> columns);
+  ColumnTableWriter(const ColumnTableWriter&) = delete;
+  ColumnTableWriter(ColumnTableWriter&&) = delete;
+  ColumnTableWriter& operator=(const ColumnTableWriter&) = delete;
+  ColumnTableWriter& operator=(ColumnTableWriter&&) = delete;
+  ~ColumnTableWriter() = default;
+
+  RowGroup row_group();
+
+  // Writes the headers for all columns. Must be called after all row groups are flushed.
+  void finalize();
+
+  inline uint64_t row_count() const {
+    return this->next_row.load();
+  }
+  inline const std::string& name() const {
+    return this->table_name;
+  }
+  inline const std::vector<Column>& get_columns() const {
+    return this->columns;
+  }
+
+private:
+  std::string table_name;
+  std::vector<Column> columns;
+  std::vector<phosg::scoped_fd> fds;
+  std::atomic<uint64_t> next_row;
+
+  void write_row_group(const std::vector<std::vector<uint64_t>>& column_values);
+};
@@ -0,0 +1,571 @@
+#include "GraphAnalysis.hh"
+
+#include <atomic>
+#include <deque>
+#include <format>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include "Types/PyCellObject.hh"
+#include "Types/PyDictObject.hh"
+#include "Types/PyFrameObject.hh"
+#include "Types/PyListObject.hh"
+#include "Types/PyObject.hh"
+#include "Types/PySetObject.hh"
+#include "Types/PyStringObjects.hh"
+#include "Types/PyThreadState.hh"
+#include "Types/PyTupleObject.hh"
+#include "Types/PyTypeObject.hh"
+
+const char* name_for_root_kind(RootKind kind) {
+  switch (kind) {
+    case RootKind::NONE:
+      return "none";
+    case RootKind::TYPE_OBJECT:
+      return "type object";
+    case RootKind::MODULE:
+      return "module";
+    case RootKind::INTERPRETER_DICT:
+      return "interpreter dict";
+    case RootKind::RUNNING_FRAME:
+      return "running frame";
+    case RootKind::INTERNED_STRING:
+      return "interned string";
+    case RootKind::THREAD_STATE:
+      return "thread state";
+    case RootKind::UNREFERENCED:
+      return "unreferenced object";
+  }
+  throw std::logic_error("Invalid root kind");
+}
+
+std::vector<RootKind> find_roots(
+    const Environment& env, const ObjectGraph& graph, size_t num_threads, bool include_unreferenced) {
+  auto module_type = env.get_type_if_exists("module");
+  auto frame_type = env.get_type_if_exists("frame");
+  auto str_type = env.get_type_if_exists("str");
+
+  std::vector<RootKind> ret(graph.node_count(), RootKind::NONE);
+  ObjectGraph::parallel_ranges(env.r, graph.node_count(), num_threads, [&](size_t start, size_t end, size_t) -> void {
+    for (size_t id = start; id < end; id++) {
+      auto addr = graph.addr_for_id(id);
+      const auto& obj = env.r.get(addr);
+      if (obj.ob_type == env.base_type_object) {
+        ret[id] = RootKind::TYPE_OBJECT;
+      } else if (!module_type.is_null() && (obj.ob_type == module_type)) {
+        ret[id] = RootKind::MODULE;
+      } else if (!frame_type.is_null() && (obj.ob_type == frame_type) &&
+          env.r.get(addr.cast<PyFrameObject>()).is_running()) {
+        ret[id] = RootKind::RUNNING_FRAME;
+      } else if (!str_type.is_null() && (obj.ob_type == str_type) &&
+          (env.r.get(addr.cast<PyASCIIStringObject>()).intern_state() >= 2)) {
+        ret[id] = RootKind::INTERNED_STRING;
+      } else if (include_unreferenced && graph.referrers(id).empty()) {
+        ret[id] = RootKind::UNREFERENCED;
+      }
+    }
+  });
+  return ret;
+}
+
+std::vector<RootKind> find_interpreter_roots(const Environment& env, const ObjectGraph& graph, size_t num_threads) {
+  // Only interned dicts at least this large are considered; the real one has thousands of entries in any process
+  static constexpr int64_t MIN_INTERNED_DICT_SIZE = 256;
+
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  auto module_type = env.get_type_if_exists("module");
+  auto dict_type = env.get_type_if_exists("dict");
+  auto frame_type = env.get_type_if_exists("frame");
+  auto str_type = env.get_type_if_exists("str");
+
+  struct ThreadResults {
+    std::vector<uint32_t> module_ids;
+    uint32_t interned_dict_id = ObjectGraph::INVALID_ID;
+    int64_t interned_dict_size = 0;
+  };
+  std::vector<ThreadResults> thread_results(num_threads);
+  std::vector<RootKind> ret(graph.node_count(), RootKind::NONE);
+  ObjectGraph::parallel_ranges(env.r, graph.node_count(), num_threads,
+      [&](size_t start, size_t end, size_t thread_index) -> void {
+        auto& results = thread_results[thread_index];
+        for (size_t id = start; id < end; id++) {
+          auto addr = graph.addr_for_id(id);
+          const auto& obj = env.r.get(addr);
+          if (obj.ob_type == env.base_type_object) {
+            if (!env.r.get(addr.cast<PyTypeObject>()).is_heap_type()) {
+              ret[id] = RootKind::TYPE_OBJECT;
+            }
+          } else if (!module_type.is_null() && (obj.ob_type == module_type)) {
+            results.module_ids.emplace_back(id);
+          } else if (!frame_type.is_null() && (obj.ob_type == frame_type) &&
+              env.r.get(addr.cast<PyFrameObject>()).is_running()) {
+            ret[id] = RootKind::RUNNING_FRAME;
+          } else if (!str_type.is_null() && (obj.ob_type == str_type) &&
+              (env.r.get(addr.cast<PyASCIIStringObject>()).intern_state() >= 2)) {
+            ret[id] = RootKind::INTERNED_STRING;
+          } else if (!dict_type.is_null() && (obj.ob_type == dict_type)) {
+            const auto& dict = env.r.get(addr.cast<PyDictObject>());
+            if ((dict.ma_used < MIN_INTERNED_DICT_SIZE) || (dict.ma_used <= results.interned_dict_size) ||
+                !dict.ma_values.is_null()) {
+              continue;
+            }
+            try {
+              bool is_interned_dict = true;
+              for (const auto& [key, value] : dict.get_items(env.r)) {
+                if ((key != value) || (graph.id_for_addr(key) == ObjectGraph::INVALID_ID) ||
+                    (env.r.get(key).ob_type != str_type) ||
+                    (env.r.get(key.cast<PyASCIIStringObject>()).intern_state() == 0)) {
+                  is_interned_dict = false;
+                  break;
+                }
+              }
+              if (is_interned_dict) {
+                results.interned_dict_id = id;
+                results.interned_dict_size = dict.ma_used;
+              }
+            } catch (const std::out_of_range&) {
+            }
+          }
+        }
+      });
+
+  uint32_t interned_dict_id = ObjectGraph::INVALID_ID;
+  int64_t interned_dict_size = 0;
+  std::vector<uint32_t> module_ids;
+  for (const auto& results : thread_results) {
+    if (results.interned_dict_size > interned_dict_size) {
+      interned_dict_id = results.interned_dict_id;
+      interned_dict_size = results.interned_dict_size;
+    }
+    module_ids.insert(module_ids.end(), results.module_ids.begin(), results.module_ids.end());
+  }
+  if (interned_dict_id != ObjectGraph::INVALID_ID) {
+    ret[interned_dict_id] = RootKind::INTERPRETER_DICT;
+  } else {
+    phosg::fwrite_fmt(stderr,
+        "Warning: could not find the interned string dict; only immortal interned strings are roots\n");
+  }
+
+  // The interpreter state refers to sys.modules, the sys module's dict, and the builtins module's dict. (It refers to
+  // a few other modules too, such as importlib, but these are always in sys.modules.)
+  auto mark_dict = [&](MappedPtr<PyObject> dict_addr) -> bool {
+    uint32_t dict_id = dict_addr.is_null() ? ObjectGraph::INVALID_ID : graph.id_for_addr(dict_addr);
+    if ((dict_id == ObjectGraph::INVALID_ID) || (env.r.get(dict_addr).ob_type != dict_type)) {
+      return false;
+    }
+    ret[dict_id] = RootKind::INTERPRETER_DICT;
+    return true;
+  };
+  bool found_sys_modules = false;
+  for (uint32_t module_id : module_ids) {
+    try {
+      auto dict_addr = env.r.get(graph.addr_for_id(module_id).offset_bytes(0x10).cast<MappedPtr<PyObject>>());
+      if (dict_addr.is_null() || (graph.id_for_addr(dict_addr) == ObjectGraph::INVALID_ID) ||
+          (env.r.get(dict_addr).ob_type != dict_type)) {
+        continue;
+      }
+      const auto& dict = env.r.get(dict_addr.cast<PyDictObject>());
+      auto name_addr = dict.value_for_key<PyObject>(env.r, "__name__");
+      if (string_equals(env.r, name_addr, "sys")) {
+        mark_dict(dict_addr);
+        found_sys_modules |= mark_dict(dict.value_for_key<PyObject>(env.r, "modules"));
+      } else if (string_equals(env.r, name_addr, "builtins")) {
+        mark_dict(dict_addr);
+      }
+    } catch (const std::out_of_range&) {
+    } catch (const invalid_object&) {
+    }
+  }
+  if (!found_sys_modules) {
+    phosg::fwrite_fmt(stderr, "Warning: could not find sys.modules; treating all modules as roots\n");
+    for (uint32_t module_id : module_ids) {
+      ret[module_id] = RootKind::MODULE;
+    }
+  }
+
+  return ret;
+}
+
+void add_thread_state_roots(
+    const Environment& env, const ObjectGraph& graph, std::vector<RootKind>& root_kinds, size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  std::vector<std::vector<uint32_t>> thread_root_ids(num_threads);
+  env.r.map_all_addresses<PyThreadState>(
+      [&](const PyThreadState& obj, MappedPtr<PyThreadState>, size_t thread_index) -> void {
+        if (obj.invalid_reason(env)) {
+          return;
+        }
+        for (auto addr : {obj.frame.cast<PyObject>(), obj.dict, obj.context, obj.async_exc, obj.curexc_type,
+                 obj.curexc_value, obj.curexc_traceback, obj.exc_state.exc_type, obj.exc_state.exc_value,
+                 obj.exc_state.exc_traceback, obj.c_profileobj, obj.c_traceobj, obj.async_gen_firstiter,
+                 obj.async_gen_finalizer}) {
+          uint32_t id = addr.is_null() ? ObjectGraph::INVALID_ID : graph.id_for_addr(addr);
+          if (id != ObjectGraph::INVALID_ID) {
+            thread_root_ids[thread_index].emplace_back(id);
+          }
+        }
+      },
+      8, num_threads);
+
+  for (const auto& root_ids : thread_root_ids) {
+    for (uint32_t id : root_ids) {
+      if (root_kinds[id] == RootKind::NONE) {
+        root_kinds[id] = RootKind::THREAD_STATE;
+      }
+    }
+  }
+}
+
+std::vector<uint64_t> find_reachable(
+    const Environment& env, const ObjectGraph& graph, const std::vector<RootKind>& root_kinds, size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  std::vector<std::atomic<uint64_t>> bitmap((graph.node_count() + 63) >> 6);
+  // Returns true if id wasn't already marked
+  auto mark = [&](uint32_t id) -> bool {
+    uint64_t mask = 1ULL << (id & 63);
+    auto& word = bitmap[id >> 6];
+    return !(word.load(std::memory_order_relaxed) & mask) && !(word.fetch_or(mask, std::memory_order_relaxed) & mask);
+  };
+
+  std::vector<uint32_t> frontier;
+  for (size_t id = 0; id < root_kinds.size(); id++) {
+    if ((root_kinds[id] != RootKind::NONE) && mark(id)) {
+      frontier.emplace_back(id);
+    }
+  }
+
+  std::vector<std::vector<uint32_t>> thread_next_frontiers(num_threads);
+  while (!frontier.empty()) {
+    ObjectGraph::parallel_ranges(env.r, frontier.size(), num_threads,
+        [&](size_t start, size_t end, size_t thread_index) -> void {
+          auto& next_frontier = thread_next_frontiers[thread_index];
+          for (size_t z = start; z < end; z++) {
+            for (uint32_t referent_id : graph.referents(frontier[z])) {
+              if (mark(referent_id)) {
+                next_frontier.emplace_back(referent_id);
+              }
+            }
+          }
+        });
+    frontier.clear();
+    for (auto& next_frontier : thread_next_frontiers) {
+      frontier.insert(frontier.end(), next_frontier.begin(), next_frontier.end());
+      next_frontier.clear();
+    }
+  }
+
+  std::vector<uint64_t> ret;
+  ret.reserve(bitmap.size());
+  for (const auto& word : bitmap) {
+    ret.emplace_back(word.load(std::memory_order_relaxed));
+  }
+  return ret;
+}
+
+std::vector<uint64_t> object_sizes(const Environment& env, const ObjectGraph& graph, size_t num_threads) {
+  std::vector<uint64_t> ret(graph.node_count(), 0);
+  ObjectGraph::parallel_ranges(env.r, graph.node_count(), num_threads, [&](size_t start, size_t end, size_t) -> void {
+    for (size_t id = start; id < end; id++) {
+      try {
+        ret[id] = env.object_extents(graph.addr_for_id(id)).total_size();
+      } catch (const std::out_of_range&) {
+      }
+    }
+  });
+  return ret;
+}
+
+DominatorTree::DominatorTree(const ObjectGraph& graph, const std::vector<RootKind>& root_kinds) {
+  constexpr uint32_t NONE = ObjectGraph::INVALID_ID;
+  size_t num_nodes = graph.node_count();
+
+  std::vector<uint32_t> root_ids;
+  for (size_t id = 0; id < num_nodes; id++) {
+    if (root_kinds[id] != RootKind::NONE) {
+      root_ids.emplace_back(id);
+    }
+  }
+
+  // Number all reachable objects in depth-first preorder, starting from the virtual root, and record each one's parent
+  // in the DFS tree. This is iterative since the graph can be far deeper than the stack allows.
+  std::vector<uint32_t> index_for_id(num_nodes, NONE);
+  std::vector<uint32_t> parent;
+  this->id_for_index.emplace_back(NONE);
+  parent.emplace_back(0);
+  {
+    struct StackEntry {
+      uint32_t index;
+      size_t next_edge;
+    };
+    std::vector<StackEntry> stack;
+    stack.emplace_back(StackEntry{0, 0});
+    while (!stack.empty()) {
+      auto& entry = stack.back();
+      uint32_t id = this->id_for_index[entry.index];
+      auto edges = (entry.index == 0) ? std::span<const uint32_t>(root_ids) : graph.referents(id);
+      if (entry.next_edge >= edges.size()) {
+        stack.pop_back();
+        continue;
+      }
+      uint32_t next_id = edges[entry.next_edge++];
+      if (index_for_id[next_id] == NONE) {
+        uint32_t next_index = this->id_for_index.size();
+        index_for_id[next_id] = next_index;
+        this->id_for_index.emplace_back(next_id);
+        parent.emplace_back(entry.index);
+        stack.emplace_back(StackEntry{next_index, 0}); // This invalidates entry
+      }
+    }
+  }
+  size_t num_indexes = this->id_for_index.size();
+
+  // Compute semidominators in reverse preorder, using a link-eval forest with path compression
+  std::vector<uint32_t> semi(num_indexes);
+  std::vector<uint32_t> label(num_indexes);
+  std::vector<uint32_t> ancestor(num_indexes, NONE);
+  for (size_t z = 0; z < num_indexes; z++) {
+    semi[z] = z;
+    label[z] = z;
+  }
+  std::vector<uint32_t> compress_stack;
+  auto eval = [&](uint32_t v) -> uint32_t {
+    if (ancestor[v] == NONE) {
+      return v;
+    }
+    for (uint32_t u = v; ancestor[ancestor[u]] != NONE; u = ancestor[u]) {
+      compress_stack.emplace_back(u);
+    }
+    while (!compress_stack.empty()) {
+      uint32_t u = compress_stack.back();
+      compress_stack.pop_back();
+      uint32_t a = ancestor[u];
+      if (semi[label[a]] < semi[label[u]]) {
+        label[u] = label[a];
+      }
+      ancestor[u] = ancestor[a];
+    }
+    return label[v];
+  };
+  for (size_t w = num_indexes - 1; w > 0; w--) {
+    uint32_t id = this->id_for_index[w];
+    if (root_kinds[id] != RootKind::NONE) {
+      semi[w] = 0;
+    }
+    for (uint32_t referrer_id : graph.referrers(id)) {
+      uint32_t v = index_for_id[referrer_id];
+      if (v == NONE) {
+        continue; // Not reachable from any root
+      }
+      uint32_t candidate = (v < w) ? v : semi[eval(v)];
+      if (candidate < semi[w]) {
+        semi[w] = candidate;
+      }
+    }
+    ancestor[w] = parent[w];
+  }
+  ancestor.clear();
+  ancestor.shrink_to_fit();
+  label.clear();
+  label.shrink_to_fit();
+
+  // The immediate dominator of each node is the nearest common ancestor, in the DFS tree, of its semidominator and
+  // its parent. Since ancestors have smaller preorder indexes, this can be found by walking up from the parent.
+  this->idom = std::move(parent);
+  for (size_t w = 1; w < num_indexes; w++) {
+    uint32_t d = this->idom[w];
+    while (d > semi[w]) {
+      d = this->idom[d];
+    }
+    this->idom[w] = d;
+  }
+}
+
+std::vector<uint64_t> DominatorTree::retained_sizes(const std::vector<uint64_t>& sizes) const {
+  std::vector<uint64_t> ret(this->size(), 0);
+  // Dominators always precede the nodes they dominate in preorder, so a single reverse pass accumulates each subtree
+  for (size_t z = this->size() - 1; z > 0; z--) {
+    ret[z] += sizes[this->id_for_index[z]];
+    ret[this->idom[z]] += ret[z];
+  }
+  return ret;
+}
+
+std::string describe_reference(const Environment& env, MappedPtr<PyObject> referrer, MappedPtr<PyObject> referent) {
+  const auto& obj = env.r.get(referrer);
+  try {
+    if (obj.ob_type == env.get_type_if_exists("dict")) {
+      for (const auto& [key, value] : env.r.get(referrer.cast<PyDictObject>()).get_items(env.r)) {
+        if (value == referent) {
+          auto t = env.traverse();
+          t.is_short = true;
+          t.max_recursion_depth = 0;
+          t.max_string_length = 0x40;
+          return std::format("[{}]", t.repr(key));
+        } else if (key == referent) {
+          return "<key>";
+        }
+      }
+    } else if (obj.ob_type == env.get_type_if_exists("list")) {
+      auto items = env.r.get(referrer.cast<PyListObject>()).get_items(env.r);
+      for (size_t z = 0; z < items.size(); z++) {
+        if (items[z] == referent) {
+          return std::format("[{}]", z);
+        }
+      }
+    } else if (obj.ob_type == env.get_type_if_exists("tuple")) {
+      auto items = env.r.get(referrer.cast<PyTupleObject>()).get_items();
+      for (size_t z = 0; z < items.size(); z++) {
+        if (items[z] == referent) {
+          return std::format("[{}]", z);
+        }
+      }
+    } else if (obj.ob_type == env.get_type_if_exists("set")) {
+      return "<member>";
+    } else if (obj.ob_type == env.get_type_if_exists("cell")) {
+      return "cell_contents";
+    } else if (obj.ob_type == env.get_type_if_exists("frame")) {
+      const auto& frame = env.r.get(referrer.cast<PyFrameObject>());
+      for (const auto& [name, value] : frame.locals(env)) {
+        if (value == referent) {
+          return std::format("local {}", decode_string_types(env.r, name).data);
+        }
+      }
+      const std::pair<uint64_t, const char*> frame_fields[] = {
+          {frame.f_back.addr, "f_back"},
+          {frame.f_code.addr, "f_code"},
+          {frame.f_builtins.addr, "f_builtins"},
+          {frame.f_globals.addr, "f_globals"},
+          {frame.f_locals.addr, "f_locals"},
+          {frame.f_trace.addr, "f_trace"},
+          {frame.f_gen.addr, "f_gen"},
+      };
+      for (const auto& [addr, name] : frame_fields) {
+        if (addr == referent.addr) {
+          return name;
+        }
+      }
+    }
+  } catch (const std::exception&) {
+    // Fall through to searching the object's memory
+  }
+
+  try {
+    size_t size = env.shallow_size(referrer);
+    auto r = env.r.read(referrer, size);
+    for (size_t offset = sizeof(PyObject); offset + sizeof(uint64_t) <= size; offset += sizeof(uint64_t)) {
+      if (r.pget_u64l(offset) == referent.addr) {
+        return std::format("+0x{:X}", offset);
+      }
+    }
+  } catch (const std::out_of_range&) {
+  }
+  return "";
+}
+
+std::vector<std::vector<uint32_t>> paths_to_roots(
+    const ObjectGraph& graph, const std::vector<RootKind>& root_kinds, uint32_t target_id, size_t max_paths) {
+  // Breadth-first search over referrers, so the first time each root is reached is along a shortest path. next_hop
+  // maps each visited object to the object it refers to on the way to the target.
+  std::unordered_map<uint32_t, uint32_t> next_hop;
+  std::deque<uint32_t> queue;
+  std::vector<std::vector<uint32_t>> ret;
+  next_hop.emplace(target_id, ObjectGraph::INVALID_ID);
+  queue.emplace_back(target_id);
+  while (!queue.empty() && (ret.size() < max_paths)) {
+    uint32_t id = queue.front();
+    queue.pop_front();
+
+    if (root_kinds[id] != RootKind::NONE) {
+      auto& path = ret.emplace_back();
+      for (uint32_t hop_id = id; hop_id != ObjectGraph::INVALID_ID; hop_id = next_hop.at(hop_id)) {
+        path.emplace_back(hop_id);
+      }
+      // Don't search past roots; a longer path through a root isn't interesting
+      continue;
+    }
+
+    for (uint32_t referrer_id : graph.referrers(id)) {
+      if (next_hop.emplace(referrer_id, id).second) {
+        queue.emplace_back(referrer_id);
+      }
+    }
+  }
+  return ret;
+}
+
+std::vector<uint32_t> strongly_connected_components(const ObjectGraph& graph, size_t* num_components) {
+  constexpr uint32_t NONE = ObjectGraph::INVALID_ID;
+  size_t num_nodes = graph.node_count();
+
+  std::vector<uint32_t> index_for_id(num_nodes, NONE);
+  std::vector<uint32_t> low_link(num_nodes, 0);
+  std::vector<bool> on_stack(num_nodes, false);
+  std::vector<uint32_t> component_stack;
+  struct CallEntry {
+    uint32_t id;
+    size_t next_edge;
+  };
+  std::vector<CallEntry> call_stack;
+  uint32_t next_index = 0;
+  uint32_t next_component = 0;
+  std::vector<uint32_t> component_for_id(num_nodes, NONE);
+
+  auto visit = [&](uint32_t id) -> void {
+    index_for_id[id] = next_index;
+    low_link[id] = next_index;
+    next_index++;
+    component_stack.emplace_back(id);
+    on_stack[id] = true;
+    call_stack.emplace_back(CallEntry{id, 0});
+  };
+
+  for (size_t start_id = 0; start_id < num_nodes; start_id++) {
+    if (index_for_id[start_id] != NONE) {
+      continue;
+    }
+    visit(start_id);
+    while (!call_stack.empty()) {
+      auto& entry = call_stack.back();
+      uint32_t id = entry.id;
+      auto edges = graph.referents(id);
+      if (entry.next_edge < edges.size()) {
+        uint32_t next_id = edges[entry.next_edge++];
+        if (index_for_id[next_id] == NONE) {
+          visit(next_id); // This invalidates entry
+        } else if (on_stack[next_id]) {
+          low_link[id] = std::min(low_link[id], index_for_id[next_id]);
+        }
+        continue;
+      }
+
+      call_stack.pop_back();
+      if (low_link[id] == index_for_id[id]) {
+        uint32_t member_id;
+        do {
+          member_id = component_stack.back();
+          component_stack.pop_back();
+          on_stack[member_id] = false;
+          component_for_id[member_id] = next_component;
+        } while (member_id != id);
+        next_component++;
+      }
+      if (!call_stack.empty()) {
+        uint32_t parent_id = call_stack.back().id;
+        low_link[parent_id] = std::min(low_link[parent_id], low_link[id]);
+      }
+    }
+  }
+
+  if (num_components) {
+    *num_components = next_component;
+  }
+  return component_for_id;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "ObjectGraph.hh"
+#include "Types/Base.hh"
+
+// Analyses over the object graph that need to know which objects are alive for reasons outside the graph (roots).
+
+enum class RootKind : uint8_t {
+  NONE = 0,
+  TYPE_OBJECT, // All types for find_roots; only static (non-heap) types for find_interpreter_roots
+  MODULE, // Only used by find_roots
+  INTERPRETER_DICT, // sys.modules, sys.__dict__, builtins.__dict__, and the interned string dict
+  RUNNING_FRAME, // Frames that were executing on some thread when the snapshot was taken
+  INTERNED_STRING, // Only immortal interned strings; mortal ones are not kept alive by the interned dict
+  THREAD_STATE, // Objects referenced by a PyThreadState (current frame, thread dict, etc.); see add_thread_state_roots
+  UNREFERENCED, // Objects with no referrers in the graph; only used if requested (see find_roots)
+};
+
+const char* name_for_root_kind(RootKind kind);
+
+// Returns the root kind for each object in the graph, indexed by id. Objects that have no referrers in the graph are
+// usually referenced only from C code or from types python-memtools doesn't implement; if include_unreferenced is
+// true, these are also treated as roots.
+std::vector<RootKind> find_roots(
+    const Environment& env, const ObjectGraph& graph, size_t num_threads, bool include_unreferenced);
+
+// Returns the objects the interpreter itself keeps alive, indexed by id. Unlike find_roots, this doesn't treat every
+// type and module as a root: the roots are static types, the sys.modules dict, the sys and builtins modules' dicts,
+// the interned string dict, running frames, and immortal interned strings. Heap types and modules are then alive only
+// if they're reachable from these (for example, via sys.modules), so leaked ones can be found. The interned dict isn't
+// referenced by any object; it's identified as the largest dict that maps only interned strings to themselves. If no
+// sys module is found, all modules are treated as roots instead, since nothing else would keep them alive.
+std::vector<RootKind> find_interpreter_roots(const Environment& env, const ObjectGraph& graph, size_t num_threads);
+
+// Scans memory for PyThreadState structures, and marks the objects they refer to (each thread's current frame,
+// thread dict, context, and exception state) as roots, unless they're already roots of another kind. This requires a
+// full scan of the snapshot, so find_roots doesn't do it.
+void add_thread_state_roots(
+    const Environment& env, const ObjectGraph& graph, std::vector<RootKind>& root_kinds, size_t num_threads);
+
+// Finds all objects reachable from the roots with a parallel level-synchronous breadth-first search. Returns a bitmap
+// indexed by id: object id is reachable if bit (id & 63) of word (id >> 6) is set.
+std::vector<uint64_t> find_reachable(
+    const Environment& env, const ObjectGraph& graph, const std::vector<RootKind>& root_kinds, size_t num_threads);
+
+// Returns the full size of each object in the graph (see Environment::object_extents), indexed by id. Objects whose
+// size can't be determined have size 0.
+std::vector<uint64_t> object_sizes(const Environment& env, const ObjectGraph& graph, size_t num_threads);
+
+// The dominator tree of all objects reachable from the roots, computed with the semi-NCA algorithm. Nodes are
+// identified by their depth-first preorder index; index 0 is a virtual node that refers to all roots, so the
+// immediate dominator of every root is 0. Objects not reachable from any root are not included.
+struct DominatorTree {
+  std::vector<uint32_t> id_for_index; // Object id for each preorder index; id_for_index[0] is INVALID_ID
+  std::vector<uint32_t> idom; // Immediate dominator's preorder index, for each preorder index; idom[0] is 0
+
+  DominatorTree(const ObjectGraph& graph, const std::vector<RootKind>& root_kinds);
+
+  inline size_t size() const {
+    return this->id_for_index.size();
+  }
+
+  // Returns the total size of the objects dominated by each node (including itself), indexed by preorder index.
+  // sizes is indexed by object id, as returned by object_sizes().
+  std::vector<uint64_t> retained_sizes(const std::vector<uint64_t>& sizes) const;
+};
+
+// Describes how referrer refers to referent, for showing reference paths: a dict key (as ['name']), a list or tuple
+// index (as [3]), a frame's local variable name, a named field of some types, or otherwise the offset within the
+// referrer at which the pointer was found. Returns an empty string if none of these applies.
+std::string describe_reference(const Environment& env, MappedPtr<PyObject> referrer, MappedPtr<PyObject> referent);
+
+// Searches backward from target through its referrers until reaching roots, and returns the shortest reference paths
+// from up to max_paths different roots. Each path begins with the root's id and ends with target_id. If the target
+// isn't reachable from any root, returns an empty list.
+std::vector<std::vector<uint32_t>> paths_to_roots(
+    const ObjectGraph& graph, const std::vector<RootKind>& root_kinds, uint32_t target_id, size_t max_paths);
+
+// Finds the strongly connected components of the graph with an iterative version of Tarjan's algorithm. Returns the
+// component number of each object, indexed by id; components are numbered from 0 in the order they're completed.
+std::vector<uint32_t> strongly_connected_components(const ObjectGraph& graph, size_t* num_components = nullptr);
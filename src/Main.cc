@@ -19,9 +19,11 @@
 #include <set>
 #include <string>
 
+#include "AnalysisServer.hh"
 #include "AnalysisShell.hh"
 #include "Common.hh"
 #include "MemoryReader.hh"
+#include "ScanProgress.hh"
 
 void chown_tree(const std::string& path, uid_t uid, gid_t gid) {
   if (lchown(path.c_str(), uid, gid) != 0) {
@@ -47,10 +49,24 @@ resulting files to the user specified by $SUDO_USER (if set); to prevent this,\n
 use --skip-chown.\n\
 \n\
 To analyze a memory snapshot:\n\
-  python-memtools --path=PATH [--command=COMMAND]\n\
-If COMMAND is given, runs that command and exits. Otherwise, opens a shell in\n\
-which you can analyze the snapshot. Run `help` in this shell to see the\n\
-available commands.\n");
+  python-memtools --path=PATH [--command=COMMAND | --script=FILENAME]\n\
+If COMMAND is given, runs that command and exits. If FILENAME is given, runs\n\
+each command in that file (one per line; blank lines and lines beginning with\n\
+# are ignored) against the same loaded snapshot, then exits; use - to read\n\
+commands from stdin. Otherwise, opens a shell in which you can analyze the\n\
+snapshot. Run `help` in this shell to see the available commands.\n\
+\n\
+To serve commands for a memory snapshot over a Unix socket:\n\
+  python-memtools --path=PATH --serve=SOCKET_PATH\n\
+The snapshot is loaded once; any number of clients can then connect to\n\
+SOCKET_PATH and run commands against it. See the README for the protocol.\n\
+\n\
+Options for analysis:\n\
+  --max-threads=N: Use this many threads for scans (default: one per core).\n\
+  --progress=FORMAT: Show scan progress as a status line (line; the default),\n\
+      as one JSON object per line (json), or not at all (none).\n\
+  --verbose: Print each object found during scans that support it, such as\n\
+      find-all-stacks and async-task-graph.\n");
 }
 
 int main(int argc, char** argv) {
@@ -64,6 +80,8 @@ int main(int argc, char** argv) {
   }
 
   size_t max_threads = args.get<uint64_t>("max-threads", 0);
+  ScanProgress::format = ScanProgress::parse_format(args.get<std::string>("progress", false));
+  ScanProgress::verbose = args.get<bool>("verbose");
 
   if (args.get<bool>("dump")) {
     uint64_t pid = args.get<uint64_t>("pid", 0);
@@ -96,9 +114,28 @@ int main(int argc, char** argv) {
   }
 
   const auto& command = args.get<std::string>("command");
+  const auto& script_filename = args.get<std::string>("script");
+  const auto& socket_path = args.get<std::string>("serve");
   if (!command.empty()) {
     shell.prepare();
     shell.run_command(command);
+  } else if (!script_filename.empty()) {
+    shell.prepare();
+    size_t num_failures = shell.run_script(script_filename);
+    if (num_failures) {
+      phosg::fwrite_fmt(stderr, "{} commands failed\n", num_failures);
+      return 1;
+    }
+  } else if (!socket_path.empty()) {
+    shell.prepare();
+    // run() only returns by throwing; catch it here so the server's destructor removes the socket
+    try {
+      AnalysisServer server(shell, socket_path);
+      server.run();
+    } catch (const std::exception& e) {
+      phosg::fwrite_fmt(stderr, "Server failed: {}\n", e.what());
+      return 1;
+    }
   } else {
     shell.run();
   }
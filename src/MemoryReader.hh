@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <sys/mman.h>
 
+#include <atomic>
 #include <filesystem>
 #include <map>
 #include <memory>
@@ -17,9 +18,16 @@
 #include <vector>
 
 #include "Common.hh"
+#include "ScanProgress.hh"
 
 class MemoryReader;
 
+class scan_cancelled : public std::runtime_error {
+public:
+  scan_cancelled() : runtime_error("Scan cancelled") {}
+  ~scan_cancelled() = default;
+};
+
 template <typename T = void>
 struct MappedPtr {
   // "Opaque" type for pointers in the mapped process' address space. This isn't really opaque (you can still just use
@@ -190,9 +198,13 @@ public:
     return this->regions_by_mapped.size();
   }
 
+  // Calls fn for every stride-aligned address in all regions, in parallel. If progress is given, its counters are
+  // displayed along with the scan position. If cancel_scans is set during the scan, the workers stop at the next block
+  // boundary and this throws scan_cancelled.
   template <typename T, typename FnT>
     requires(std::is_invocable_r_v<void, FnT, const T&, MappedPtr<T>, size_t>)
-  void map_all_addresses(FnT&& fn, size_t stride, size_t num_threads = 0, size_t object_size = sizeof(T)) const {
+  void map_all_addresses(FnT&& fn, size_t stride, size_t num_threads = 0, ScanProgress* progress = nullptr,
+      size_t object_size = sizeof(T)) const {
     if (stride & (stride - 1)) {
       throw std::logic_error("Stride must be a power of 2");
     }
@@ -219,6 +231,9 @@ public:
       size_t current_region = 0;
       uint64_t offset;
       while ((offset = current_offset.fetch_add(block_stride)) < region_start_offsets.back()) {
+        if (this->cancel_scans.load(std::memory_order_relaxed)) {
+          break;
+        }
         while (offset >= region_start_offsets[current_region + 1]) {
           current_region++;
         }
@@ -241,28 +256,39 @@ public:
       threads.emplace_back(thread_fn, thread_index);
     }
 
+    ScanProgress default_progress;
+    if (!progress) {
+      progress = &default_progress;
+    }
     size_t progress_current_region = 0;
     uint64_t progress_current_offset;
-    while ((progress_current_offset = current_offset.load()) < region_start_offsets.back()) {
-      while (progress_current_offset >= region_start_offsets[progress_current_region]) {
+    while (((progress_current_offset = current_offset.load()) < region_start_offsets.back()) &&
+        !this->cancel_scans.load(std::memory_order_relaxed)) {
+      while (progress_current_offset >= region_start_offsets[progress_current_region + 1]) {
         progress_current_region++;
       }
       auto progress_current_addr = regions[progress_current_region].first.offset_bytes(
           progress_current_offset - region_start_offsets[progress_current_region]);
-      auto checked_bytes_str = phosg::format_size(progress_current_offset);
-      auto total_bytes_str = phosg::format_size(region_start_offsets.back());
-      float progress = static_cast<float>(progress_current_offset) / static_cast<float>(region_start_offsets.back());
-      phosg::fwrite_fmt(stderr, "... {} ({}/{} regions, {}/{}, {:g}%)" CLEAR_LINE_TO_END "\r",
-          progress_current_addr, progress_current_region, regions.size(),
-          checked_bytes_str, total_bytes_str, progress * 100.0f);
+      progress->update(progress_current_addr.addr, progress_current_region, regions.size(), progress_current_offset,
+          region_start_offsets.back());
       usleep(100000);
     }
 
     for (auto& t : threads) {
       t.join();
     }
+    if (this->cancel_scans.load()) {
+      throw scan_cancelled();
+    }
+    progress->finish(region_start_offsets.back(), regions.size());
   }
 
+  // Set by the analysis server to stop a running command's scans early (see map_all_addresses). It's the caller's
+  // responsibility to clear this before starting the next command. This is shared by all readers in the process, so it
+  // also stops scans of other snapshots that the command loads (like diff's --against snapshot); the server runs at
+  // most one command at a time in its own process, and runs the others in child processes.
+  static inline std::atomic<bool> cancel_scans = false;
+
   static std::vector<std::pair<MappedPtr<void>, size_t>> ranges_for_pid(uint64_t pid);
   static void dump(uint64_t pid, const std::string& directory, size_t max_threads);
 
@@ -0,0 +1,278 @@
+#include "ObjectGraph.hh"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <phosg/Filesystem.hh>
+#include <stdexcept>
+#include <thread>
+
+#include "Types/PyObject.hh"
+
+static constexpr size_t BUILD_CHUNK_SIZE = 0x1000;
+
+static size_t align8(size_t size) {
+  return (size + 7) & ~static_cast<size_t>(7);
+}
+
+ObjectGraph::ObjectGraph(const std::string& filename) : file(filename) {
+  this->parse_file();
+}
+
+ObjectGraph::ObjectGraph(MemoryMappedFile&& file) : file(std::move(file)) {
+  this->parse_file();
+}
+
+void ObjectGraph::parse_file() {
+  if (this->file.total_size < HEADER_SIZE) {
+    throw std::runtime_error(std::format("{} is too small to be an object graph", this->file.filename));
+  }
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(this->file.all_data);
+  if (memcmp(data, "PMTGRF01", 8)) {
+    throw std::runtime_error(std::format("{} is not an object graph", this->file.filename));
+  }
+  this->num_nodes = *reinterpret_cast<const uint64_t*>(data + 0x08);
+  this->num_edges = *reinterpret_cast<const uint64_t*>(data + 0x10);
+  this->num_types = *reinterpret_cast<const uint64_t*>(data + 0x18);
+
+  size_t offset = HEADER_SIZE;
+  this->addrs = reinterpret_cast<const uint64_t*>(data + offset);
+  offset += this->num_nodes * sizeof(uint64_t);
+  this->referent_offsets = reinterpret_cast<const uint64_t*>(data + offset);
+  offset += (this->num_nodes + 1) * sizeof(uint64_t);
+  this->referrer_offsets = reinterpret_cast<const uint64_t*>(data + offset);
+  offset += (this->num_nodes + 1) * sizeof(uint64_t);
+  this->referent_ids = reinterpret_cast<const uint32_t*>(data + offset);
+  offset += align8(this->num_edges * sizeof(uint32_t));
+  this->referrer_ids = reinterpret_cast<const uint32_t*>(data + offset);
+  offset += align8(this->num_edges * sizeof(uint32_t));
+  if (offset > this->file.total_size) {
+    throw std::runtime_error(std::format("{} is truncated", this->file.filename));
+  }
+}
+
+std::string ObjectGraph::filename_for_environment(const Environment& env) {
+  // This uses the same convention as analysis-data.json
+  return std::format("{}{:c}object-graph.bin", env.data_path, std::filesystem::is_directory(env.data_path) ? '/' : ':');
+}
+
+uint32_t ObjectGraph::id_for_addr(MappedPtr<void> addr) const {
+  const uint64_t* end = this->addrs + this->num_nodes;
+  const uint64_t* it = std::lower_bound(this->addrs, end, addr.addr);
+  return ((it == end) || (*it != addr.addr)) ? INVALID_ID : (it - this->addrs);
+}
+
+void ObjectGraph::parallel_ranges(const MemoryReader& r, size_t count, size_t num_threads,
+    const std::function<void(size_t, size_t, size_t)>& fn) {
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  std::atomic<size_t> next_start(0);
+  std::atomic<bool> failed = false;
+  std::vector<std::exception_ptr> errors(num_threads);
+  auto thread_fn = [&](size_t thread_index) -> void {
+    // An exception escaping a thread would terminate the process, so save it and rethrow it on the calling thread
+    try {
+      size_t start;
+      while ((start = next_start.fetch_add(BUILD_CHUNK_SIZE)) < count) {
+        if (r.cancel_scans.load(std::memory_order_relaxed) || failed.load(std::memory_order_relaxed)) {
+          break;
+        }
+        fn(start, std::min<size_t>(start + BUILD_CHUNK_SIZE, count), thread_index);
+      }
+    } catch (...) {
+      errors[thread_index] = std::current_exception();
+      failed = true;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  while (threads.size() < num_threads) {
+    threads.emplace_back(thread_fn, threads.size());
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  for (const auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+  if (r.cancel_scans.load()) {
+    throw scan_cancelled();
+  }
+}
+
+std::unique_ptr<ObjectGraph> ObjectGraph::build(
+    const Environment& env, const std::string& filename, size_t num_threads, size_t memory_limit) {
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+
+  // Find all objects and assign them ids in address order
+  auto name_for_type = env.names_for_types();
+  std::vector<std::vector<uint64_t>> thread_addrs(num_threads);
+  {
+    ScanProgress progress;
+    auto& num_objects = progress.add_counter("objects");
+    env.r.map_all_addresses<PyObject>(
+        [&](const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) -> void {
+          if (name_for_type.count(obj.ob_type) && !env.invalid_reason(addr)) {
+            thread_addrs[thread_index].emplace_back(addr.addr);
+            num_objects.fetch_add(1, std::memory_order_relaxed);
+          }
+        },
+        8, num_threads, &progress);
+    phosg::fwrite_fmt(stderr, CLEAR_LINE);
+  }
+  std::vector<uint64_t> addrs;
+  for (auto& v : thread_addrs) {
+    addrs.insert(addrs.end(), v.begin(), v.end());
+    v.clear();
+    v.shrink_to_fit();
+  }
+  std::sort(addrs.begin(), addrs.end());
+  size_t num_nodes = addrs.size();
+  if (num_nodes >= INVALID_ID) {
+    throw std::runtime_error("Too many objects to build a graph");
+  }
+  phosg::fwrite_fmt(stderr, "Found {} objects; collecting references\n", num_nodes);
+
+  auto get_referent_ids = [&](uint32_t id, std::vector<uint32_t>& ret) -> void {
+    ret.clear();
+    std::unordered_set<MappedPtr<void>> referents;
+    try {
+      referents = env.direct_referents(MappedPtr<PyObject>{addrs[id]});
+    } catch (const invalid_object&) {
+    }
+    for (auto referent : referents) {
+      auto it = std::lower_bound(addrs.begin(), addrs.end(), referent.addr);
+      if ((it != addrs.end()) && (*it == referent.addr)) {
+        ret.emplace_back(it - addrs.begin());
+      }
+    }
+    std::sort(ret.begin(), ret.end());
+  };
+
+  // Count each object's referents and referrers. Until the memory limit is reached, also keep the referent lists,
+  // grouped by chunk; since each chunk covers a contiguous range of ids, each chunk's buffer is already in the order
+  // it will appear in the file.
+  std::vector<uint32_t> out_degree(num_nodes, 0);
+  std::vector<std::atomic<uint32_t>> in_degree(num_nodes);
+  std::vector<std::vector<uint32_t>> chunk_referent_ids((num_nodes + BUILD_CHUNK_SIZE - 1) / BUILD_CHUNK_SIZE);
+  std::atomic<size_t> buffered_bytes(0);
+  std::atomic<bool> buffering(true);
+  parallel_ranges(env.r, num_nodes, num_threads, [&](size_t start, size_t end, size_t) -> void {
+    std::vector<uint32_t> referent_ids;
+    auto& chunk_buffer = chunk_referent_ids[start / BUILD_CHUNK_SIZE];
+    for (size_t id = start; id < end; id++) {
+      get_referent_ids(id, referent_ids);
+      out_degree[id] = referent_ids.size();
+      for (uint32_t referent_id : referent_ids) {
+        in_degree[referent_id].fetch_add(1, std::memory_order_relaxed);
+      }
+      if (buffering.load(std::memory_order_relaxed)) {
+        chunk_buffer.insert(chunk_buffer.end(), referent_ids.begin(), referent_ids.end());
+      }
+    }
+    if (buffering.load(std::memory_order_relaxed) &&
+        (buffered_bytes.fetch_add(chunk_buffer.size() * sizeof(uint32_t)) > memory_limit)) {
+      buffering = false;
+    }
+  });
+  if (!buffering) {
+    phosg::fwrite_fmt(stderr, "Edge buffers exceeded memory limit; references will be collected again\n");
+    chunk_referent_ids.clear();
+    chunk_referent_ids.shrink_to_fit();
+  }
+
+  // Compute the offsets and allocate the file
+  size_t num_edges = 0;
+  for (uint32_t degree : out_degree) {
+    num_edges += degree;
+  }
+  size_t addrs_offset = HEADER_SIZE;
+  size_t referent_offsets_offset = addrs_offset + num_nodes * sizeof(uint64_t);
+  size_t referrer_offsets_offset = referent_offsets_offset + (num_nodes + 1) * sizeof(uint64_t);
+  size_t referent_ids_offset = referrer_offsets_offset + (num_nodes + 1) * sizeof(uint64_t);
+  size_t referrer_ids_offset = referent_ids_offset + align8(num_edges * sizeof(uint32_t));
+  size_t file_size = referrer_ids_offset + align8(num_edges * sizeof(uint32_t));
+  phosg::fwrite_fmt(stderr, "Found {} references; writing {} to {}\n",
+      num_edges, phosg::format_size(file_size), filename);
+
+  MemoryMappedFile file = [&]() -> MemoryMappedFile {
+    phosg::scoped_fd fd(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (ftruncate(fd, file_size) != 0) {
+      throw std::runtime_error(std::format("Cannot resize {}", filename));
+    }
+    return MemoryMappedFile(fd, 0, file_size, true);
+  }();
+  uint8_t* data = reinterpret_cast<uint8_t*>(file.all_data);
+  uint64_t* file_addrs = reinterpret_cast<uint64_t*>(data + addrs_offset);
+  uint64_t* referent_offsets = reinterpret_cast<uint64_t*>(data + referent_offsets_offset);
+  uint64_t* referrer_offsets = reinterpret_cast<uint64_t*>(data + referrer_offsets_offset);
+  uint32_t* referent_ids = reinterpret_cast<uint32_t*>(data + referent_ids_offset);
+  uint32_t* referrer_ids = reinterpret_cast<uint32_t*>(data + referrer_ids_offset);
+
+  memcpy(file_addrs, addrs.data(), num_nodes * sizeof(uint64_t));
+  referent_offsets[0] = 0;
+  referrer_offsets[0] = 0;
+  for (size_t id = 0; id < num_nodes; id++) {
+    referent_offsets[id + 1] = referent_offsets[id] + out_degree[id];
+    referrer_offsets[id + 1] = referrer_offsets[id] + in_degree[id].load(std::memory_order_relaxed);
+  }
+  out_degree.clear();
+  out_degree.shrink_to_fit();
+
+  // Write the referent lists, either from the chunk buffers or by collecting them again
+  parallel_ranges(env.r, num_nodes, num_threads, [&](size_t start, size_t end, size_t) -> void {
+    if (buffering) {
+      const auto& chunk_buffer = chunk_referent_ids[start / BUILD_CHUNK_SIZE];
+      memcpy(referent_ids + referent_offsets[start], chunk_buffer.data(), chunk_buffer.size() * sizeof(uint32_t));
+    } else {
+      std::vector<uint32_t> ids;
+      for (size_t id = start; id < end; id++) {
+        get_referent_ids(id, ids);
+        if (ids.size() != referent_offsets[id + 1] - referent_offsets[id]) {
+          throw std::logic_error("Referent count changed between passes");
+        }
+        memcpy(referent_ids + referent_offsets[id], ids.data(), ids.size() * sizeof(uint32_t));
+      }
+    }
+  });
+  chunk_referent_ids.clear();
+  chunk_referent_ids.shrink_to_fit();
+
+  // Scatter the referrer lists (this is the counting sort by destination), then sort each list so the file contents
+  // don't depend on thread scheduling. in_degree is reused as each list's fill cursor.
+  for (auto& cursor : in_degree) {
+    cursor.store(0, std::memory_order_relaxed);
+  }
+  parallel_ranges(env.r, num_nodes, num_threads, [&](size_t start, size_t end, size_t) -> void {
+    for (size_t id = start; id < end; id++) {
+      for (uint64_t z = referent_offsets[id]; z < referent_offsets[id + 1]; z++) {
+        uint32_t referent_id = referent_ids[z];
+        uint64_t index = referrer_offsets[referent_id] + in_degree[referent_id].fetch_add(1, std::memory_order_relaxed);
+        referrer_ids[index] = id;
+      }
+    }
+  });
+  parallel_ranges(env.r, num_nodes, num_threads, [&](size_t start, size_t end, size_t) -> void {
+    for (size_t id = start; id < end; id++) {
+      std::sort(referrer_ids + referrer_offsets[id], referrer_ids + referrer_offsets[id + 1]);
+    }
+  });
+
+  // Write the header last, so an interrupted build doesn't leave a file that looks valid
+  *reinterpret_cast<uint64_t*>(data + 0x08) = num_nodes;
+  *reinterpret_cast<uint64_t*>(data + 0x10) = num_edges;
+  *reinterpret_cast<uint64_t*>(data + 0x18) = env.type_objects.size();
+  memcpy(data, "PMTGRF01", 8);
+
+  return std::unique_ptr<ObjectGraph>(new ObjectGraph(std::move(file)));
+}
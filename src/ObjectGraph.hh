@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+
+#include "MemoryReader.hh"
+#include "Types/Base.hh"
+
+// The reference graph of all valid objects of known types, in compressed sparse row form. Objects are identified by
+// dense ids, assigned in address order. For each object, the ids of the objects it refers to (referents) and of the
+// objects that refer to it (referrers) are stored contiguously and in increasing order. References to addresses that
+// aren't valid objects of known types are not included.
+//
+// The graph is stored in a file next to the snapshot and used directly from the memory-mapped file, so it only needs
+// to be built once per snapshot. The file format is:
+//   /* 00 */ char magic[8]; // "PMTGRF01"
+//   /* 08 */ uint64_t node_count; // N
+//   /* 10 */ uint64_t edge_count; // E
+//   /* 18 */ uint64_t type_count; // Number of known types when the graph was built
+//   /* 20 */ uint8_t unused[0x20];
+//   /* 40 */ uint64_t addrs[N]; // Sorted
+//   /* -- */ uint64_t referent_offsets[N + 1]; // Indexes into referent_ids
+//   /* -- */ uint64_t referrer_offsets[N + 1]; // Indexes into referrer_ids
+//   /* -- */ uint32_t referent_ids[E];
+//   /* -- */ uint32_t referrer_ids[E];
+class ObjectGraph {
+public:
+  static constexpr uint32_t INVALID_ID = 0xFFFFFFFF;
+
+  // Loads a previously-built graph
+  explicit ObjectGraph(const std::string& filename);
+  ObjectGraph(const ObjectGraph&) = delete;
+  ObjectGraph(ObjectGraph&&) = delete;
+  ObjectGraph& operator=(const ObjectGraph&) = delete;
+  ObjectGraph& operator=(ObjectGraph&&) = delete;
+  ~ObjectGraph() = default;
+
+  // Finds all objects and their references, and writes the graph to filename. Edges are collected in per-thread
+  // buffers and placed with a parallel counting sort; if the buffers would use more than memory_limit bytes, they're
+  // discarded and the referents are computed a second time and written directly into the mapped file instead, so
+  // memory usage is bounded by a few bytes per object regardless of the number of edges.
+  static std::unique_ptr<ObjectGraph> build(
+      const Environment& env, const std::string& filename, size_t num_threads, size_t memory_limit);
+
+  // Returns the filename used for the given snapshot's graph
+  static std::string filename_for_environment(const Environment& env);
+
+  inline size_t node_count() const {
+    return this->num_nodes;
+  }
+  inline size_t edge_count() const {
+    return this->num_edges;
+  }
+  inline size_t type_count() const {
+    return this->num_types;
+  }
+
+  inline MappedPtr<PyObject> addr_for_id(uint32_t id) const {
+    return MappedPtr<PyObject>{this->addrs[id]};
+  }
+  // Returns INVALID_ID if there's no object at addr in the graph
+  uint32_t id_for_addr(MappedPtr<void> addr) const;
+
+  inline std::span<const uint32_t> referents(uint32_t id) const {
+    return std::span<const uint32_t>(
+        this->referent_ids + this->referent_offsets[id], this->referent_ids + this->referent_offsets[id + 1]);
+  }
+  inline std::span<const uint32_t> referrers(uint32_t id) const {
+    return std::span<const uint32_t>(
+        this->referrer_ids + this->referrer_offsets[id], this->referrer_ids + this->referrer_offsets[id + 1]);
+  }
+
+  // Calls fn(begin_id, end_id, thread_index) for consecutive ranges of ids in parallel. Throws scan_cancelled if the
+  // environment's reader is cancelled during the call. If fn throws, the other threads stop after their current
+  // ranges, and the exception is rethrown on the calling thread.
+  static void parallel_ranges(const MemoryReader& r, size_t count, size_t num_threads,
+      const std::function<void(size_t, size_t, size_t)>& fn);
+
+private:
+  static constexpr size_t HEADER_SIZE = 0x40;
+
+  ObjectGraph(MemoryMappedFile&& file);
+  void parse_file();
+
+  MemoryMappedFile file;
+  size_t num_nodes;
+  size_t num_edges;
+  size_t num_types;
+  const uint64_t* addrs;
+  const uint64_t* referent_offsets;
+  const uint64_t* referrer_offsets;
+  const uint32_t* referent_ids;
+  const uint32_t* referrer_ids;
+};
@@ -0,0 +1,78 @@
+#include "OrderedOutput.hh"
+
+#include <algorithm>
+#include <format>
+#include <phosg/Filesystem.hh>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+
+OrderedOutput::OrderedOutput(size_t num_threads, Order order) : order(order) {
+  this->buffers.resize(num_threads);
+}
+
+OrderedOutput::Order OrderedOutput::parse_order(const std::string& name) {
+  if (name.empty() || (name == "address")) {
+    return Order::ADDRESS;
+  } else if (name == "repr") {
+    return Order::TEXT;
+  } else {
+    throw std::invalid_argument(std::format("Invalid sort order: {}", name));
+  }
+}
+
+size_t OrderedOutput::size() const {
+  size_t ret = 0;
+  for (const auto& buffer : this->buffers) {
+    ret += buffer.size();
+  }
+  return ret;
+}
+
+void OrderedOutput::write(FILE* f) {
+  using EntryT = std::pair<uint64_t, std::string>;
+  auto less = [&](const EntryT& a, const EntryT& b) -> bool {
+    if (this->order == Order::TEXT) {
+      return (a.second != b.second) ? (a.second < b.second) : (a.first < b.first);
+    } else {
+      return a < b;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (auto& buffer : this->buffers) {
+    if (buffer.size() > 1) {
+      threads.emplace_back([&buffer, &less]() -> void {
+        std::sort(buffer.begin(), buffer.end(), less);
+      });
+    }
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // k-way merge; the heap holds (buffer index, entry index) for the next unwritten entry of each buffer
+  auto greater = [&](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) -> bool {
+    return less(this->buffers[b.first][b.second], this->buffers[a.first][a.second]);
+  };
+  std::priority_queue<std::pair<size_t, size_t>, std::vector<std::pair<size_t, size_t>>, decltype(greater)> heap(greater);
+  for (size_t z = 0; z < this->buffers.size(); z++) {
+    if (!this->buffers[z].empty()) {
+      heap.emplace(z, 0);
+    }
+  }
+  while (!heap.empty()) {
+    auto [buffer_index, entry_index] = heap.top();
+    heap.pop();
+    const auto& buffer = this->buffers[buffer_index];
+    phosg::fwritex(f, buffer[entry_index].second);
+    if (entry_index + 1 < buffer.size()) {
+      heap.emplace(buffer_index, entry_index + 1);
+    }
+  }
+
+  for (auto& buffer : this->buffers) {
+    buffer.clear();
+    buffer.shrink_to_fit();
+  }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Collects results from a parallel scan in per-thread buffers, so workers never block on the console, then writes
+// them all at the end in a deterministic order. Without this, the order of results depends on thread scheduling.
+class OrderedOutput {
+public:
+  enum class Order {
+    ADDRESS = 0, // By key (usually the object's address), then by text
+    TEXT, // By text, then by key
+  };
+
+  OrderedOutput(size_t num_threads, Order order = Order::ADDRESS);
+  OrderedOutput(const OrderedOutput&) = delete;
+  OrderedOutput(OrderedOutput&&) = delete;
+  OrderedOutput& operator=(const OrderedOutput&) = delete;
+  OrderedOutput& operator=(OrderedOutput&&) = delete;
+  ~OrderedOutput() = default;
+
+  // Parses the value of a --sort option ("address" or "repr")
+  static Order parse_order(const std::string& name);
+
+  inline void add(size_t thread_index, uint64_t key, std::string&& text) {
+    this->buffers[thread_index].emplace_back(key, std::move(text));
+  }
+
+  size_t size() const;
+
+  // Sorts each thread's buffer in parallel, then merges them into f. The buffers are empty afterward.
+  void write(FILE* f);
+
+private:
+  Order order;
+  std::vector<std::vector<std::pair<uint64_t, std::string>>> buffers;
+};
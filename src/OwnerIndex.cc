@@ -0,0 +1,131 @@
+#include "OwnerIndex.hh"
+
+#include <algorithm>
+#include <phosg/Strings.hh>
+#include <thread>
+#include <unordered_map>
+
+#include "Common.hh"
+#include "ScanProgress.hh"
+#include "Types/PyDictObject.hh"
+#include "Types/PyObject.hh"
+#include "Types/PyTypeObject.hh"
+
+OwnerIndex::OwnerIndex(const Environment& env, size_t num_threads) {
+  if (num_threads == 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+
+  auto name_for_type = env.names_for_types();
+  auto dict_type = env.get_type_if_exists("dict");
+  std::vector<std::vector<Interval>> thread_intervals(num_threads);
+  std::vector<std::unordered_map<uint64_t, MappedPtr<PyObject>>> thread_shared_keys_owners(num_threads);
+  {
+    ScanProgress progress;
+    auto& num_objects = progress.add_counter("objects");
+    env.r.map_all_addresses<PyObject>(
+        [&](const PyObject& obj, MappedPtr<PyObject> addr, size_t thread_index) -> void {
+          if (!name_for_type.count(obj.ob_type) || env.invalid_reason(addr)) {
+            return;
+          }
+          try {
+            auto extents = env.object_extents(addr);
+            auto& intervals = thread_intervals[thread_index];
+            intervals.emplace_back(
+                Interval{extents.start.addr, extents.start.addr + extents.size, addr, IntervalKind::OBJECT});
+            for (const auto& [buffer_addr, buffer_size] : extents.buffers) {
+              intervals.emplace_back(
+                  Interval{buffer_addr.addr, buffer_addr.addr + buffer_size, addr, IntervalKind::BUFFER});
+            }
+
+            // If this is an instance with a split __dict__, its keys table is shared with the other instances of its
+            // class; remember it so it can be indexed once, under the class
+            // TODO: Support negative tp_dictoffset here
+            const auto& type_obj = env.r.get(obj.ob_type);
+            if (type_obj.is_heap_type() && (type_obj.tp_dictoffset > 0)) {
+              auto dict_addr = env.r.get(addr.offset_bytes(type_obj.tp_dictoffset).cast<MappedPtr<PyDictObject>>());
+              if (env.r.obj_valid(dict_addr) && (env.r.get(dict_addr).ob_type == dict_type)) {
+                const auto& dict = env.r.get(dict_addr);
+                if (!dict.ma_values.is_null() && env.r.obj_valid(dict.ma_keys) &&
+                    (env.r.get(dict.ma_keys).dk_refcnt != 1)) {
+                  thread_shared_keys_owners[thread_index].emplace(dict.ma_keys.addr, obj.ob_type.cast<PyObject>());
+                }
+              }
+            }
+            num_objects.fetch_add(1, std::memory_order_relaxed);
+          } catch (const std::out_of_range&) {
+          }
+        },
+        8, num_threads, &progress);
+    phosg::fwrite_fmt(stderr, CLEAR_LINE);
+  }
+
+  std::unordered_map<uint64_t, MappedPtr<PyObject>> shared_keys_owners;
+  for (auto& owners : thread_shared_keys_owners) {
+    shared_keys_owners.merge(owners);
+    owners.clear();
+  }
+  std::vector<Interval> shared_keys_intervals;
+  for (const auto& [keys_addr, type_addr] : shared_keys_owners) {
+    try {
+      size_t size = env.r.get(MappedPtr<PyDictKeysObject>{keys_addr}).allocated_size();
+      shared_keys_intervals.emplace_back(
+          Interval{keys_addr, keys_addr + size, type_addr, IntervalKind::SHARED_DICT_KEYS});
+    } catch (const std::out_of_range&) {
+    }
+  }
+  thread_intervals.emplace_back(std::move(shared_keys_intervals));
+
+  size_t num_skipped = 0;
+  for (auto& intervals : thread_intervals) {
+    for (const auto& interval : intervals) {
+      if ((interval.end <= interval.start) ||
+          !env.r.exists_range(MappedPtr<void>{interval.start}, interval.end - interval.start)) {
+        num_skipped++;
+      } else if (interval.end - interval.start > LARGE_INTERVAL_SIZE) {
+        this->large_intervals.intervals.emplace_back(interval);
+      } else {
+        this->small_intervals.intervals.emplace_back(interval);
+      }
+    }
+    intervals.clear();
+    intervals.shrink_to_fit();
+  }
+  this->small_intervals.sort();
+  this->large_intervals.sort();
+  if (num_skipped) {
+    phosg::fwrite_fmt(stderr, "Warning: skipped {} objects or buffers that extend past readable memory\n", num_skipped);
+  }
+}
+
+void OwnerIndex::SortedIntervals::sort() {
+  std::sort(this->intervals.begin(), this->intervals.end(), [](const Interval& a, const Interval& b) -> bool {
+    return (a.start != b.start) ? (a.start < b.start) : (a.end < b.end);
+  });
+  this->max_end.clear();
+  this->max_end.reserve(this->intervals.size());
+  uint64_t max_end = 0;
+  for (const auto& interval : this->intervals) {
+    max_end = std::max<uint64_t>(max_end, interval.end);
+    this->max_end.emplace_back(max_end);
+  }
+}
+
+void OwnerIndex::SortedIntervals::find(std::vector<const Interval*>& ret, uint64_t addr) const {
+  // Find the last interval that starts at or before addr, then walk backward until no earlier interval can reach addr
+  auto it = std::upper_bound(this->intervals.begin(), this->intervals.end(), addr,
+      [](uint64_t addr, const Interval& interval) -> bool { return addr < interval.start; });
+  for (size_t z = it - this->intervals.begin(); (z > 0) && (this->max_end[z - 1] > addr); z--) {
+    const auto& interval = this->intervals[z - 1];
+    if (interval.end > addr) {
+      ret.emplace_back(&interval);
+    }
+  }
+}
+
+std::vector<const OwnerIndex::Interval*> OwnerIndex::owners_of(MappedPtr<void> addr) const {
+  std::vector<const Interval*> ret;
+  this->small_intervals.find(ret, addr.addr);
+  this->large_intervals.find(ret, addr.addr);
+  return ret;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "Types/Base.hh"
+
+// Maps arbitrary addresses to the objects that contain them. Each valid object of a known type contributes an interval
+// for its own allocation (including its GC header, if any) and one for each of its out-of-line buffers, as returned by
+// Environment::object_extents. The keys tables shared by split instance dicts aren't owned by any one dict, so they're
+// indexed under the class whose instances use them. Intervals are kept sorted by start address, so lookups are a
+// binary search. Intervals that aren't entirely within readable memory (from corrupt or stale objects) are skipped,
+// and intervals larger than LARGE_INTERVAL_SIZE are kept in a separate list, so that neither can make lookups walk
+// over large parts of the index.
+class OwnerIndex {
+public:
+  static constexpr uint64_t LARGE_INTERVAL_SIZE = 0x100000;
+
+  enum class IntervalKind : uint8_t {
+    OBJECT = 0, // The owner's own allocation
+    BUFFER, // An out-of-line buffer owned by the owner
+    SHARED_DICT_KEYS, // A keys table shared by the split __dict__s of instances of the owner (a type)
+  };
+
+  struct Interval {
+    uint64_t start;
+    uint64_t end; // Exclusive
+    MappedPtr<PyObject> owner;
+    IntervalKind kind;
+  };
+
+  explicit OwnerIndex(const Environment& env, size_t num_threads);
+  OwnerIndex(const OwnerIndex&) = delete;
+  OwnerIndex(OwnerIndex&&) = delete;
+  OwnerIndex& operator=(const OwnerIndex&) = delete;
+  OwnerIndex& operator=(OwnerIndex&&) = delete;
+  ~OwnerIndex() = default;
+
+  inline size_t size() const {
+    return this->small_intervals.intervals.size() + this->large_intervals.intervals.size();
+  }
+
+  // Returns all intervals that contain addr. There is usually at most one, but corrupt or stale objects may overlap
+  // live ones.
+  std::vector<const Interval*> owners_of(MappedPtr<void> addr) const;
+
+private:
+  struct SortedIntervals {
+    std::vector<Interval> intervals; // Sorted by start
+    std::vector<uint64_t> max_end; // max_end[z] is the largest end of intervals[0] through intervals[z]
+
+    void sort();
+    void find(std::vector<const Interval*>& ret, uint64_t addr) const;
+  };
+  SortedIntervals small_intervals;
+  SortedIntervals large_intervals;
+};
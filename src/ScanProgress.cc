@@ -0,0 +1,76 @@
+#include "ScanProgress.hh"
+
+#include <format>
+#include <phosg/Strings.hh>
+#include <stdexcept>
+
+#include "Common.hh"
+
+ScanProgress::Format ScanProgress::format = ScanProgress::Format::LINE;
+bool ScanProgress::verbose = false;
+
+ScanProgress::Format ScanProgress::parse_format(const std::string& name) {
+  if (name.empty() || (name == "line")) {
+    return Format::LINE;
+  } else if (name == "json") {
+    return Format::JSON;
+  } else if (name == "none") {
+    return Format::NONE;
+  } else {
+    throw std::invalid_argument(std::format("Invalid progress format: {}", name));
+  }
+}
+
+std::atomic<size_t>& ScanProgress::add_counter(const std::string& name) {
+  auto& counter = this->counters.emplace_back();
+  counter.name = name;
+  return counter.value;
+}
+
+std::string ScanProgress::format_counters_line() const {
+  std::string ret;
+  for (const auto& counter : this->counters) {
+    ret += std::format(", {} {}", counter.value.load(std::memory_order_relaxed), counter.name);
+  }
+  return ret;
+}
+
+std::string ScanProgress::format_counters_json() const {
+  std::string ret = "{";
+  for (const auto& counter : this->counters) {
+    if (ret.size() > 1) {
+      ret.push_back(',');
+    }
+    ret += std::format("\"{}\":{}", counter.name, counter.value.load(std::memory_order_relaxed));
+  }
+  ret.push_back('}');
+  return ret;
+}
+
+void ScanProgress::update(uint64_t current_addr, size_t current_region, size_t num_regions, uint64_t bytes_done,
+    uint64_t total_bytes) {
+  float progress = static_cast<float>(bytes_done) / static_cast<float>(total_bytes);
+  switch (ScanProgress::format) {
+    case Format::LINE:
+      phosg::fwrite_fmt(stderr, "... {:016X} ({}/{} regions, {}/{}, {:g}%{})" CLEAR_LINE_TO_END "\r",
+          current_addr, current_region, num_regions, phosg::format_size(bytes_done), phosg::format_size(total_bytes),
+          progress * 100.0f, this->format_counters_line());
+      break;
+    case Format::JSON:
+      phosg::fwrite_fmt(stderr,
+          "{{\"event\":\"progress\",\"address\":\"{:016X}\",\"region\":{},\"regions\":{},\"bytes_done\":{},\"total_bytes\":{},\"counters\":{}}}\n",
+          current_addr, current_region, num_regions, bytes_done, total_bytes, this->format_counters_json());
+      break;
+    case Format::NONE:
+      break;
+  }
+}
+
+void ScanProgress::finish(uint64_t total_bytes, size_t num_regions) {
+  // The line format doesn't need a final update; callers clear the status line before printing their results
+  if (ScanProgress::format == Format::JSON) {
+    phosg::fwrite_fmt(stderr,
+        "{{\"event\":\"done\",\"regions\":{},\"total_bytes\":{},\"counters\":{}}}\n",
+        num_regions, total_bytes, this->format_counters_json());
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <string>
+
+// Progress reporting for memory scans. Scan workers bump named counters without locking; only the scan's
+// coordinating thread renders them, at most once per update interval, as a status line or a stream of JSON objects
+// on stderr. Per-object diagnostics should be printed only if verbose is set.
+class ScanProgress {
+public:
+  enum class Format {
+    LINE = 0, // Single status line, overwritten in place
+    JSON, // One JSON object per line
+    NONE,
+  };
+
+  // These are set from the command line and apply to all scans
+  static Format format;
+  static bool verbose;
+
+  static Format parse_format(const std::string& name);
+
+  ScanProgress() = default;
+  ScanProgress(const ScanProgress&) = delete;
+  ScanProgress(ScanProgress&&) = delete;
+  ScanProgress& operator=(const ScanProgress&) = delete;
+  ScanProgress& operator=(ScanProgress&&) = delete;
+  ~ScanProgress() = default;
+
+  // Adds a counter that's displayed along with the scan position. The returned reference remains valid for the
+  // lifetime of this object; workers should increment it with relaxed ordering.
+  std::atomic<size_t>& add_counter(const std::string& name);
+
+  // Called by the coordinating thread during and after a scan
+  void update(uint64_t current_addr, size_t current_region, size_t num_regions, uint64_t bytes_done,
+      uint64_t total_bytes);
+  void finish(uint64_t total_bytes, size_t num_regions);
+
+private:
+  struct Counter {
+    std::string name;
+    std::atomic<size_t> value{0};
+  };
+  std::deque<Counter> counters;
+
+  std::string format_counters_line() const;
+  std::string format_counters_json() const;
+};
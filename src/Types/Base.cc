@@ -49,6 +49,14 @@ void Environment::save_analysis() const {
   phosg::save_file(this->analysis_filename, json.serialize());
 }
 
+std::unordered_map<MappedPtr<PyTypeObject>, std::string> Environment::names_for_types() const {
+  std::unordered_map<MappedPtr<PyTypeObject>, std::string> ret;
+  for (const auto& [name, type] : this->type_objects) {
+    ret.emplace(type, name);
+  }
+  return ret;
+}
+
 const char* Environment::invalid_reason(MappedPtr<PyObject> addr, MappedPtr<PyTypeObject> expected_type) const {
   if (addr.is_null()) {
     return "null_obj_ptr";
@@ -79,6 +87,8 @@ const char* Environment::invalid_reason(MappedPtr<PyObject> addr, MappedPtr<PyTy
       return this->r.get(addr.cast<PyFloatObject>()).invalid_reason(*this);
     } else if (obj.ob_type == this->get_type_if_exists("bytes")) {
       return this->r.get(addr.cast<PyBytesObject>()).invalid_reason(*this);
+    } else if (obj.ob_type == this->get_type_if_exists("bytearray")) {
+      return this->r.get(addr.cast<PyByteArrayObject>()).invalid_reason(*this);
     } else if (obj.ob_type == this->get_type_if_exists("str")) {
       return this->r.get(addr.cast<PyASCIIStringObject>()).invalid_reason(*this);
 
@@ -174,6 +184,8 @@ std::unordered_set<MappedPtr<void>> Environment::direct_referents(MappedPtr<PyOb
       return this->r.get(addr.cast<PyFloatObject>()).direct_referents(*this);
     } else if (obj.ob_type == this->get_type_if_exists("bytes")) {
       return this->r.get(addr.cast<PyBytesObject>()).direct_referents(*this);
+    } else if (obj.ob_type == this->get_type_if_exists("bytearray")) {
+      return this->r.get(addr.cast<PyByteArrayObject>()).direct_referents(*this);
     } else if (obj.ob_type == this->get_type_if_exists("str")) {
       return this->r.get(addr.cast<PyASCIIStringObject>()).direct_referents(*this);
 
@@ -253,6 +265,153 @@ std::unordered_set<MappedPtr<void>> Environment::direct_referents(MappedPtr<PyOb
   }
 }
 
+size_t Environment::shallow_size(MappedPtr<PyObject> addr) const {
+  const auto& obj = this->r.get(addr);
+  const auto& type_obj = this->r.get(obj.ob_type);
+  size_t ret = type_obj.tp_basicsize;
+  if (type_obj.tp_itemsize > 0) {
+    // ob_size is negative for negative ints, so use its magnitude
+    int64_t num_items = this->r.get(addr.cast<PyVarObject>()).ob_size;
+    ret += type_obj.tp_itemsize * ((num_items < 0) ? -num_items : num_items);
+  }
+  return ret;
+}
+
+ObjectExtents Environment::object_extents(MappedPtr<PyObject> addr) const {
+  const auto& obj = this->r.get(addr);
+  const auto& type_obj = this->r.get(obj.ob_type);
+
+  ObjectExtents ret;
+  ret.start = addr.cast<void>();
+  ret.size = this->shallow_size(addr);
+
+  if (obj.ob_type == this->get_type_if_exists("str")) {
+    // str has tp_itemsize == 0, so shallow_size doesn't account for the inline data of compact strings
+    const auto& str = this->r.get(addr.cast<PyASCIIStringObject>());
+    size_t data_bytes = (str.length + 1) * str.char_kind();
+    if (str.is_compact() && str.is_ascii()) {
+      ret.size = sizeof(PyASCIIStringObject) + data_bytes;
+    } else if (str.is_compact()) {
+      const auto& compact_str = this->r.get(addr.cast<PyCompactStringObject>());
+      ret.size = sizeof(PyCompactStringObject) + data_bytes;
+      if (!compact_str.utf8.is_null()) {
+        ret.buffers.emplace_back(compact_str.utf8.cast<void>(), compact_str.utf8_length + 1);
+      }
+    } else {
+      const auto& gen_str = this->r.get(addr.cast<PyGeneralStringObject>());
+      if (!gen_str.data.is_null()) {
+        ret.buffers.emplace_back(gen_str.data, data_bytes);
+      }
+      if (!gen_str.utf8.is_null() && (gen_str.utf8.addr != gen_str.data.addr)) {
+        ret.buffers.emplace_back(gen_str.utf8.cast<void>(), gen_str.utf8_length + 1);
+      }
+    }
+
+  } else if (obj.ob_type == this->get_type_if_exists("dict")) {
+    const auto& dict = this->r.get(addr.cast<PyDictObject>());
+    if (!dict.ma_keys.is_null()) {
+      const auto& keys = this->r.get(dict.ma_keys);
+      // The entries array holds USABLE_FRACTION(dk_size) entries; see new_keys_object in dictobject.c
+      size_t num_entries = (keys.dk_size * 2) / 3;
+      if (dict.ma_values.is_null()) {
+        // Combined table. Its keys object is owned by this dict, unless it's the shared static empty keys object
+        if (keys.dk_refcnt == 1) {
+          ret.buffers.emplace_back(dict.ma_keys.cast<void>(), keys.allocated_size());
+        }
+      } else {
+        // Split table; the keys are shared with the other instances of the same class, but the values are not
+        ret.buffers.emplace_back(dict.ma_values.cast<void>(), sizeof(MappedPtr<PyObject>) * num_entries);
+      }
+    }
+
+  } else if (obj.ob_type == this->get_type_if_exists("bytearray")) {
+    const auto& bytearray = this->r.get(addr.cast<PyByteArrayObject>());
+    if (!bytearray.ob_bytes.is_null()) {
+      ret.buffers.emplace_back(bytearray.ob_bytes.cast<void>(), bytearray.ob_alloc);
+    }
+
+  } else if (obj.ob_type == this->get_type_if_exists("list")) {
+    const auto& list = this->r.get(addr.cast<PyListObject>());
+    if (!list.ob_item.is_null()) {
+      ret.buffers.emplace_back(list.ob_item.cast<void>(), sizeof(MappedPtr<PyObject>) * list.allocated);
+    }
+
+  } else if ((obj.ob_type == this->get_type_if_exists("set")) ||
+      (obj.ob_type == this->get_type_if_exists("frozenset"))) {
+    // Small sets use the smalltable, which immediately follows the fixed fields and is included in tp_basicsize
+    const auto& set = this->r.get(addr.cast<PySetObject>());
+    if (set.table.addr != addr.offset_bytes(sizeof(PySetObject)).addr) {
+      ret.buffers.emplace_back(set.table.cast<void>(), sizeof(PySetObject::Entry) * (set.mask + 1));
+    }
+  }
+
+  if (type_obj.is_gc()) {
+    ret.start = ret.start.offset_bytes(-0x10);
+    ret.size += 0x10;
+  }
+  return ret;
+}
+
+// Returns the size of the combined-table keys object that a new dict would allocate for num_items items. dk_size is
+// the smallest power of 2 (at least 8) whose usable fraction holds all the items; see new_keys_object in dictobject.c
+static size_t min_dict_keys_size(size_t num_items) {
+  PyDictKeysObject keys{};
+  keys.dk_size = 8;
+  while ((keys.dk_size * 2) / 3 < num_items) {
+    keys.dk_size <<= 1;
+  }
+  return sizeof(PyDictKeysObject) + keys.bytes_per_table_value() * keys.dk_size +
+      sizeof(PyDictKeyEntry) * ((keys.dk_size * 2) / 3);
+}
+
+size_t Environment::container_slack(MappedPtr<PyObject> addr) const {
+  const auto& obj = this->r.get(addr);
+
+  if (obj.ob_type == this->get_type_if_exists("dict")) {
+    const auto& dict = this->r.get(addr.cast<PyDictObject>());
+    if (dict.ma_keys.is_null()) {
+      return 0;
+    }
+    const auto& keys = this->r.get(dict.ma_keys);
+    size_t num_entries = (keys.dk_size * 2) / 3;
+    size_t used = (dict.ma_used > 0) ? dict.ma_used : 0;
+    if (!dict.ma_values.is_null()) {
+      // Split table: only the values array belongs to this dict, and its size is determined by the shared keys
+      return sizeof(MappedPtr<PyObject>) * ((num_entries > used) ? (num_entries - used) : 0);
+    }
+    if (keys.dk_refcnt != 1) {
+      return 0; // Shared empty keys object; see object_extents
+    }
+    size_t table_size = keys.allocated_size();
+    size_t min_size = min_dict_keys_size(used);
+    return (table_size > min_size) ? (table_size - min_size) : 0;
+
+  } else if (obj.ob_type == this->get_type_if_exists("list")) {
+    const auto& list = this->r.get(addr.cast<PyListObject>());
+    size_t used = (list.ob_size > 0) ? list.ob_size : 0;
+    return (list.allocated > used) ? (sizeof(MappedPtr<PyObject>) * (list.allocated - used)) : 0;
+
+  } else if ((obj.ob_type == this->get_type_if_exists("set")) ||
+      (obj.ob_type == this->get_type_if_exists("frozenset"))) {
+    // Sets that fit in the smalltable have no separate buffer. Otherwise, a new set's table is the smallest power of 2
+    // that keeps the fill below 60%; see set_table_resize in setobject.c
+    const auto& set = this->r.get(addr.cast<PySetObject>());
+    if (set.table.addr == addr.offset_bytes(sizeof(PySetObject)).addr) {
+      return 0;
+    }
+    size_t used = (set.used > 0) ? set.used : 0;
+    size_t min_entries = 8;
+    while (used * 5 >= min_entries * 3) {
+      min_entries <<= 1;
+    }
+    size_t table_size = sizeof(PySetObject::Entry) * (set.mask + 1);
+    size_t min_size = (min_entries == 8) ? 0 : (sizeof(PySetObject::Entry) * min_entries);
+    return (table_size > min_size) ? (table_size - min_size) : 0;
+  }
+
+  return 0;
+}
+
 Traversal Environment::traverse(phosg::Arguments* args) const {
   return Traversal(*this, args);
 }
@@ -312,6 +471,8 @@ std::string Traversal::repr(MappedPtr<PyObject> addr) {
     } else if (obj.ob_type == this->env.get_type_if_exists("bytes")) {
       ret = check_valid_and_repr.template operator()<PyBytesObject>();
       show_address = this->show_all_addresses || this->in_progress.empty();
+    } else if (obj.ob_type == this->env.get_type_if_exists("bytearray")) {
+      ret = check_valid_and_repr.template operator()<PyByteArrayObject>();
     } else if (obj.ob_type == this->env.get_type_if_exists("str")) {
       ret = check_valid_and_repr.template operator()<PyASCIIStringObject>();
       show_address = this->show_all_addresses || this->in_progress.empty();
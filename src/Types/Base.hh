@@ -5,6 +5,7 @@
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "../MemoryReader.hh"
 
@@ -20,6 +21,25 @@ public:
   const char* reason;
 };
 
+// The memory used by one object: its own allocation (including the GC header, if the type has one) and any
+// separately-allocated buffers that belong only to it, such as a list's item array or a dict's keys table.
+struct ObjectExtents {
+  MappedPtr<void> start; // Before addr if the object has a GC header
+  size_t size = 0;
+  std::vector<std::pair<MappedPtr<void>, size_t>> buffers;
+
+  inline size_t buffers_size() const {
+    size_t ret = 0;
+    for (const auto& it : this->buffers) {
+      ret += it.second;
+    }
+    return ret;
+  }
+  inline size_t total_size() const {
+    return this->size + this->buffers_size();
+  }
+};
+
 struct Environment {
   std::string data_path;
   std::string analysis_filename;
@@ -49,9 +69,24 @@ struct Environment {
     }
   }
 
+  // Inverse of type_objects, for fast lookup during scans
+  std::unordered_map<MappedPtr<PyTypeObject>, std::string> names_for_types() const;
+
   const char* invalid_reason(
       MappedPtr<PyObject> addr, MappedPtr<PyTypeObject> expected_type = MappedPtr<PyTypeObject>{0}) const;
   std::unordered_set<MappedPtr<void>> direct_referents(MappedPtr<PyObject> addr) const;
+  // Returns the size of the object's own allocation, as described by its type (tp_basicsize, plus tp_itemsize for
+  // each item if the type is variable-size). Throws std::out_of_range if the object or its type is unreadable.
+  size_t shallow_size(MappedPtr<PyObject> addr) const;
+  // Returns the object's full memory usage: its shallow size, GC header, and out-of-line buffers for the types whose
+  // layout python-memtools knows (str, bytearray, dict, list, and set). Buffers shared with other objects (e.g. a dict
+  // keys table referenced by several split dicts) aren't included. Throws std::out_of_range if anything is unreadable.
+  ObjectExtents object_extents(MappedPtr<PyObject> addr) const;
+  // Returns the number of bytes in the object's out-of-line buffers that aren't needed for its current contents: the
+  // difference between the buffer sizes in object_extents and the sizes CPython would allocate for a new container
+  // holding the same number of items (so a dict that was once huge and then drained reports nearly its whole table).
+  // Returns 0 for objects that aren't dicts, lists, or sets. Throws std::out_of_range if anything is unreadable.
+  size_t container_slack(MappedPtr<PyObject> addr) const;
 
   Traversal traverse(phosg::Arguments* args = nullptr) const; // Can't be inlined because Traversal is incomplete here
 };
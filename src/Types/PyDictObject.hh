@@ -33,6 +33,13 @@ struct PyDictKeysObject {
     }
   }
 
+  // Returns the size of the keys object's allocation: the header, the index table, and the entries array, which holds
+  // USABLE_FRACTION(dk_size) entries (see new_keys_object in dictobject.c)
+  inline size_t allocated_size() const {
+    return sizeof(PyDictKeysObject) + this->bytes_per_table_value() * this->dk_size +
+        sizeof(PyDictKeyEntry) * ((this->dk_size * 2) / 3);
+  }
+
   const char* invalid_reason(const Environment& env) const;
   std::string repr(Traversal& t) const;
 };
@@ -59,8 +66,7 @@ struct PyDictObject : PyObject {
     // TODO: This is slow. We should only call get_items when we actually need all the items.
     for (auto it : this->get_items(r)) {
       try {
-        DecodedString key_dec = decode_string_types(r, it.first);
-        if (key_dec.data == key) {
+        if (string_equals(r, it.first, key)) {
           return it.second.cast<T>();
         }
       } catch (const invalid_object&) {
@@ -1,4 +1,11 @@
 #include "PyStringObjects.hh"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <string.h>
+
 #include "Base.hh"
 
 std::string escape_string_data(const void* data, size_t size, bool is_str, size_t excess_bytes) {
@@ -32,43 +39,162 @@ std::string escape_string_data(const void* data, size_t size, bool is_str, size_
   return ret;
 }
 
+// Returns the code unit at index in string data of the given kind. Like the rest of python-memtools, this assumes
+// the snapshot is of a little-endian process.
+static inline uint32_t load_code_unit(const uint8_t* data, size_t index, uint8_t kind) {
+  if (kind == 1) {
+    return data[index];
+  } else if (kind == 2) {
+    uint16_t ret;
+    memcpy(&ret, data + index * 2, sizeof(ret));
+    return ret;
+  } else {
+    uint32_t ret;
+    memcpy(&ret, data + index * 4, sizeof(ret));
+    return ret;
+  }
+}
+
+// Returns the number of leading code units in data (at most count) that are ASCII. kind is the size of each code
+// unit, as in PyASCIIStringObject::char_kind.
+static size_t count_ascii_prefix(const uint8_t* data, size_t count, uint8_t kind) {
+  size_t z = 0;
+#ifdef __SSE2__
+  // Check 16 bytes at a time: a code unit is ASCII if none of its bits above the low 7 are set
+  __m128i high_mask;
+  if (kind == 1) {
+    high_mask = _mm_set1_epi8(static_cast<char>(0x80));
+  } else if (kind == 2) {
+    high_mask = _mm_set1_epi16(static_cast<short>(0xFF80));
+  } else {
+    high_mask = _mm_set1_epi32(static_cast<int>(0xFFFFFF80));
+  }
+  size_t units_per_block = 16 / kind;
+  for (; z + units_per_block <= count; z += units_per_block) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + z * kind));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, high_mask), _mm_setzero_si128())) != 0xFFFF) {
+      break;
+    }
+  }
+#endif
+  for (; z < count; z++) {
+    if (load_code_unit(data, z, kind) >= 0x80) {
+      break;
+    }
+  }
+  return z;
+}
+
+// Writes the UTF-8 encoding of ch to out, and returns the number of bytes written (at most 4)
+static size_t encode_utf8(uint32_t ch, uint8_t* out) {
+  if (ch < 0x80) {
+    out[0] = ch;
+    return 1;
+  } else if (ch < 0x800) {
+    out[0] = 0xC0 | ((ch >> 6) & 0x1F);
+    out[1] = 0x80 | (ch & 0x3F);
+    return 2;
+  } else if (ch < 0x10000) {
+    out[0] = 0xE0 | ((ch >> 12) & 0x0F);
+    out[1] = 0x80 | ((ch >> 6) & 0x3F);
+    out[2] = 0x80 | (ch & 0x3F);
+    return 3;
+  } else if (ch < 0x110000) {
+    out[0] = 0xF0 | ((ch >> 18) & 0x07);
+    out[1] = 0x80 | ((ch >> 12) & 0x3F);
+    out[2] = 0x80 | ((ch >> 6) & 0x3F);
+    out[3] = 0x80 | (ch & 0x3F);
+    return 4;
+  } else {
+    throw std::out_of_range("Invalid UCS character");
+  }
+}
+
+// Appends the UTF-8 encoding of code units from data to out, stopping after count code units or once out is at least
+// max_size bytes long, and returns the number of code units encoded. There's a separate instance of this for each
+// kind so that the per-character work is just a load and a compare. Where an ASCII character begins a block of 16
+// bytes of ASCII code units, the block is narrowed and copied at once; text with few or no ASCII characters (CJK,
+// Cyrillic, etc.) never attempts a block, so it isn't slowed down by the ASCII fast path.
+template <uint8_t Kind>
+static size_t append_utf8(std::string& out, const uint8_t* data, size_t count, size_t max_size) {
+  // UCS1 code units take at most 2 bytes in UTF-8, UCS2 at most 3, and UCS4 at most 4
+  static constexpr size_t MAX_BYTES_PER_UNIT = (Kind == 1) ? 2 : ((Kind == 2) ? 3 : 4);
+  size_t out_offset = out.size();
+  size_t out_limit = max_size - out_offset;
+  // The last character may go up to 3 bytes past out_limit
+  size_t out_capacity = count * MAX_BYTES_PER_UNIT;
+  if (out_limit < out_capacity) {
+    out_capacity = out_limit + 3;
+  }
+  out.resize(out_offset + out_capacity);
+  uint8_t* out_data = reinterpret_cast<uint8_t*>(out.data() + out_offset);
+
+  size_t z = 0;
+  size_t w = 0;
+  while ((z < count) && (w < out_limit)) {
+    uint32_t ch = load_code_unit(data, z, Kind);
+    if (ch >= 0x80) {
+      w += encode_utf8(ch, out_data + w);
+      z++;
+      continue;
+    }
+#ifdef __SSE2__
+    static constexpr size_t UNITS_PER_BLOCK = 16 / Kind;
+    if ((z + UNITS_PER_BLOCK <= count) && (w + UNITS_PER_BLOCK <= out_limit)) {
+      // A code unit is ASCII if none of its bits above the low 7 are set
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + z * Kind));
+      __m128i high_mask;
+      if constexpr (Kind == 1) {
+        high_mask = _mm_set1_epi8(static_cast<char>(0x80));
+      } else if constexpr (Kind == 2) {
+        high_mask = _mm_set1_epi16(static_cast<short>(0xFF80));
+      } else {
+        high_mask = _mm_set1_epi32(static_cast<int>(0xFFFFFF80));
+      }
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, high_mask), _mm_setzero_si128())) == 0xFFFF) {
+        if constexpr (Kind == 1) {
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(out_data + w), v);
+        } else if constexpr (Kind == 2) {
+          _mm_storel_epi64(reinterpret_cast<__m128i*>(out_data + w), _mm_packus_epi16(v, v));
+        } else {
+          __m128i v16 = _mm_packs_epi32(v, v);
+          _mm_storeu_si32(out_data + w, _mm_packus_epi16(v16, v16));
+        }
+        z += UNITS_PER_BLOCK;
+        w += UNITS_PER_BLOCK;
+        continue;
+      }
+    }
+#endif
+    out_data[w++] = ch;
+    z++;
+  }
+  out.resize(out_offset + w);
+  return z;
+}
+
 static DecodedString decode_ucs(phosg::StringReader r, uint8_t ucs_type, size_t max_len) {
+  if ((ucs_type != 1) && (ucs_type != 2) && (ucs_type != 4)) {
+    throw std::logic_error("Invalid UCS encoding type");
+  }
   if (r.size() & (ucs_type - 1)) {
     throw std::runtime_error("Invalid UCS string length");
   }
 
+  size_t count = r.size() / ucs_type;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(r.getv(r.size()));
+
   DecodedString ret;
-  while (!r.eof() && (!max_len || (ret.data.size() < max_len))) {
-    uint32_t ch;
-    if (ucs_type == 1) {
-      ch = r.get_u8();
-    } else if (ucs_type == 2) {
-      ch = r.get_u16l();
-    } else if (ucs_type == 4) {
-      ch = r.get_u32l();
-    } else {
-      throw std::logic_error("Invalid UCS encoding type");
-    }
-
-    if (ch < 0x80) {
-      ret.data.push_back(ch);
-    } else if (ch < 0x800) {
-      ret.data.push_back(0xC0 | ((ch >> 6) & 0x1F));
-      ret.data.push_back(0x80 | (ch & 0x3F));
-    } else if (ch < 0x10000) {
-      ret.data.push_back(0xE0 | ((ch >> 12) & 0x0F));
-      ret.data.push_back(0x80 | ((ch >> 6) & 0x3F));
-      ret.data.push_back(0x80 | (ch & 0x3F));
-    } else if (ch < 0x110000) {
-      ret.data.push_back(0xF0 | ((ch >> 18) & 0x07));
-      ret.data.push_back(0x80 | ((ch >> 12) & 0x3F));
-      ret.data.push_back(0x80 | ((ch >> 6) & 0x3F));
-      ret.data.push_back(0x80 | (ch & 0x3F));
-    } else {
-      throw std::out_of_range("Invalid UCS character");
-    }
+  size_t max_size = max_len ? max_len : SIZE_MAX;
+  size_t z;
+  if (ucs_type == 1) {
+    z = append_utf8<1>(ret.data, data, count, max_size);
+  } else if (ucs_type == 2) {
+    z = append_utf8<2>(ret.data, data, count, max_size);
+  } else {
+    z = append_utf8<4>(ret.data, data, count, max_size);
   }
-  ret.excess_bytes = r.remaining();
+  ret.excess_bytes = (count - z) * ucs_type;
   return ret;
 }
 
@@ -108,6 +234,73 @@ DecodedString decode_string_types(const MemoryReader& r, MappedPtr<PyObject> add
   }
 }
 
+phosg::StringReader read_string_storage(const MemoryReader& r, MappedPtr<PyObject> addr) {
+  const auto& obj = r.get(addr.cast<PyASCIIStringObject>());
+  MappedPtr<void> data_addr;
+  if (obj.is_compact() && obj.is_ascii()) {
+    data_addr = addr.offset_bytes(sizeof(PyASCIIStringObject));
+  } else if (obj.is_compact()) {
+    data_addr = addr.offset_bytes(sizeof(PyCompactStringObject));
+  } else {
+    data_addr = r.get(addr.cast<PyGeneralStringObject>()).data;
+  }
+  if (obj.length == 0) {
+    return phosg::StringReader();
+  }
+  try {
+    return r.read(data_addr, obj.length * obj.char_kind());
+  } catch (const std::out_of_range&) {
+    throw invalid_object("invalid_str_data");
+  }
+}
+
+bool string_equals(const MemoryReader& r, MappedPtr<PyObject> addr, const std::string& needle) {
+  const auto& obj = r.get(addr.cast<PyASCIIStringObject>());
+  // Every code point takes at least one byte in UTF-8, and ASCII code points take exactly one
+  if ((obj.length > needle.size()) || (obj.is_ascii() && (obj.length != needle.size()))) {
+    return false;
+  }
+  auto data_r = read_string_storage(r, addr);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(data_r.getv(data_r.size()));
+  uint8_t kind = obj.char_kind();
+  if ((kind != 1) && (kind != 2) && (kind != 4)) {
+    throw invalid_object("invalid_char_kind");
+  }
+  if (obj.is_ascii()) {
+    return !memcmp(data, needle.data(), needle.size());
+  }
+
+  const uint8_t* needle_data = reinterpret_cast<const uint8_t*>(needle.data());
+  size_t needle_offset = 0;
+  for (size_t z = 0; z < obj.length;) {
+    // Compare runs of ASCII characters without encoding them
+    size_t run = count_ascii_prefix(data + z * kind, obj.length - z, kind);
+    if (needle_offset + run > needle.size()) {
+      return false;
+    }
+    for (size_t end_z = z + run; z < end_z; z++, needle_offset++) {
+      if (load_code_unit(data, z, kind) != needle_data[needle_offset]) {
+        return false;
+      }
+    }
+    if (z < obj.length) {
+      uint8_t encoded[4];
+      size_t encoded_size;
+      try {
+        encoded_size = encode_utf8(load_code_unit(data, z, kind), encoded);
+      } catch (const std::out_of_range&) {
+        throw invalid_object("invalid_unicode_str_data");
+      }
+      if ((needle_offset + encoded_size > needle.size()) || memcmp(needle_data + needle_offset, encoded, encoded_size)) {
+        return false;
+      }
+      needle_offset += encoded_size;
+      z++;
+    }
+  }
+  return needle_offset == needle.size();
+}
+
 static std::string repr_string_types(Traversal& t, MappedPtr<PyObject> addr) {
   try {
     auto ret = decode_string_types(t.env.r, addr, t.max_string_length);
@@ -135,38 +328,82 @@ phosg::StringReader PyBytesObject::read_contents() const {
   return phosg::StringReader(this->data, this->ob_size);
 }
 
+// Returns the repr of bytes or bytearray contents, without the bytearray(...) wrapper
+static std::string repr_bytes_data(Traversal& t, phosg::StringReader r) {
+  if (t.bytes_as_hex) {
+    if (t.max_string_length && (r.size() > t.max_string_length)) {
+      return std::format(
+          "bytes.fromhex(\'{}\'...<0x{:X} more bytes>)",
+          phosg::format_data_string(r.getv(r.size()), t.max_string_length, nullptr, phosg::FormatDataFlags::HEX_ONLY),
+          r.size() - t.max_string_length);
+    } else {
+      return std::format(
+          "bytes.fromhex(\'{}\')",
+          phosg::format_data_string(r.getv(r.size()), r.size(), nullptr, phosg::FormatDataFlags::HEX_ONLY));
+    }
+  } else {
+    size_t excess_bytes = 0;
+    if (t.max_string_length && (r.size() > t.max_string_length)) {
+      excess_bytes = r.size() - t.max_string_length;
+      r.truncate(t.max_string_length);
+    }
+    return escape_string_data(r.getv(r.size()), r.size(), false, excess_bytes);
+  }
+}
+
 std::string PyBytesObject::repr(Traversal& t) const {
   if (const char* ir = t.check_valid(*this)) {
     return std::format("<bytes !{}>", ir);
   }
   try {
-    auto r = this->read_contents();
-    std::string ret;
-    if (t.bytes_as_hex) {
-      if (t.max_string_length && (r.size() > t.max_string_length)) {
-        ret = std::format(
-            "bytes.fromhex(\'{}\'...<0x{:X} more bytes>)",
-            phosg::format_data_string(r.getv(r.size()), t.max_string_length, nullptr, phosg::FormatDataFlags::HEX_ONLY),
-            r.size() - t.max_string_length);
-      } else {
-        ret = std::format(
-            "bytes.fromhex(\'{}\')",
-            phosg::format_data_string(r.getv(r.size()), r.size(), nullptr, phosg::FormatDataFlags::HEX_ONLY));
-      }
-    } else {
-      size_t excess_bytes = 0;
-      if (t.max_string_length && (r.size() > t.max_string_length)) {
-        excess_bytes = r.size() - t.max_string_length;
-        r.truncate(t.max_string_length);
-      }
-      ret = escape_string_data(r.getv(r.size()), r.size(), false, excess_bytes);
-    }
-    return ret;
+    return repr_bytes_data(t, this->read_contents());
   } catch (const std::out_of_range&) {
     return std::format("<bytes !unreadable_data>");
   }
 }
 
+const char* PyByteArrayObject::invalid_reason(const Environment& env) const {
+  if (const char* ir = this->PyVarObject::invalid_reason(env)) {
+    return ir;
+  }
+  if (this->ob_size < 0) {
+    return "negative_size";
+  }
+  if (this->ob_exports < 0) {
+    return "negative_exports";
+  }
+  if (this->ob_bytes.is_null()) {
+    return (this->ob_size || this->ob_alloc || !this->ob_start.is_null()) ? "null_bytes_with_size" : nullptr;
+  }
+  // ob_start may be after ob_bytes if bytes have been removed from the beginning; there's always a trailing null
+  if ((this->ob_start.addr < this->ob_bytes.addr) ||
+      (this->ob_start.addr + this->ob_size + 1 > this->ob_bytes.addr + this->ob_alloc)) {
+    return "start_out_of_range";
+  }
+  if (!env.r.exists_range(this->ob_bytes, this->ob_alloc)) {
+    return "invalid_bytes";
+  }
+  return nullptr;
+}
+
+std::string PyByteArrayObject::repr(Traversal& t) const {
+  if (const char* ir = t.check_valid(*this)) {
+    return std::format("<bytearray !{}>", ir);
+  }
+  try {
+    return std::format("bytearray({})", repr_bytes_data(t, this->read_contents(t.env.r)));
+  } catch (const std::out_of_range&) {
+    return std::format("<bytearray !unreadable_data>");
+  }
+}
+
+phosg::StringReader PyByteArrayObject::read_contents(const MemoryReader& r) const {
+  if (this->ob_size == 0) {
+    return phosg::StringReader();
+  }
+  return r.read(this->ob_start, this->ob_size);
+}
+
 const char* PyASCIIStringObject::invalid_reason(const Environment& env) const {
   if (const char* ir = this->PyObject::invalid_reason(env)) {
     return ir;
@@ -14,6 +14,20 @@ struct PyBytesObject : PyVarObject {
   phosg::StringReader read_contents() const;
 };
 
+// See https://github.com/python/cpython/blob/3.10/Include/cpython/bytearrayobject.h
+struct PyByteArrayObject : PyVarObject {
+  int64_t ob_alloc; // Bytes allocated at ob_bytes
+  MappedPtr<char> ob_bytes; // Null if nothing has been allocated yet
+  MappedPtr<char> ob_start; // Logical start of the contents; may be after ob_bytes
+  int64_t ob_exports; // Number of exported buffers (memoryviews etc.)
+
+  const char* invalid_reason(const Environment& env) const;
+  // direct_referents inherited from PyVarObject
+  std::string repr(Traversal& t) const;
+
+  phosg::StringReader read_contents(const MemoryReader& r) const;
+};
+
 // See https://github.com/python/cpython/blob/3.10/Include/cpython/unicodeobject.h for this and the following structs
 struct PyASCIIStringObject : PyObject {
   uint64_t length; // Number of code points, not number of bytes!
@@ -64,4 +78,14 @@ struct DecodedString {
 };
 DecodedString decode_string_types(const MemoryReader& r, MappedPtr<PyObject> addr, size_t max_len = 0);
 
+// Returns the code units of a str object as they're stored in memory (UCS1, UCS2, or UCS4, according to its
+// char_kind), without a null terminator and without decoding them. Since CPython always uses the narrowest kind that
+// can represent a string, two strings are equal if and only if they have the same kind and the same stored data.
+phosg::StringReader read_string_storage(const MemoryReader& r, MappedPtr<PyObject> addr);
+
+// Returns true if the str object at addr is equal to needle (which must be UTF-8). This compares the string's stored
+// form directly, so it doesn't allocate or decode the whole string. Throws invalid_object if the string's data isn't
+// readable.
+bool string_equals(const MemoryReader& r, MappedPtr<PyObject> addr, const std::string& needle);
+
 std::string escape_string_data(const void* data, size_t size, bool is_str, size_t excess_bytes = 0);
@@ -18,6 +18,9 @@ struct PyMemberDef {
 
 // See struct _typeobject in https://github.com/python/cpython/blob/3.10/Include/cpython/object.h
 struct PyTypeObject : PyVarObject {
+  static constexpr unsigned long Py_TPFLAGS_HEAPTYPE = (1UL << 9);
+  static constexpr unsigned long Py_TPFLAGS_HAVE_GC = (1UL << 14);
+
   /* 0000 */ MappedPtr<char> tp_name;
   /* 0008 */ int64_t tp_basicsize;
   /* 0010 */ int64_t tp_itemsize;
@@ -80,6 +83,16 @@ struct PyTypeObject : PyVarObject {
   }
   std::string repr(Traversal& t) const;
 
+  // Objects of GC types are preceded in memory by a PyGC_Head (two pointers)
+  inline bool is_gc() const {
+    return this->tp_flags & Py_TPFLAGS_HAVE_GC;
+  }
+  // Heap types are created at runtime (usually by class statements); others are static in the interpreter or an
+  // extension module, and live forever
+  inline bool is_heap_type() const {
+    return this->tp_flags & Py_TPFLAGS_HEAPTYPE;
+  }
+
   static bool type_name_is_valid(const std::string& name);
   std::string name(const MemoryReader& r) const;
 